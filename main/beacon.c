@@ -0,0 +1,196 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "lwip/sockets.h"
+#include "esp_wifi.h"
+#include "esp_mac.h"
+#include "esp_app_desc.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "mc.h"
+
+static char const *LOG_TAG = "mc|beacon";
+
+/* A small fixed-size status packet, multicast every
+   CONFIG_WLM_BEACON_PERIOD_S seconds and whenever the motor, tank or beep
+   state changes, so that a monitoring host can follow a whole fleet of units
+   by listening (tools/beacon_listener.py) instead of polling each one's
+   /mc_status over TCP.
+
+   All fields are little endian. The layout only ever grows at the end;
+   anything else bumps BEACON_VERSION. tools/beacon_listener.py has a copy of
+   it. */
+#define BEACON_MAGIC "MB"
+#define BEACON_VERSION 1
+
+/* Bits of `state` */
+#define BEACON_MOTOR_RUNNING 0x01
+#define BEACON_TANK_FULL 0x02
+#define BEACON_BEEPING 0x04
+
+struct beacon_t_ {
+  char magic[2];
+  uint8_t version;
+  uint8_t state;		/* BEACON_* bits */
+  uint8_t unit_id[6];		/* station MAC address */
+  uint16_t seq;			/* to spot lost beacons */
+  char firmware_version[16];	/* NUL padded, truncated if longer */
+  uint32_t uptime_s;
+  int8_t rssi;			/* dBm */
+  uint8_t status;		/* bit per active enum status_code_t_ */
+  uint32_t free_heap;
+  uint32_t min_free_heap;
+  uint32_t motor_on_s;		/* uptime at the last motor start, 0 if none yet */
+  uint32_t motor_off_s;		/* uptime at the last motor stop, 0 if none yet */
+  uint32_t tank_full_s;		/* uptime at the last tank full, 0 if none yet */
+  uint32_t epoch;		/* wall clock, 0 if the time was never set */
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct beacon_t_) == 58, "beacon layout changed");
+
+/* A burst of state changes (e.g. motor off, beep off and tank full at
+   once) goes out as one beacon, at most this often */
+#define BEACON_MIN_GAP_MS 1000
+
+static TaskHandle_t beacon_task_handle = NULL;
+static uint32_t beacons_sent = 0;
+static uint32_t beacons_failed = 0;
+
+/* Called by the motor, tank level and beep tasks when their state changes,
+   and by wifi.c when it gets an IP, to have a beacon go out now rather than
+   at the next period */
+void beacon_notify (void) {
+  if (beacon_task_handle) {
+    xTaskNotifyGive(beacon_task_handle);
+  }
+}
+
+void beacon_get_stats (uint32_t *sent, uint32_t *failed) {
+  *sent = beacons_sent;
+  *failed = beacons_failed;
+}
+
+#ifdef CONFIG_WLM_BEACON
+
+static int fd_socket = -1;
+static struct sockaddr_in beacon_addr;
+
+static bool open_socket (void) {
+  uint8_t ttl = 1; /* the local network only */
+
+  fd_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd_socket < 0) {
+    ESP_LOGE(LOG_TAG, "Failed to create socket for the beacon: %s", strerror(errno));
+    fd_socket = -1;
+    return false;
+  }
+  if (setsockopt(fd_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+    ESP_LOGE(LOG_TAG, "Failed to set the multicast TTL: %s", strerror(errno));
+  }
+
+  /* Prepare the beacon_addr which will be used in the sendto() call */
+  memset(&beacon_addr, 0, sizeof(beacon_addr));
+
+  beacon_addr.sin_family = AF_INET;
+  inet_pton(AF_INET, CONFIG_WLM_BEACON_IPV4_ADDRESS, &(beacon_addr.sin_addr));
+  beacon_addr.sin_port = htons(CONFIG_WLM_BEACON_PORT);
+  ESP_LOGI(LOG_TAG, "Sending beacons to %s:%d", CONFIG_WLM_BEACON_IPV4_ADDRESS,
+	   CONFIG_WLM_BEACON_PORT);
+  return true;
+}
+
+void beacon_task (void *param) {
+  struct mc_task_args_t_ *mc_task_args = (struct mc_task_args_t_ *) param;
+  struct beacon_t_ beacon;
+  wifi_ap_record_t ap_info;
+  EventBits_t bits;
+  TickType_t last_sent = 0;
+  uint32_t now_s, motor_on_s = 0, motor_off_s = 0, tank_full_s = 0;
+  uint8_t state, seen_state = 0, last_state = 0;
+  uint16_t seq = 0;
+  bool periodic_due, sent_any = false, failing = false;
+  time_t now;
+
+  beacon_task_handle = xTaskGetCurrentTaskHandle();
+
+  memset(&beacon, 0, sizeof(beacon));
+  memcpy(beacon.magic, BEACON_MAGIC, sizeof(beacon.magic));
+  beacon.version = BEACON_VERSION;
+  esp_read_mac(beacon.unit_id, ESP_MAC_WIFI_STA);
+  strncpy(beacon.firmware_version, esp_app_get_description()->version,
+	  sizeof(beacon.firmware_version));
+
+  while (pdTRUE) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_WLM_BEACON_PERIOD_S * 1000));
+
+    bits = xEventGroupGetBits(mc_task_args->mc_event_group);
+    state = ((bits & EVENT_MOTOR_RUNNING) ? BEACON_MOTOR_RUNNING : 0) |
+      ((bits & EVENT_OH_TANK_FULL) ? BEACON_TANK_FULL : 0) |
+      ((bits & EVENT_BEEPING) ? BEACON_BEEPING : 0);
+    now_s = esp_timer_get_time() / 1000000;
+    if ((state & ~seen_state) & BEACON_MOTOR_RUNNING) {
+      motor_on_s = now_s;
+    }
+    if ((~state & seen_state) & BEACON_MOTOR_RUNNING) {
+      motor_off_s = now_s;
+    }
+    if ((state & ~seen_state) & BEACON_TANK_FULL) {
+      tank_full_s = now_s;
+    }
+    seen_state = state;
+    periodic_due = ((xTaskGetTickCount() - last_sent) >=
+		    pdMS_TO_TICKS(CONFIG_WLM_BEACON_PERIOD_S * 1000));
+    if ((state == last_state) && !periodic_due && sent_any) {
+      continue;
+    }
+
+    /* Nothing to send on while the wifi is down. The socket stays open
+       across wifi outages. last_state is only the state a beacon went out
+       with, so a change seen meanwhile is sent once the wifi is back. */
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+      continue;
+    }
+    if ((fd_socket == -1) && !open_socket()) {
+      continue;
+    }
+
+    time(&now);
+    beacon.state = state;
+    beacon.seq = seq++;
+    beacon.uptime_s = now_s;
+    beacon.rssi = ap_info.rssi;
+    beacon.status = status_get();
+    beacon.free_heap = esp_get_free_heap_size();
+    beacon.min_free_heap = esp_get_minimum_free_heap_size();
+    beacon.motor_on_s = motor_on_s;
+    beacon.motor_off_s = motor_off_s;
+    beacon.tank_full_s = tank_full_s;
+    /* Anything before 2020 means the time was never set */
+    beacon.epoch = (now > 1577836800) ? (uint32_t) now : 0;
+
+    if (0 > sendto(fd_socket, &beacon, sizeof(beacon), 0, (struct sockaddr *) &beacon_addr,
+		   sizeof(beacon_addr))) {
+      /* Once per streak of failures, or a dead network would flood the log */
+      if (!failing) {
+	ESP_LOGE(LOG_TAG, "sendto() failed: %s", strerror(errno));
+	failing = true;
+      }
+      beacons_failed++;
+    } else {
+      beacons_sent++;
+      failing = false;
+      last_state = state;
+    }
+    last_sent = xTaskGetTickCount();
+    sent_any = true;
+
+    vTaskDelay(pdMS_TO_TICKS(BEACON_MIN_GAP_MS));
+  }
+}
+
+#endif
@@ -2,33 +2,32 @@
 #include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
-#include "driver/gpio.h"
+#include "freertos/event_groups.h"
 #include "esp_log.h"
-#include "pins.h"
 #include "mc.h"
+#include "trace.h"
 
 static char const *LOG_TAG = "mc|beep";
 
-static void make_some_noise (void) {
-  BaseType_t i;
-  for (i = 0; i < 4; i++) {
-    gpio_set_level(BEEP_OUT, 1);
-    vTaskDelay(pdMS_TO_TICKS(150));
-    gpio_set_level(BEEP_OUT, 0);
-    vTaskDelay(pdMS_TO_TICKS(100));
-  }
-}
+/* Four short beeps, a second of quiet, and over again until the beep is
+   turned off. Played by pattern.c, so a beep-off takes effect right away,
+   even in the middle of a beep. */
+static struct pattern_step_t_ const tank_full_beeps[] = {
+  {150, 100}, {150, 100}, {150, 100}, {150, 1100},
+};
 
 void beep_task (void *param) {
   bool current_state, desired_state;
   QueueHandle_t beep_q = ((struct mc_task_args_t_ *) param)->beep_q;
+  EventGroupHandle_t mc_event_group = ((struct mc_task_args_t_ *) param)->mc_event_group;
   
   current_state = false;
 
   /* Loop forever, looking for enqueues to the beep_q */
   while (1) {
     desired_state = false;
-    if (pdTRUE == xQueueReceive(beep_q, (void *) &desired_state, pdMS_TO_TICKS(1000))) {
+    if (pdTRUE == xQueueReceive(beep_q, (void *) &desired_state, portMAX_DELAY)) {
+      MC_TRACE(TRACE_BEEP_Q_RECV, desired_state);
       /* Something was enqueued */
       if (desired_state == current_state) {
 	/* Nothing to do */
@@ -39,18 +38,19 @@ void beep_task (void *param) {
       if (desired_state == true) {
 	/* turn beep on */
 	ESP_LOGI(LOG_TAG, "setting beep on");
-	make_some_noise();
+	power_lock(POWER_LOCK_BEEP);
+	pattern_play(PATTERN_BEEP, tank_full_beeps,
+		     sizeof(tank_full_beeps) / sizeof(tank_full_beeps[0]));
+	xEventGroupSetBits(mc_event_group, EVENT_BEEPING);
       } else {
 	/* turn beep off */
 	ESP_LOGI(LOG_TAG, "setting beep off");
-	gpio_set_level(BEEP_OUT, 0);
+	pattern_stop(PATTERN_BEEP);
+	power_unlock(POWER_LOCK_BEEP);
+	xEventGroupClearBits(mc_event_group, EVENT_BEEPING);
       }
       current_state = desired_state;
-    } else {
-      /* Timed out without receiving anything on the queue */
-      if (current_state == true) {
-	make_some_noise();
-      }
+      beacon_notify();
     }
   }
 }
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "esp_log.h"
+#include "mc.h"
+#include "tank_filter.h"
+#include "io.h"
+
+#ifdef CONFIG_WLM_BENCH
+
+static char const *LOG_TAG = "mc|bench";
+
+/* Microbenchmarks of the hot paths, timed with the CPU cycle counter, to
+   compare builds (e.g. -Os against -O2, see sdkconfig.bench_perf). Each
+   case runs CONFIG_WLM_BENCH_ITERATIONS times and reports the min, median
+   and max; the min is the cost of the code itself, the max includes
+   whatever interrupts and higher priority tasks took along the way.
+
+   The run holds the CPU at its full clock, so that cycles convert to time
+   at a fixed rate. It runs on the core of the calling task; the cycle
+   counter is per core, so the caller has to be pinned (app_main and the
+   HTTP async workers are). */
+#define BENCH_ITERATIONS CONFIG_WLM_BENCH_ITERATIONS
+#define BENCH_OTA_BLOCK_SIZE 4096
+#define BENCH_OTA_BLOCKS 16	/* 64KB of the update partition */
+
+struct bench_case_t_ {
+  char const *name;
+  /* Fill in up to `n` samples, return how many (0 to skip the case) */
+  size_t (*run)(struct mc_task_args_t_ *mc_task_args, uint32_t *cycles, size_t n);
+};
+
+/* One reading into the tank filter, as every second while the motor runs.
+   The readings alternate, so the filter never stops counting. */
+static size_t bench_tank_filter (struct mc_task_args_t_ *mc_task_args, uint32_t *cycles,
+				 size_t n) {
+  struct tank_filter_config_t_ config = TANK_FILTER_DEFAULT_CONFIG;
+  struct tank_filter_t_ filter;
+  uint32_t start;
+  size_t i;
+
+  tank_filter_init(&filter, &config);
+  for (i = 0; i < n; i++) {
+    start = esp_cpu_get_cycle_count();
+    tank_filter_sample(&filter, i & 1);
+    cycles[i] = esp_cpu_get_cycle_count() - start;
+  }
+  return n;
+}
+
+/* Reading the inputs, as the motor and tank level tasks do every loop. The
+   first read in a tick reads the input registers, the others copy the
+   snapshot, so the max is the register read and the median the copy. */
+static size_t bench_io_snapshot (struct mc_task_args_t_ *mc_task_args, uint32_t *cycles,
+				 size_t n) {
+  struct io_snapshot_t_ inputs;
+  uint32_t start;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    start = esp_cpu_get_cycle_count();
+    io_snapshot(&inputs);
+    cycles[i] = esp_cpu_get_cycle_count() - start;
+  }
+  return n;
+}
+
+/* Formatting one typical log line, and sending it to the UDP logging host
+   if that is up */
+static size_t bench_udp_log_line (struct mc_task_args_t_ *mc_task_args, uint32_t *cycles,
+				  size_t n) {
+  uint32_t start;
+  size_t i;
+  bool sent = false;
+
+  for (i = 0; i < n; i++) {
+    start = esp_cpu_get_cycle_count();
+    sent = udp_logging_bench_line("I (%lu) mc|oh_tank_level: GPIO now = %s, full reports "
+				  "in last %u readings = %u\n", (unsigned long) i,
+				  (i & 1) ? "full" : "not full", 10U, (unsigned) (i % 10));
+    cycles[i] = esp_cpu_get_cycle_count() - start;
+  }
+  if (!sent) {
+    ESP_LOGW(LOG_TAG, "UDP logging is not up, udp_log_line only timed the formatting");
+  }
+  return n;
+}
+
+static size_t bench_status_response (struct mc_task_args_t_ *mc_task_args, uint32_t *cycles,
+				     size_t n) {
+  char response[20 + 1];
+  uint32_t start;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    start = esp_cpu_get_cycle_count();
+    http_format_status(xEventGroupGetBits(mc_task_args->mc_event_group), response,
+		       sizeof(response));
+    cycles[i] = esp_cpu_get_cycle_count() - start;
+  }
+  return n;
+}
+
+/* Mostly the flash reads of the app descriptions */
+static size_t bench_version_info_response (struct mc_task_args_t_ *mc_task_args,
+					   uint32_t *cycles, size_t n) {
+  char *response;
+  uint32_t start;
+  size_t i;
+
+  response = malloc(VERSION_INFO_RESPONSE_SIZE + 1);
+  if (!response) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    start = esp_cpu_get_cycle_count();
+    http_format_version_info(response);
+    cycles[i] = esp_cpu_get_cycle_count() - start;
+  }
+  free(response);
+  return n;
+}
+
+#ifdef CONFIG_WLM_BENCH_OTA_WRITE
+static size_t bench_ota_write (struct mc_task_args_t_ *mc_task_args, uint32_t *cycles,
+			       size_t n) {
+  uint8_t *block;
+
+  block = malloc(BENCH_OTA_BLOCK_SIZE);
+  if (!block) {
+    return 0;
+  }
+  memset(block, 0xa5, BENCH_OTA_BLOCK_SIZE);
+  n = ota_bench_write(block, BENCH_OTA_BLOCK_SIZE, cycles,
+		      (n < BENCH_OTA_BLOCKS) ? n : BENCH_OTA_BLOCKS);
+  free(block);
+  return n;
+}
+#endif
+
+static struct bench_case_t_ const bench_cases[] = {
+  { "tank_filter_sample", bench_tank_filter },
+  { "io_snapshot", bench_io_snapshot },
+  { "udp_log_line", bench_udp_log_line },
+  { "status_response", bench_status_response },
+  { "version_info_response", bench_version_info_response },
+#ifdef CONFIG_WLM_BENCH_OTA_WRITE
+  { "esp_ota_write_4k", bench_ota_write },
+#endif
+};
+
+static portMUX_TYPE bench_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool bench_running = false;
+
+static int compare_cycles (void const *a, void const *b) {
+  uint32_t x = *(uint32_t const *) a, y = *(uint32_t const *) b;
+
+  return (x > y) - (x < y);
+}
+
+static char const *optimization_name (void) {
+#if defined(CONFIG_COMPILER_OPTIMIZATION_PERF)
+  return "-O2";
+#elif defined(CONFIG_COMPILER_OPTIMIZATION_SIZE)
+  return "-Os";
+#elif defined(CONFIG_COMPILER_OPTIMIZATION_NONE)
+  return "-O0";
+#else
+  return "-Og";
+#endif
+}
+
+/* Run all the cases and write the report into `buf`:
+     build=<optimization> cpu_mhz=<n> iterations=<n>
+     <case> runs=<n> min_cycles=<n> median_cycles=<n> max_cycles=<n>
+       min_us=... median_us=... max_us=...
+   (one line per case). Returns the length of the report, or -1 if a run is
+   already going on, a buffer could not be allocated, or the report does not
+   fit. */
+int bench_run (struct mc_task_args_t_ *mc_task_args, char *buf, size_t len) {
+  uint32_t *cycles, mhz;
+  size_t runs, i;
+  int n, written = -1;
+  bool busy;
+
+  taskENTER_CRITICAL(&bench_lock);
+  busy = bench_running;
+  bench_running = true;
+  taskEXIT_CRITICAL(&bench_lock);
+  if (busy) {
+    ESP_LOGW(LOG_TAG, "A benchmark run is already in progress");
+    return -1;
+  }
+
+  cycles = malloc(BENCH_ITERATIONS * sizeof(uint32_t));
+  if (!cycles) {
+    ESP_LOGE(LOG_TAG, "Unable to allocate %d samples", BENCH_ITERATIONS);
+    goto done;
+  }
+
+  power_lock(POWER_LOCK_BENCH);
+  mhz = esp_rom_get_cpu_ticks_per_us();
+  written = snprintf(buf, len, "build=%s cpu_mhz=%lu iterations=%d\n", optimization_name(),
+		     (unsigned long) mhz, BENCH_ITERATIONS);
+  for (i = 0; (i < sizeof(bench_cases) / sizeof(bench_cases[0])) && (written >= 0) &&
+	 (written < (int) len); i++) {
+    runs = bench_cases[i].run(mc_task_args, cycles, BENCH_ITERATIONS);
+    if (runs == 0) {
+      n = snprintf(buf + written, len - written, "%s skipped\n", bench_cases[i].name);
+    } else {
+      qsort(cycles, runs, sizeof(uint32_t), compare_cycles);
+      n = snprintf(buf + written, len - written,
+		   "%s runs=%u min_cycles=%lu median_cycles=%lu max_cycles=%lu "
+		   "min_us=%.2f median_us=%.2f max_us=%.2f\n", bench_cases[i].name,
+		   (unsigned) runs, (unsigned long) cycles[0],
+		   (unsigned long) cycles[runs / 2], (unsigned long) cycles[runs - 1],
+		   (double) cycles[0] / mhz, (double) cycles[runs / 2] / mhz,
+		   (double) cycles[runs - 1] / mhz);
+    }
+    written = (n < 0) ? n : written + n;
+  }
+  power_unlock(POWER_LOCK_BENCH);
+  free(cycles);
+
+  if ((written < 0) || (written >= (int) len)) {
+    ESP_LOGE(LOG_TAG, "Buffer too small for the benchmark report");
+    written = -1;
+  }
+
+ done:
+  taskENTER_CRITICAL(&bench_lock);
+  bench_running = false;
+  taskEXIT_CRITICAL(&bench_lock);
+  return written;
+}
+
+/* Run once at boot, from app_main, with the report in the log */
+void bench_run_at_boot (struct mc_task_args_t_ *mc_task_args) {
+  char *report, *line, *next;
+
+  report = malloc(BENCH_REPORT_SIZE);
+  if (!report) {
+    return;
+  }
+  ESP_LOGI(LOG_TAG, "Running the hot path benchmarks");
+  if (bench_run(mc_task_args, report, BENCH_REPORT_SIZE) > 0) {
+    for (line = report; *line; line = next) {
+      next = strchr(line, '\n');
+      if (!next) {
+	break;
+      }
+      *next++ = '\0';
+      ESP_LOGI(LOG_TAG, "%s", line);
+    }
+  }
+  free(report);
+}
+
+#endif
@@ -3,3 +3,5 @@
 #
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
 
+# The host backend of io.h, built by tools/control_host.c only
+COMPONENT_OBJEXCLUDE := io_mock.o
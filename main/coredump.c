@@ -0,0 +1,97 @@
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_core_dump.h"
+#include "mc.h"
+
+/* On a panic the core dump (ELF format) is written to the "coredump"
+   partition. It stays there until it is erased with DELETE /mc_coredump, so
+   the summary below is logged at every boot until then. Boot logs reach the
+   UDP logging host through the log ring. */
+static esp_partition_t const *coredump_partition = NULL;
+static size_t coredump_offset = 0; /* of the dump, within the partition */
+static char const *LOG_TAG = "mc|coredump";
+
+/* Returns true, and the size of the dump, if there is a valid one in flash */
+bool coredump_available (size_t *size) {
+  size_t addr;
+
+  if (!coredump_partition) {
+    coredump_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+						  ESP_PARTITION_SUBTYPE_DATA_COREDUMP,
+						  NULL);
+    if (!coredump_partition) {
+      return false;
+    }
+  }
+  if (esp_core_dump_image_get(&addr, size) != ESP_OK) {
+    return false;
+  }
+  coredump_offset = addr - coredump_partition->address;
+  return true;
+}
+
+/* Read `len` bytes of the dump at `offset`; coredump_available() must have
+   returned true before */
+bool coredump_read (size_t offset, void *buf, size_t len) {
+  if (!coredump_partition) {
+    return false;
+  }
+  return esp_partition_read(coredump_partition, coredump_offset + offset,
+			    buf, len) == ESP_OK;
+}
+
+bool coredump_erase (void) {
+  esp_err_t err;
+
+  err = esp_core_dump_image_erase();
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to erase core dump (%s)", esp_err_to_name(err));
+    return false;
+  }
+  ESP_LOGI(LOG_TAG, "Core dump erased");
+  return true;
+}
+
+/* Called from app_main */
+void coredump_report (void) {
+  esp_core_dump_summary_t *summary;
+  size_t size;
+  char bt[16 * 11 + 1];
+  int i, len = 0;
+
+  if (!coredump_available(&size)) {
+    return;
+  }
+
+  summary = malloc(sizeof(*summary));
+  if (!summary) {
+    ESP_LOGE(LOG_TAG, "Core dump of %u bytes in flash", (unsigned) size);
+    return;
+  }
+  if (esp_core_dump_get_summary(summary) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Core dump of %u bytes in flash, unable to read its summary",
+	     (unsigned) size);
+    free(summary);
+    return;
+  }
+
+  bt[0] = '\0';
+  for (i = 0; (i < (int) summary->exc_bt_info.depth) && (i < 16); i++) {
+    len += snprintf(bt + len, sizeof(bt) - len, " 0x%08" PRIx32,
+		    summary->exc_bt_info.bt[i]);
+  }
+  ESP_LOGE(LOG_TAG, "Core dump of %u bytes in flash, from firmware %.16s",
+	   (unsigned) size, (char const *) summary->app_elf_sha256);
+  ESP_LOGE(LOG_TAG, "Crashed in task \"%s\" at PC 0x%08" PRIx32
+	   ", exception cause %" PRIu32 ", address 0x%08" PRIx32,
+	   summary->exc_task, summary->exc_pc, summary->ex_info.exc_cause,
+	   summary->ex_info.exc_vaddr);
+  ESP_LOGE(LOG_TAG, "Backtrace:%s%s", bt,
+	   summary->exc_bt_info.corrupted ? " (corrupted)" : "");
+  ESP_LOGE(LOG_TAG, "Fetch it from /mc_coredump, and DELETE it from there once done");
+  free(summary);
+}
@@ -0,0 +1,125 @@
+#include <math.h>
+#include <string.h>
+#include "fill_model.h"
+
+/* The tank takes about the same time to fill on every run, so the probe does
+   not need reading every second from the start: it corrodes a little on
+   every read. The model keeps the mean and the variance of the fill times
+   (from the motor start to the filter turning the motor off) of past runs,
+   updated one run at a time with Welford's method, and splits a run in two:
+
+   - up to `mean - FILL_MODEL_FAST_SIGMAS * stddev - fast_lead_s`, the probe
+     is read every config.slow_period_s
+   - after that, it is read as often as the loop allows.
+
+   A run that goes on past `mean + FILL_MODEL_CUTOFF_SIGMAS * stddev` (but at
+   least FILL_MODEL_CUTOFF_MIN_RATIO times the mean, and never past
+   config.max_runtime_s) is cut off: the probe has most likely failed to see
+   the tank full.
+
+   A fill that ends early, when the tank was not empty at the motor start, is
+   seen as a full reading while the probe is read slowly, which switches to
+   fast reading at once. The tank then fills for at most slow_period_s
+   longer than it would have with the probe read fast all along.
+
+   Until config.min_runs fills are learned, the probe is read fast all along,
+   and the cutoff is config.max_runtime_s. Once config.max_runs fills are
+   learned, each new one weighs 1 / max_runs, so that the model follows slow
+   changes (e.g. in the supply pressure). */
+#define FILL_MODEL_FAST_SIGMAS 3
+#define FILL_MODEL_CUTOFF_SIGMAS 4
+#define FILL_MODEL_CUTOFF_MIN_RATIO 1.5f
+
+bool fill_model_init (struct fill_model_t_ *model,
+		      struct fill_model_config_t_ const *config) {
+  if ((config->min_runs == 0) || (config->max_runs < 2) ||
+      (config->min_runs > config->max_runs) || (config->slow_period_s == 0) ||
+      (config->max_runtime_s == 0)) {
+    return false;
+  }
+  model->config = *config;
+  fill_model_reset(model);
+  return true;
+}
+
+/* Forget all the fills learned */
+void fill_model_reset (struct fill_model_t_ *model) {
+  memset(&model->stats, 0, sizeof(model->stats));
+  model->stats.version = FILL_MODEL_VERSION;
+}
+
+/* Take over stats saved earlier (e.g. in NVS). Returns false, and leaves the
+   model as it was, if they do not look right. */
+bool fill_model_restore (struct fill_model_t_ *model,
+			 struct fill_model_stats_t_ const *stats) {
+  if ((stats->version != FILL_MODEL_VERSION) || (stats->runs > model->config.max_runs) ||
+      !isfinite(stats->mean_s) || !isfinite(stats->m2) ||
+      (stats->mean_s < 0) || (stats->m2 < 0)) {
+    return false;
+  }
+  model->stats = *stats;
+  return true;
+}
+
+/* Add the time one run took to fill the tank. Once the model is learned, a
+   fill that ended before the fast sampling started is left out: the tank was
+   not empty to begin with, and learning it would pull the cutoff down for
+   the fills that start from empty. Returns whether the fill was learned. */
+bool fill_model_learn (struct fill_model_t_ *model, uint32_t fill_s) {
+  struct fill_model_stats_t_ *stats = &model->stats;
+  float delta;
+
+  if (fill_model_learned(model) && (fill_s < fill_model_fast_after_s(model))) {
+    return false;
+  }
+  if (stats->runs < model->config.max_runs) {
+    stats->runs++;
+  } else {
+    /* Keep the weight of the history fixed, the oldest fills fade out */
+    stats->m2 -= stats->m2 / stats->runs;
+  }
+  delta = fill_s - stats->mean_s;
+  stats->mean_s += delta / stats->runs;
+  stats->m2 += delta * (fill_s - stats->mean_s);
+  return true;
+}
+
+bool fill_model_learned (struct fill_model_t_ const *model) {
+  return model->stats.runs >= model->config.min_runs;
+}
+
+float fill_model_stddev_s (struct fill_model_t_ const *model) {
+  if (model->stats.runs < 2) {
+    return 0;
+  }
+  return sqrtf(model->stats.m2 / (model->stats.runs - 1));
+}
+
+/* Time into a run from which the probe is read fast, 0 for all along */
+uint32_t fill_model_fast_after_s (struct fill_model_t_ const *model) {
+  float fast_after_s;
+
+  if (!fill_model_learned(model)) {
+    return 0;
+  }
+  fast_after_s = model->stats.mean_s - FILL_MODEL_FAST_SIGMAS * fill_model_stddev_s(model) -
+    model->config.fast_lead_s;
+  return (fast_after_s > 0) ? (uint32_t) fast_after_s : 0;
+}
+
+/* Time into a run at which the motor is turned off regardless */
+uint32_t fill_model_cutoff_s (struct fill_model_t_ const *model) {
+  float cutoff_s;
+
+  if (!fill_model_learned(model)) {
+    return model->config.max_runtime_s;
+  }
+  cutoff_s = model->stats.mean_s + FILL_MODEL_CUTOFF_SIGMAS * fill_model_stddev_s(model);
+  if (cutoff_s < model->stats.mean_s * FILL_MODEL_CUTOFF_MIN_RATIO) {
+    cutoff_s = model->stats.mean_s * FILL_MODEL_CUTOFF_MIN_RATIO;
+  }
+  if (cutoff_s > model->config.max_runtime_s) {
+    return model->config.max_runtime_s;
+  }
+  return (uint32_t) cutoff_s;
+}
@@ -0,0 +1,47 @@
+#ifndef __FILL_MODEL_H__
+#define __FILL_MODEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The fill time model of oh_tank_level.c, kept free of ESP-IDF and FreeRTOS
+   like tank_filter.c. It learns how long a motor run takes to fill the tank,
+   and from that when the tank level probe has to be read often, and when a
+   run has gone on for too long. */
+
+struct fill_model_config_t_ {
+  unsigned int min_runs;	/* learned fills before the sampling adapts */
+  unsigned int max_runs;	/* fills weighed in; older ones fade out */
+  unsigned int slow_period_s;	/* between readings early in a fill */
+  unsigned int fast_lead_s;	/* fast sampling this long before the earliest full */
+  unsigned int max_runtime_s;	/* cutoff at most, and until learned */
+};
+
+/* Running mean and variance of the fill times (Welford). Stored in NVS as it
+   is, so any change to the layout bumps FILL_MODEL_VERSION. */
+#define FILL_MODEL_VERSION 1
+
+struct fill_model_stats_t_ {
+  uint32_t version;
+  uint32_t runs;		/* learned fills, up to config.max_runs */
+  float mean_s;
+  float m2;			/* sum of squared differences from the mean */
+};
+
+struct fill_model_t_ {
+  struct fill_model_config_t_ config;
+  struct fill_model_stats_t_ stats;
+};
+
+extern bool fill_model_init(struct fill_model_t_ *model,
+			    struct fill_model_config_t_ const *config);
+extern void fill_model_reset(struct fill_model_t_ *model);
+extern bool fill_model_restore(struct fill_model_t_ *model,
+			       struct fill_model_stats_t_ const *stats);
+extern bool fill_model_learn(struct fill_model_t_ *model, uint32_t fill_s);
+extern bool fill_model_learned(struct fill_model_t_ const *model);
+extern float fill_model_stddev_s(struct fill_model_t_ const *model);
+extern uint32_t fill_model_fast_after_s(struct fill_model_t_ const *model);
+extern uint32_t fill_model_cutoff_s(struct fill_model_t_ const *model);
+
+#endif
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_heap_trace.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "mc.h"
+
+static char const *LOG_TAG = "mc|heap_mon";
+
+/* Heap monitoring, to catch leaks and slow fragmentation in the field.
+
+   heap_mon_task samples the 8-bit capable heap every
+   CONFIG_WLM_HEAP_SAMPLE_PERIOD_S into a ring of the last
+   CONFIG_WLM_HEAP_HISTORY samples: free bytes, the low water mark, and the
+   largest free block. The fragmentation is how much of the free memory is
+   not in the largest block, i.e. cannot be had in one allocation.
+
+   With CONFIG_HEAP_TRACING_STANDALONE, heap-trace=start on /mc_ctrl starts
+   recording every allocation not yet freed (HEAP_TRACE_LEAKS) into a buffer
+   of CONFIG_WLM_HEAP_TRACE_RECORDS records; once it is full, the oldest
+   record makes room for the newest. heap-trace=stop stops recording and
+   keeps the records, and the next start clears them. The buffer itself is
+   allocated at the first start and kept from then on.
+
+   /mc_heap reports both, the outstanding allocations grouped by the
+   addresses of their callers (CONFIG_HEAP_TRACING_STACK_DEPTH of them), the
+   ones holding the most bytes first. */
+#define HEAP_MON_PERIOD_S CONFIG_WLM_HEAP_SAMPLE_PERIOD_S
+#define HEAP_MON_HISTORY CONFIG_WLM_HEAP_HISTORY
+#define HEAP_MON_CALLERS 16	/* groups reported, the rest go into one */
+
+struct heap_sample_t_ {
+  uint32_t uptime_s;
+  uint32_t free;
+  uint32_t min_free;
+  uint32_t largest_free_block;
+};
+
+static struct heap_sample_t_ heap_history[HEAP_MON_HISTORY];
+static size_t heap_history_head = 0;	/* next to write */
+static size_t heap_history_count = 0;
+static portMUX_TYPE heap_mon_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t frag_pct (struct heap_sample_t_ const *sample) {
+  if (sample->free == 0) {
+    return 0;
+  }
+  return 100 - (uint32_t) ((uint64_t) sample->largest_free_block * 100 / sample->free);
+}
+
+static void heap_sample (void) {
+  struct heap_sample_t_ sample;
+  multi_heap_info_t info;
+
+  heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+  sample.uptime_s = esp_timer_get_time() / 1000000;
+  sample.free = info.total_free_bytes;
+  sample.min_free = info.minimum_free_bytes;
+  sample.largest_free_block = info.largest_free_block;
+
+  taskENTER_CRITICAL(&heap_mon_lock);
+  heap_history[heap_history_head] = sample;
+  heap_history_head = (heap_history_head + 1) % HEAP_MON_HISTORY;
+  if (heap_history_count < HEAP_MON_HISTORY) {
+    heap_history_count++;
+  }
+  taskEXIT_CRITICAL(&heap_mon_lock);
+}
+
+/* heap_caps_get_info() walks every block of every heap, under the heap
+   locks, so it runs here at the lowest priority rather than on the
+   esp_timer task, where it would hold up the beep patterns */
+void heap_mon_task (void *param) {
+  while (pdTRUE) {
+    heap_sample();
+    vTaskDelay(pdMS_TO_TICKS(HEAP_MON_PERIOD_S * 1000));
+  }
+}
+
+/* `heap_fragmentation_pct` and `heap_samples` lines for /mc_stats, from
+   the latest sample */
+int heap_mon_format_stats (char *buf, size_t len) {
+  struct heap_sample_t_ sample = { 0 };
+  size_t count;
+
+  taskENTER_CRITICAL(&heap_mon_lock);
+  count = heap_history_count;
+  if (count) {
+    sample = heap_history[(heap_history_head + HEAP_MON_HISTORY - 1) % HEAP_MON_HISTORY];
+  }
+  taskEXIT_CRITICAL(&heap_mon_lock);
+
+  return snprintf(buf, len,
+		  "heap_fragmentation_pct=%lu\n"
+		  "heap_samples=%u\n",
+		  (unsigned long) frag_pct(&sample), (unsigned) count);
+}
+
+/* Samples from `*index` on (0 is the oldest), one line each:
+     sample uptime_s=<n> free=<n> min_free=<n> largest_free_block=<n> fragmentation_pct=<n>
+   as many as fit into `buf`. Advances `*index` past them and returns the
+   length, 0 once there are no more. */
+int heap_mon_format_history (size_t *index, char *buf, size_t len) {
+  struct heap_sample_t_ sample;
+  size_t oldest, count;
+  int n, written = 0;
+
+  while (pdTRUE) {
+    taskENTER_CRITICAL(&heap_mon_lock);
+    count = heap_history_count;
+    oldest = (heap_history_head + HEAP_MON_HISTORY - count) % HEAP_MON_HISTORY;
+    if (*index < count) {
+      sample = heap_history[(oldest + *index) % HEAP_MON_HISTORY];
+    }
+    taskEXIT_CRITICAL(&heap_mon_lock);
+    if (*index >= count) {
+      return written;
+    }
+
+    n = snprintf(buf + written, len - written,
+		 "sample uptime_s=%lu free=%lu min_free=%lu largest_free_block=%lu "
+		 "fragmentation_pct=%lu\n", (unsigned long) sample.uptime_s,
+		 (unsigned long) sample.free, (unsigned long) sample.min_free,
+		 (unsigned long) sample.largest_free_block, (unsigned long) frag_pct(&sample));
+    if ((n < 0) || (n >= (int) (len - written))) {
+      /* Does not fit, left for the next call */
+      return (written == 0) ? -1 : written;
+    }
+    written += n;
+    (*index)++;
+  }
+}
+
+#ifdef CONFIG_HEAP_TRACING_STANDALONE
+#define HEAP_MON_TRACE_RECORDS CONFIG_WLM_HEAP_TRACE_RECORDS
+
+struct heap_caller_t_ {
+  void *alloced_by[CONFIG_HEAP_TRACING_STACK_DEPTH];
+  uint32_t allocations;
+  uint32_t bytes;
+};
+
+static heap_trace_record_t *trace_records = NULL;
+static bool trace_running = false;
+static bool trace_busy = false;	/* a start or stop is in progress */
+
+static bool claim_trace (void) {
+  bool busy;
+
+  taskENTER_CRITICAL(&heap_mon_lock);
+  busy = trace_busy;
+  trace_busy = true;
+  taskEXIT_CRITICAL(&heap_mon_lock);
+  if (busy) {
+    ESP_LOGW(LOG_TAG, "A heap trace start or stop is already in progress");
+  }
+  return !busy;
+}
+
+static void release_trace (bool running) {
+  taskENTER_CRITICAL(&heap_mon_lock);
+  trace_running = running;
+  trace_busy = false;
+  taskEXIT_CRITICAL(&heap_mon_lock);
+}
+
+bool heap_mon_trace_start (void) {
+  esp_err_t err;
+
+  if (!claim_trace()) {
+    return false;
+  }
+  if (trace_running) {
+    ESP_LOGW(LOG_TAG, "Heap trace already running");
+    release_trace(true);
+    return true;
+  }
+  if (!trace_records) {
+    /* The trace buffer must stay in internal RAM */
+    trace_records = heap_caps_calloc(HEAP_MON_TRACE_RECORDS, sizeof(heap_trace_record_t),
+				     MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!trace_records) {
+      ESP_LOGE(LOG_TAG, "Unable to allocate %d heap trace records", HEAP_MON_TRACE_RECORDS);
+      release_trace(false);
+      return false;
+    }
+    err = heap_trace_init_standalone(trace_records, HEAP_MON_TRACE_RECORDS);
+    if (err != ESP_OK) {
+      ESP_LOGE(LOG_TAG, "Unable to set up heap tracing (%s)", esp_err_to_name(err));
+      free(trace_records);
+      trace_records = NULL;
+      release_trace(false);
+      return false;
+    }
+  }
+  err = heap_trace_start(HEAP_TRACE_LEAKS);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to start heap tracing (%s)", esp_err_to_name(err));
+    release_trace(false);
+    return false;
+  }
+  ESP_LOGI(LOG_TAG, "Heap trace started, %d records", HEAP_MON_TRACE_RECORDS);
+  release_trace(true);
+  return true;
+}
+
+void heap_mon_trace_stop (void) {
+  if (!claim_trace()) {
+    return;
+  }
+  if (trace_running) {
+    heap_trace_stop();
+    ESP_LOGI(LOG_TAG, "Heap trace stopped");
+  }
+  release_trace(false);
+}
+
+static int compare_callers (void const *a, void const *b) {
+  uint32_t x = ((struct heap_caller_t_ const *) a)->bytes;
+  uint32_t y = ((struct heap_caller_t_ const *) b)->bytes;
+
+  return (x < y) - (x > y);
+}
+
+/* The trace summary and its outstanding allocations by caller:
+     tracing=on|off
+     trace_records=<n> trace_capacity=<n> trace_high_water=<n> trace_overflowed=0|1
+     trace_allocations=<n> trace_frees=<n>
+     caller=0x400d1234,0x400d5678 allocations=<n> bytes=<n>
+     ...
+     caller=other allocations=<n> bytes=<n>
+   Returns the length, as snprintf() does. */
+int heap_mon_format_trace (char *buf, size_t len) {
+  struct heap_caller_t_ callers[HEAP_MON_CALLERS + 1], *other = &callers[HEAP_MON_CALLERS];
+  heap_trace_summary_t summary;
+  heap_trace_record_t record;
+  size_t i, j, groups = 0;
+  bool running;
+  int n, written;
+
+  taskENTER_CRITICAL(&heap_mon_lock);
+  running = trace_running;
+  taskEXIT_CRITICAL(&heap_mon_lock);
+
+  if (!trace_records) {
+    return snprintf(buf, len, "tracing=off\n");
+  }
+  if (heap_trace_summary(&summary) != ESP_OK) {
+    return -1;
+  }
+
+  memset(callers, 0, sizeof(callers));
+  for (i = 0; i < summary.count; i++) {
+    /* Records come and go while tracing, stop at the first one gone */
+    if (heap_trace_get(i, &record) != ESP_OK) {
+      break;
+    }
+    if (!record.address) {
+      continue;
+    }
+    for (j = 0; j < groups; j++) {
+      if (memcmp(callers[j].alloced_by, record.alloced_by, sizeof(record.alloced_by)) == 0) {
+	break;
+      }
+    }
+    if (j == groups) {
+      if (groups < HEAP_MON_CALLERS) {
+	memcpy(callers[j].alloced_by, record.alloced_by, sizeof(record.alloced_by));
+	groups++;
+      } else {
+	j = HEAP_MON_CALLERS;
+      }
+    }
+    callers[j].allocations++;
+    callers[j].bytes += record.size;
+  }
+  qsort(callers, groups, sizeof(callers[0]), compare_callers);
+
+  written = snprintf(buf, len,
+		     "tracing=%s\n"
+		     "trace_records=%u trace_capacity=%u trace_high_water=%u "
+		     "trace_overflowed=%d\n"
+		     "trace_allocations=%u trace_frees=%u\n",
+		     running ? "on" : "off", (unsigned) summary.count,
+		     (unsigned) summary.capacity, (unsigned) summary.high_water_mark,
+		     summary.has_overflowed ? 1 : 0, (unsigned) summary.total_allocations,
+		     (unsigned) summary.total_frees);
+  for (i = 0; (i < groups) && (written >= 0); i++) {
+    n = snprintf(buf + written, (written < (int) len) ? len - written : 0, "caller=");
+    written = (n < 0) ? n : written + n;
+    for (j = 0; (j < CONFIG_HEAP_TRACING_STACK_DEPTH) && (written >= 0); j++) {
+      n = snprintf(buf + written, (written < (int) len) ? len - written : 0, "%s%p",
+		   j ? "," : "", callers[i].alloced_by[j]);
+      written = (n < 0) ? n : written + n;
+    }
+    if (written >= 0) {
+      n = snprintf(buf + written, (written < (int) len) ? len - written : 0,
+		   " allocations=%lu bytes=%lu\n", (unsigned long) callers[i].allocations,
+		   (unsigned long) callers[i].bytes);
+      written = (n < 0) ? n : written + n;
+    }
+  }
+  if ((written >= 0) && other->allocations) {
+    n = snprintf(buf + written, (written < (int) len) ? len - written : 0,
+		 "caller=other allocations=%lu bytes=%lu\n",
+		 (unsigned long) other->allocations, (unsigned long) other->bytes);
+    written = (n < 0) ? n : written + n;
+  }
+  return written;
+}
+
+#else
+
+bool heap_mon_trace_start (void) {
+  ESP_LOGE(LOG_TAG, "Heap tracing is not built in (CONFIG_HEAP_TRACING_STANDALONE)");
+  return false;
+}
+
+void heap_mon_trace_stop (void) {
+}
+
+int heap_mon_format_trace (char *buf, size_t len) {
+  return snprintf(buf, len, "tracing=unavailable\n");
+}
+
+#endif
@@ -3,42 +3,194 @@
 #include <errno.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_system.h"
 #include "esp_partition.h"
 #include "esp_app_format.h"
 #include "esp_ota_ops.h"
 #include "esp_http_server.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "mc.h"
+#include "trace.h"
+#include "tank_filter.h"
 
-static char *firmware_upgrade_command = NULL;
 static char const *LOG_TAG = "mc|httpd";
 
-static esp_err_t mc_version_info_handler (httpd_req_t *req) {
-  esp_partition_t const *next_partition, *running_partition, *boot_partition,
-    *last_invalid_partition;
-  esp_app_desc_t next_app_info = {0}, running_app_info = {0}, invalid_app_info = {0};
-  char *response, *cursor, *sentinel;
-  int len, remaining_length;
-  static char const *buf_too_small = "Buffer too small for response";
+/* Counters reported by /mc_stats, so that a load generator can tell how many
+   requests the server actually handled and how many sockets it allows */
+static uint32_t http_requests_served = 0;
+static uint16_t http_max_open_sockets = 0;
+static portMUX_TYPE http_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Handlers run on the server task and on the async workers alike */
+static void count_request (void) {
+  taskENTER_CRITICAL(&http_stats_lock);
+  http_requests_served++;
+  taskEXIT_CRITICAL(&http_stats_lock);
+}
+
+/* /mc_logs subscribers, each streaming the log ring from its own cursor */
+#define LOG_SUBSCRIBERS CONFIG_WLM_HTTPD_LOG_SUBSCRIBERS
+#define LOG_STREAM_CHUNK_SIZE 512
+#define LOG_STREAM_POLL_MS 250
+
+static int log_subscribers = 0;
+static uint32_t log_subscribers_dropped = 0;
+static portMUX_TYPE log_subscribers_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* esp_http_server runs every handler on its single server task, so a handler
+   that blocks (e.g. waiting up to 2 seconds to enqueue on a full ota_q) stalls
+   every other client. Such handlers hand their request over to a small pool
+   of worker tasks using the async request API, and return immediately so
+   that the server task can go on serving the fast status reads. */
+#define HTTP_ASYNC_WORKERS CONFIG_WLM_HTTPD_ASYNC_WORKERS
+
+struct http_async_req_t_ {
+  httpd_req_t *req;
+  esp_err_t (*handler)(httpd_req_t *req);
+};
+
+static QueueHandle_t http_async_req_q = NULL;
+static SemaphoreHandle_t http_async_worker_ready = NULL;
+static TaskHandle_t http_async_workers[HTTP_ASYNC_WORKERS];
+
+static bool is_on_async_worker (void) {
+  TaskHandle_t current = xTaskGetCurrentTaskHandle();
+  int i;
+
+  for (i = 0; i < HTTP_ASYNC_WORKERS; i++) {
+    if (http_async_workers[i] == current) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Hand `req` over to a worker task, which will invoke `handler` on it. Fails
+   (without touching `req`) if all the workers are busy. */
+static esp_err_t submit_async_req (httpd_req_t *req,
+				   esp_err_t (*handler)(httpd_req_t *req)) {
+  struct http_async_req_t_ async_req;
+  httpd_req_t *copy = NULL;
+  esp_err_t err;
+
+  if (!http_async_req_q) {
+    return ESP_FAIL;
+  }
+
+  /* Only take the request if a worker is free to pick it up right away,
+     otherwise it would sit in the queue holding on to its socket */
+  if (pdTRUE != xSemaphoreTake(http_async_worker_ready, 0)) {
+    ESP_LOGW(LOG_TAG, "No free async worker for %s", req->uri);
+    return ESP_FAIL;
+  }
+
+  err = httpd_req_async_handler_begin(req, &copy);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "httpd_req_async_handler_begin failed (%s)", esp_err_to_name(err));
+    xSemaphoreGive(http_async_worker_ready);
+    return err;
+  }
+
+  async_req.req = copy;
+  async_req.handler = handler;
+  if (pdTRUE != xQueueSend(http_async_req_q, &async_req, 0)) {
+    ESP_LOGE(LOG_TAG, "Failed to enqueue async request for %s", req->uri);
+    httpd_req_async_handler_complete(copy);
+    xSemaphoreGive(http_async_worker_ready);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+/* Called at the top of a slow handler. Returns true if the handler should
+   return `*ret` right away because the request has been taken care of
+   (handed over to a worker, or rejected because all workers are busy). */
+static bool offload_to_async_worker (httpd_req_t *req,
+				     esp_err_t (*handler)(httpd_req_t *req),
+				     esp_err_t *ret) {
+  if (is_on_async_worker()) {
+    return false;
+  }
+  if (submit_async_req(req, handler) == ESP_OK) {
+    *ret = ESP_OK;
+    return true;
+  }
+  httpd_resp_set_status(req, "503 Service Unavailable");
+  httpd_resp_sendstr(req, "Busy, try again");
+  *ret = ESP_OK;
+  return true;
+}
+
+static void http_async_worker_task (void *param) {
+  struct http_async_req_t_ async_req;
+
+  while (pdTRUE) {
+    if (pdTRUE == xQueueReceive(http_async_req_q, &async_req, portMAX_DELAY)) {
+      /* The slow requests run at full clock; the quick ones on the server
+	 task do not need it */
+      power_lock(POWER_LOCK_HTTP);
+      async_req.handler(async_req.req);
+      power_unlock(POWER_LOCK_HTTP);
+      if (httpd_req_async_handler_complete(async_req.req) != ESP_OK) {
+	ESP_LOGE(LOG_TAG, "httpd_req_async_handler_complete failed");
+      }
+      xSemaphoreGive(http_async_worker_ready);
+    }
+  }
+}
+
+static void start_async_workers (void) {
+  BaseType_t ret;
+  int i;
+
+  http_async_worker_ready = xSemaphoreCreateCounting(HTTP_ASYNC_WORKERS, 0);
+  http_async_req_q = xQueueCreate(HTTP_ASYNC_WORKERS, sizeof(struct http_async_req_t_));
+  if (!http_async_worker_ready || !http_async_req_q) {
+    ESP_LOGE(LOG_TAG, "Failed to create async worker queue/semaphore");
+    return;
+  }
+
+  for (i = 0; i < HTTP_ASYNC_WORKERS; i++) {
+    ret = xTaskCreatePinnedToCore(http_async_worker_task, "HTTP Async Worker", 4096,
+				  NULL, MC_PRIO_HTTP_WORKER, &http_async_workers[i],
+				  MC_NETWORK_CORE);
+    if (ret != pdPASS) {
+      ESP_LOGE(LOG_TAG, "Failed to create async worker %d", i);
+      break;
+    }
+    xSemaphoreGive(http_async_worker_ready);
+  }
+}
+
+/* The /mc_version_info text, into `response` of VERSION_INFO_RESPONSE_SIZE + 1
+   bytes. Returns false if it does not fit. Also run by bench.c.
 
-  /*
   Could not fetch running partition info\n
   Could not fetch other partition info\n
   Boot partition is not identical to running partition\n
   Invalid partition seen\n
   Could not fetch invalid partition info\n
+  OTA: staged, waiting for the motor to be idle (version ...)\n
   */
-  response = malloc(300 + 1);
-  if (!response) {
-    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for version info response");
-    httpd_resp_send_408(req);
-    return ESP_FAIL;
-  }
-  response[300] = '\0';
-  sentinel = &(response[299]);
+bool http_format_version_info (char *response) {
+  esp_partition_t const *next_partition, *running_partition, *boot_partition,
+    *last_invalid_partition;
+  esp_app_desc_t next_app_info = {0}, running_app_info = {0}, invalid_app_info = {0};
+  char *cursor, *sentinel;
+  char const *ota_phase, *staged_version;
+  int len, remaining_length;
+  static char const *buf_too_small = "Buffer too small for response";
+
+  response[VERSION_INFO_RESPONSE_SIZE] = '\0';
+  sentinel = &(response[VERSION_INFO_RESPONSE_SIZE - 1]);
   cursor = response;
-  remaining_length = 300;
+  remaining_length = VERSION_INFO_RESPONSE_SIZE;
   
   running_partition = esp_ota_get_running_partition();
   next_partition = esp_ota_get_next_update_partition(running_partition);
@@ -53,9 +205,7 @@ static esp_err_t mc_version_info_handler (httpd_req_t *req) {
   cursor += len;
   if (cursor >= sentinel) {
     ESP_LOGE(LOG_TAG, "%s\n", buf_too_small);
-    free(response);
-    httpd_resp_send_408(req);
-    return ESP_FAIL;
+    return false;
   }
   
   if (esp_ota_get_partition_description(next_partition, &next_app_info) == ESP_OK) {
@@ -68,9 +218,7 @@ static esp_err_t mc_version_info_handler (httpd_req_t *req) {
   cursor += len;
   if (cursor >= sentinel) {
     ESP_LOGE(LOG_TAG, "%s\n", buf_too_small);
-    free(response);
-    httpd_resp_send_408(req);
-    return ESP_FAIL;
+    return false;
   }
 
   boot_partition = esp_ota_get_boot_partition();
@@ -81,9 +229,7 @@ static esp_err_t mc_version_info_handler (httpd_req_t *req) {
   cursor += len;
   if (cursor >= sentinel) {
     ESP_LOGE(LOG_TAG, "%s\n", buf_too_small);
-    free(response);
-    httpd_resp_send_408(req);
-    return ESP_FAIL;
+    return false;
   }
 
   last_invalid_partition = esp_ota_get_last_invalid_partition();
@@ -107,12 +253,59 @@ static esp_err_t mc_version_info_handler (httpd_req_t *req) {
   }
   if (cursor >= sentinel) {
     ESP_LOGE(LOG_TAG, "%s\n", buf_too_small);
+    return false;
+  }
+
+  ota_phase = ota_get_phase(&staged_version);
+  if (staged_version) {
+    len = snprintf(cursor, remaining_length, "OTA: %s (version %s)\n", ota_phase,
+		   staged_version);
+  } else {
+    len = snprintf(cursor, remaining_length, "OTA: %s\n", ota_phase);
+  }
+  remaining_length -= len;
+  cursor += len;
+  if (cursor >= sentinel) {
+    ESP_LOGE(LOG_TAG, "%s\n", buf_too_small);
+    return false;
+  }
+
+  len = selftest_format(cursor, remaining_length);
+  if (len < 0) {
+    return false;
+  }
+  remaining_length -= len;
+  cursor += len;
+  if (cursor >= sentinel) {
+    ESP_LOGE(LOG_TAG, "%s\n", buf_too_small);
+    return false;
+  }
+
+  *cursor = '\0';
+  return true;
+}
+
+static esp_err_t mc_version_info_handler (httpd_req_t *req) {
+  char *response;
+  esp_err_t ret;
+
+  /* Reading the app descriptions means several flash reads */
+  if (offload_to_async_worker(req, mc_version_info_handler, &ret)) {
+    return ret;
+  }
+  count_request();
+
+  response = malloc(VERSION_INFO_RESPONSE_SIZE + 1);
+  if (!response) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for version info response");
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+  if (!http_format_version_info(response)) {
     free(response);
     httpd_resp_send_408(req);
     return ESP_FAIL;
   }
-
-  *cursor = '\0';
   
   if (ESP_OK != httpd_resp_send(req, response, strlen(response))) {
     free(response);
@@ -132,12 +325,19 @@ static httpd_uri_t mc_version_info_uri = {
     .user_ctx  = NULL /* will be filled in in start_webserver */
 };
 
+/* The /mc_status text. Also run by bench.c. */
+int http_format_status (EventBits_t bits, char *buf, size_t len) {
+  return snprintf(buf, len, "Motor is %s",
+		  (bits & EVENT_MOTOR_RUNNING) ? "running" : "not running");
+}
+
 static esp_err_t mc_status_handler (httpd_req_t *req) {
   struct mc_task_args_t_ *task_args;
   EventBits_t bits;
   /* Motor is not running */
   static char http_response[20 + 1];
 
+  count_request();
   task_args = (struct mc_task_args_t_ *) req->user_ctx;
   if (!task_args) {
     ESP_LOGE(LOG_TAG, "NULL context in %s", __FUNCTION__);
@@ -145,9 +345,8 @@ static esp_err_t mc_status_handler (httpd_req_t *req) {
     return ESP_FAIL;
   }
 
-  bits = xEventGroupGetBits(task_args->mc_event_group);
-  snprintf(http_response, sizeof(http_response), "Motor is %s",
-	   (bits & EVENT_MOTOR_RUNNING) ? "running" : "not running");
+  bits = xEventGroupSetBits(task_args->mc_event_group, EVENT_HEALTH_HTTPD);
+  http_format_status(bits, http_response, sizeof(http_response));
   http_response[sizeof(http_response) - 1] = '\0';
 
   if (ESP_OK != httpd_resp_send(req, http_response, strlen(http_response))) {
@@ -190,21 +389,111 @@ static httpd_uri_t mc_status_uri = {
     .user_ctx  = NULL /* will be filled in in start_webserver */
 };
 
+/* Carry out one control command:
+    motor=on
+    motor=off
+    timeofday=<epoch> (get the epoch by running `date +%s` on Linux)
+    firmware-upgrade=https://192.168.29.76:59443/mc.bin[&sha256=<hex digest>]
+    loglevel=<tag>:<none|error|warn|info|debug|verbose> (tag "*" for all)
+    jitter=reset
+    sensor-trace=start|stop
+    fill-model=reset
+    heap-trace=start|stop
+    wifi-ps=none|min|max|auto
+    replica=takeover
+   Shared by the /mc_ctrl handler and the MQTT command topic. Returns false if
+   the command is not understood or fails. Can block for a few seconds on a
+   full queue. */
+bool mc_ctrl_command (struct mc_task_args_t_ *task_args, char const *buf) {
+  bool desired_motor_state;
+  char *firmware_upgrade_command;
+
+  if (strstr(buf, "timeofday=") == buf) {
+    return set_system_time(buf + strlen("timeofday="));
+  } else if (strstr(buf, "firmware-upgrade=") == buf) {
+    /* Post the `buf` to the OTA queue */
+    firmware_upgrade_command = strdup(buf);
+    if (!firmware_upgrade_command) {
+      ESP_LOGE(LOG_TAG, "Failed to allocate firmware upgrade req");
+      return false;
+    }
+    /* ota_task frees it once done with it, so it is ours to free if it
+       never gets there */
+    if (pdTRUE != xQueueSend(task_args->ota_q, (void *) &firmware_upgrade_command,
+			     pdMS_TO_TICKS(2000))) {
+      ESP_LOGE(LOG_TAG, "failed to enq firmware upgrade req");
+      free(firmware_upgrade_command);
+      return false;
+    }
+  } else if (strstr(buf, "loglevel=") == buf) {
+    return log_level_command(buf + strlen("loglevel="));
+  } else if (strcmp(buf, "jitter=reset") == 0) {
+    oh_tank_level_jitter_reset();
+  } else if (strcmp(buf, "sensor-trace=start") == 0) {
+    return sensor_trace_start();
+  } else if (strcmp(buf, "sensor-trace=stop") == 0) {
+    sensor_trace_stop();
+  } else if (strcmp(buf, "fill-model=reset") == 0) {
+    oh_tank_level_fill_model_reset();
+  } else if (strcmp(buf, "heap-trace=start") == 0) {
+    return heap_mon_trace_start();
+  } else if (strcmp(buf, "heap-trace=stop") == 0) {
+    heap_mon_trace_stop();
+  } else if (strstr(buf, "wifi-ps=") == buf) {
+    return wifi_ps_command(buf + strlen("wifi-ps="));
+  } else if (strstr(buf, "replica=") == buf) {
+    return replica_command(buf + strlen("replica="));
+  } else if (strstr(buf, "motor=") == buf) {
+    if (strcmp(buf, "motor=on") == 0) {
+      ESP_LOGI(LOG_TAG, "Will set motor to ON state");
+      desired_motor_state = true;
+      MC_TRACE(TRACE_HTTP_CTRL, desired_motor_state);
+      if (pdTRUE != xQueueSend(task_args->motor_on_off_q, (void *) &desired_motor_state,
+			       pdMS_TO_TICKS(1000))) {
+	MC_TRACE(TRACE_MOTOR_Q_SEND_FAILED, desired_motor_state);
+	ESP_LOGE(LOG_TAG, "Failed to enqueue motor ON");
+      } else {
+	MC_TRACE(TRACE_MOTOR_Q_SEND, desired_motor_state);
+      }
+    } else if (strcmp(buf, "motor=off") == 0) {
+      ESP_LOGI(LOG_TAG, "Will set motor to OFF state");
+      desired_motor_state = false;
+      MC_TRACE(TRACE_HTTP_CTRL, desired_motor_state);
+      if (pdTRUE != xQueueSend(task_args->motor_on_off_q, (void *) &desired_motor_state,
+			       pdMS_TO_TICKS(1000))) {
+	MC_TRACE(TRACE_MOTOR_Q_SEND_FAILED, desired_motor_state);
+	ESP_LOGE(LOG_TAG, "failed to enqueue motor OFF");
+      } else {
+	MC_TRACE(TRACE_MOTOR_Q_SEND, desired_motor_state);
+      }
+    } else {
+      ESP_LOGE(LOG_TAG, "cannot understand motor desired state \"%s\"", buf);
+      return false;
+    }
+  } else {
+    ESP_LOGE(LOG_TAG, "unable to parse control word");
+    return false;
+  }
+  return true;
+}
+
 /* HTTP POST handler */
 static esp_err_t mc_ctrl_handler (httpd_req_t *req) {
   char *buf;
   int ret;
-  bool desired_motor_state;
   struct mc_task_args_t_ *task_args;
 
-  /*
-    motor=on
-    motor=off
-    timeofday=<epoch> (get the epoch by running `date +%s` on Linux)
-    firmware-upgrade=https://192.168.29.76:59443/mc.bin
-  */
+  /* All the commands end up waiting on a queue, which can take seconds, so
+     they go to a worker. If uploads and probes have taken all the workers,
+     the command runs here rather than being refused: a motor=off must
+     always get through, and the waits are bounded (1 s on the motor queue,
+     2 s on the OTA one). */
+  if (!is_on_async_worker() && (submit_async_req(req, mc_ctrl_handler) == ESP_OK)) {
+    return ESP_OK;
+  }
+  count_request();
   ESP_LOGI(LOG_TAG, "Handling POST (%u bytes)", req->content_len);
-  if (req->content_len > 128) {
+  if (req->content_len > 256) {
     ESP_LOGE(LOG_TAG, "POST length suspicious");
     httpd_resp_send_408(req);
     return ESP_FAIL;
@@ -231,75 +520,885 @@ static esp_err_t mc_ctrl_handler (httpd_req_t *req) {
   }
 
   buf[req->content_len] = '\0';
-  if (strstr(buf, "timeofday=") == buf) {
-    if (!set_system_time(buf + strlen("timeofday="))) {
+  if (!mc_ctrl_command(task_args, buf)) {
+    free(buf);
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+
+  /* Respond with empty body */
+  httpd_resp_send(req, NULL, 0);
+  free(buf);
+  return ESP_OK;
+}
+
+static httpd_uri_t mc_ctrl_uri = {
+    .uri       = "/mc_ctrl",
+    .method    = HTTP_POST,
+    .handler   = mc_ctrl_handler,
+    .user_ctx  = NULL /* will be filled in in start_webserver */
+};
+
+/* Push-style firmware upgrade. The raw image is POSTed as the request body,
+   e.g.
+     curl --data-binary @build/mc.bin \
+	  -H "X-Image-SHA256: $(sha256sum build/mc.bin | cut -d' ' -f1)" \
+	  http://192.168.29.9/mc_ota
+   and is written to the update partition one block at a time as it arrives.
+   The X-Image-SHA256 header is optional; if present, it must be the 64 hex
+   characters of the digest, and the image is only staged if it matches.
+   ota_task applies the staged image. */
+#define OTA_UPLOAD_BLOCK_SIZE 1024
+#define OTA_UPLOAD_MAX_TIMEOUTS 5
+
+/* Fill `buf` with `len` bytes of the request body (or less, if the body ends
+   first). Returns the number of bytes read, or -1 on error. */
+static int recv_block (httpd_req_t *req, char *buf, int len) {
+  int received = 0, ret, timeouts = 0;
+
+  while (received < len) {
+    ret = httpd_req_recv(req, buf + received, len - received);
+    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+      if (++timeouts >= OTA_UPLOAD_MAX_TIMEOUTS) {
+	return -1;
+      }
+      continue;
+    }
+    if (ret <= 0) {
+      return (ret == 0) ? received : -1;
+    }
+    timeouts = 0;
+    received += ret;
+  }
+  return received;
+}
+
+static esp_err_t mc_ota_handler (httpd_req_t *req) {
+  char *buf, digest_hex[2 * 32 + 1];
+  uint8_t expected_sha256[32];
+  bool have_digest = false;
+  struct ota_writer_t_ *writer;
+  size_t remaining;
+  int len;
+  int64_t start, elapsed_ms;
+  esp_err_t async_ret;
+
+  /* The upload takes tens of seconds */
+  if (offload_to_async_worker(req, mc_ota_handler, &async_ret)) {
+    return async_ret;
+  }
+  count_request();
+  ESP_LOGI(LOG_TAG, "Handling firmware upload (%u bytes)", req->content_len);
+
+  if (req->content_len == 0) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty image");
+    return ESP_FAIL;
+  }
+
+  /* Images are taken as is; there is no decompressor in the firmware */
+  if ((httpd_req_get_hdr_value_len(req, "Content-Encoding") > 0)) {
+    httpd_resp_set_status(req, "415 Unsupported Media Type");
+    httpd_resp_sendstr(req, "Compressed images are not supported");
+    return ESP_FAIL;
+  }
+
+  /* A malformed (e.g. over-long) digest is refused, rather than skipped */
+  if (httpd_req_get_hdr_value_len(req, "X-Image-SHA256") > 0) {
+    if ((httpd_req_get_hdr_value_len(req, "X-Image-SHA256") != sizeof(digest_hex) - 1) ||
+	(httpd_req_get_hdr_value_str(req, "X-Image-SHA256", digest_hex,
+				     sizeof(digest_hex)) != ESP_OK) ||
+	!ota_parse_sha256(digest_hex, expected_sha256)) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad X-Image-SHA256 header");
+      return ESP_FAIL;
+    }
+    have_digest = true;
+  }
+
+  buf = malloc(OTA_UPLOAD_BLOCK_SIZE);
+  if (!buf) {
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+
+  writer = ota_writer_begin();
+  if (!writer) {
+    free(buf);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+			"Unable to start firmware upgrade");
+    return ESP_FAIL;
+  }
+
+  start = esp_timer_get_time();
+  remaining = req->content_len;
+  while (remaining > 0) {
+    len = recv_block(req, buf, (remaining < OTA_UPLOAD_BLOCK_SIZE) ?
+		     remaining : OTA_UPLOAD_BLOCK_SIZE);
+    if (len <= 0) {
+      ESP_LOGE(LOG_TAG, "Firmware upload interrupted with %u bytes to go",
+	       (unsigned) remaining);
+      ota_writer_abort(writer);
       free(buf);
       httpd_resp_send_408(req);
       return ESP_FAIL;
     }
-  } else if (strstr(buf, "firmware-upgrade=") == buf) {
-    /* Post the `buf` to the OTA queue */
-    firmware_upgrade_command = strdup(buf);
-    if (pdTRUE != xQueueSend(task_args->ota_q, (void *) &firmware_upgrade_command,
-			     pdMS_TO_TICKS(2000))) {
-      ESP_LOGE(LOG_TAG, "failed to enq firmware upgrade req");
+    if (!ota_writer_write(writer, buf, len)) {
+      ota_writer_abort(writer);
+      free(buf);
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+			  "Unable to write image");
+      return ESP_FAIL;
     }
-  } else if (strstr(buf, "motor=") == buf) {
-    if (strcmp(buf, "motor=on") == 0) {
-      ESP_LOGI(LOG_TAG, "Will set motor to ON state");
-      desired_motor_state = true;
-      if (pdTRUE != xQueueSend(task_args->motor_on_off_q, (void *) &desired_motor_state,
-			       pdMS_TO_TICKS(1000))) {
-	ESP_LOGE(LOG_TAG, "Failed to enqueue motor ON");
-      }
-    } else if (strcmp(buf, "motor=off") == 0) {
-      ESP_LOGI(LOG_TAG, "Will set motor to OFF state");
-      desired_motor_state = false;
-      if (pdTRUE != xQueueSend(task_args->motor_on_off_q, (void *) &desired_motor_state,
-			       pdMS_TO_TICKS(1000))) {
-	ESP_LOGE(LOG_TAG, "failed to enqueue motor OFF");
+    remaining -= len;
+  }
+  elapsed_ms = (esp_timer_get_time() - start) / 1000;
+
+  if (!ota_writer_finish(writer, have_digest ? expected_sha256 : NULL)) {
+    free(buf);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+			"Image verification failed");
+    return ESP_FAIL;
+  }
+
+  snprintf(buf, OTA_UPLOAD_BLOCK_SIZE,
+	   "Received %u bytes in %lld ms (%lld KB/s), digest %s; staged, will "
+	   "restart once the motor is idle\n",
+	   req->content_len, elapsed_ms,
+	   (elapsed_ms > 0) ? ((int64_t) req->content_len / elapsed_ms) : 0LL,
+	   have_digest ? "verified" : "not checked");
+  ESP_LOGI(LOG_TAG, "%s", buf);
+  httpd_resp_sendstr(req, buf);
+  free(buf);
+  return ESP_OK;
+}
+
+static httpd_uri_t mc_ota_uri = {
+    .uri       = "/mc_ota",
+    .method    = HTTP_POST,
+    .handler   = mc_ota_handler,
+    .user_ctx  = NULL
+};
+
+static void release_log_subscriber (void) {
+  taskENTER_CRITICAL(&log_subscribers_lock);
+  log_subscribers--;
+  taskEXIT_CRITICAL(&log_subscribers_lock);
+}
+
+/* Runs for as long as one /mc_logs client stays connected. The log ring is
+   shared: the writers never wait for a subscriber, and a subscriber that
+   falls more than a ring's worth behind is told so and disconnected. */
+static void log_stream_task (void *param) {
+  httpd_req_t *req = (httpd_req_t *) param;
+  char *chunk;
+  uint32_t cursor, lost;
+  size_t len;
+  bool connected = true;
+
+  chunk = malloc(LOG_STREAM_CHUNK_SIZE);
+  if (!chunk) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for log stream");
+    httpd_resp_send_408(req);
+    connected = false;
+  }
+
+  /* Start with what is still in the ring */
+  cursor = log_ring_tail();
+  while (connected) {
+    len = log_ring_read(&cursor, chunk, LOG_STREAM_CHUNK_SIZE, &lost);
+    if (lost) {
+      len = snprintf(chunk, LOG_STREAM_CHUNK_SIZE,
+		     "---- fell %lu bytes behind, disconnecting ----\n",
+		     (unsigned long) lost);
+      httpd_resp_send_chunk(req, chunk, len);
+      taskENTER_CRITICAL(&log_subscribers_lock);
+      log_subscribers_dropped++;
+      taskEXIT_CRITICAL(&log_subscribers_lock);
+      break;
+    }
+    if (len > 0) {
+      if (ESP_OK != httpd_resp_send_chunk(req, chunk, len)) {
+	/* The client went away */
+	connected = false;
       }
     } else {
-      ESP_LOGE(LOG_TAG, "cannot understand motor desired state \"%s\"", buf);
-      free(buf);
-      httpd_resp_send_408(req);
+      vTaskDelay(pdMS_TO_TICKS(LOG_STREAM_POLL_MS));
+    }
+  }
+  if (connected) {
+    httpd_resp_send_chunk(req, NULL, 0);
+  }
+  free(chunk);
+
+  if (httpd_req_async_handler_complete(req) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "httpd_req_async_handler_complete failed");
+  }
+  release_log_subscriber();
+  vTaskDelete(NULL);
+}
+
+static esp_err_t mc_logs_handler (httpd_req_t *req) {
+  httpd_req_t *copy = NULL;
+  bool slot_taken = false;
+
+  count_request();
+  taskENTER_CRITICAL(&log_subscribers_lock);
+  if (log_subscribers < LOG_SUBSCRIBERS) {
+    log_subscribers++;
+    slot_taken = true;
+  }
+  taskEXIT_CRITICAL(&log_subscribers_lock);
+  if (!slot_taken) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_sendstr(req, "Too many log subscribers, try again later");
+    return ESP_OK;
+  }
+
+  httpd_resp_set_type(req, "text/plain");
+  if (ESP_OK != httpd_req_async_handler_begin(req, &copy)) {
+    ESP_LOGE(LOG_TAG, "Unable to start log stream");
+    release_log_subscriber();
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  if (pdPASS != xTaskCreatePinnedToCore(log_stream_task, "Log Stream", 3072, copy,
+					MC_PRIO_LOGGING, NULL, MC_NETWORK_CORE)) {
+    ESP_LOGE(LOG_TAG, "Unable to start log stream task");
+    release_log_subscriber();
+    /* The request was handed over to the copy, which answers it */
+    httpd_resp_send_500(copy);
+    httpd_req_async_handler_complete(copy);
+  }
+  return ESP_OK;
+}
+
+static httpd_uri_t mc_logs_uri = {
+    .uri       = "/mc_logs",
+    .method    = HTTP_GET,
+    .handler   = mc_logs_handler,
+    .user_ctx  = NULL
+};
+
+/* Streams the core dump straight from flash, a small chunk at a time. It is
+   the raw contents of the coredump partition, for
+   `espcoredump.py info_corefile --core-format raw`. */
+#define COREDUMP_CHUNK_SIZE 1024
+static esp_err_t mc_coredump_handler (httpd_req_t *req) {
+  char *chunk;
+  size_t size, offset, len;
+  esp_err_t ret;
+
+  /* Sending tens of KB from flash takes a while */
+  if (offload_to_async_worker(req, mc_coredump_handler, &ret)) {
+    return ret;
+  }
+  count_request();
+
+  if (!coredump_available(&size)) {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No core dump");
+    return ESP_OK;
+  }
+
+  if (req->method == HTTP_DELETE) {
+    if (!coredump_erase()) {
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Erase failed");
       return ESP_FAIL;
     }
-  } else {
-    ESP_LOGE(LOG_TAG, "POST handler: unable to parse control word");
+    httpd_resp_send(req, NULL, 0);
+    return ESP_OK;
+  }
+
+  chunk = malloc(COREDUMP_CHUNK_SIZE);
+  if (!chunk) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for core dump");
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+  httpd_resp_set_type(req, "application/octet-stream");
+  httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"mc_coredump.bin\"");
+  for (offset = 0; offset < size; offset += len) {
+    len = size - offset;
+    if (len > COREDUMP_CHUNK_SIZE) {
+      len = COREDUMP_CHUNK_SIZE;
+    }
+    if (!coredump_read(offset, chunk, len)) {
+      ESP_LOGE(LOG_TAG, "Unable to read core dump at %u", (unsigned) offset);
+      break;
+    }
+    if (ESP_OK != httpd_resp_send_chunk(req, chunk, len)) {
+      ESP_LOGE(LOG_TAG, "Unable to send core dump");
+      free(chunk);
+      return ESP_FAIL;
+    }
+  }
+  free(chunk);
+  /* A short dump (read error) is caught by the checksum on the other end */
+  httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+static httpd_uri_t mc_coredump_uri = {
+    .uri       = "/mc_coredump",
+    .method    = HTTP_GET,
+    .handler   = mc_coredump_handler,
+    .user_ctx  = NULL
+};
+
+static httpd_uri_t mc_coredump_delete_uri = {
+    .uri       = "/mc_coredump",
+    .method    = HTTP_DELETE,
+    .handler   = mc_coredump_handler,
+    .user_ctx  = NULL
+};
+
+#ifdef CONFIG_WLM_TRACE
+/* Export the trace rings as text, for tools/trace2chrome.py:
+     cpu_ticks_per_us=<n>
+     tick_hz=<n>
+     event <number> <name>            (one per event type)
+     task <handle> <name>             (one per task seen in the records)
+     r <core> <cycles> <ticks> <task handle> <event> <arg>
+   Tracing is paused during the export. All the traced tasks live forever,
+   so their handles are safe to look up. */
+#define TRACE_EXPORT_RECORDS 16
+#define TRACE_EXPORT_LINE_SIZE 64
+#define TRACE_EXPORT_MAX_TASKS 16
+static esp_err_t mc_trace_handler (httpd_req_t *req) {
+  struct trace_record_t_ *records;
+  char *buf;
+  uint32_t tasks[TRACE_EXPORT_MAX_TASKS];
+  uint32_t cursor;
+  size_t n, i, len;
+  int core, num_tasks = 0, t;
+  uint16_t event;
+  esp_err_t ret = ESP_OK;
+
+  /* Formatting and sending every record of both rings takes a while */
+  if (offload_to_async_worker(req, mc_trace_handler, &ret)) {
+    return ret;
+  }
+  count_request();
+  records = malloc(TRACE_EXPORT_RECORDS * sizeof(*records));
+  buf = malloc(TRACE_EXPORT_RECORDS * TRACE_EXPORT_LINE_SIZE);
+  if (!records || !buf) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffers for trace export");
+    free(records);
     free(buf);
     httpd_resp_send_408(req);
     return ESP_FAIL;
   }
 
-  /* Respond with empty body */
-  httpd_resp_send(req, NULL, 0);
+  trace_pause(true);
+  httpd_resp_set_type(req, "text/plain");
+  len = snprintf(buf, TRACE_EXPORT_LINE_SIZE, "cpu_ticks_per_us=%lu\ntick_hz=%lu\n",
+		 (unsigned long) trace_cycles_per_us(),
+		 (unsigned long) configTICK_RATE_HZ);
+  httpd_resp_send_chunk(req, buf, len);
+  for (event = 1; event < TRACE_EVENTS; event++) {
+    len = snprintf(buf, TRACE_EXPORT_LINE_SIZE, "event %u %s\n", event,
+		   trace_event_name(event));
+    httpd_resp_send_chunk(req, buf, len);
+  }
+
+  /* First pass for the task names */
+  for (core = 0; core < portNUM_PROCESSORS; core++) {
+    cursor = 0;
+    while ((n = trace_read(core, &cursor, records, TRACE_EXPORT_RECORDS)) > 0) {
+      for (i = 0; i < n; i++) {
+	for (t = 0; (t < num_tasks) && (tasks[t] != records[i].task); t++) {
+	}
+	if ((t == num_tasks) && (num_tasks < TRACE_EXPORT_MAX_TASKS)) {
+	  tasks[num_tasks++] = records[i].task;
+	  len = snprintf(buf, TRACE_EXPORT_LINE_SIZE, "task 0x%08lx %s\n",
+			 (unsigned long) records[i].task,
+			 pcTaskGetName((TaskHandle_t) records[i].task));
+	  httpd_resp_send_chunk(req, buf, len);
+	}
+      }
+    }
+  }
+
+  for (core = 0; (core < portNUM_PROCESSORS) && (ret == ESP_OK); core++) {
+    cursor = 0;
+    while ((n = trace_read(core, &cursor, records, TRACE_EXPORT_RECORDS)) > 0) {
+      len = 0;
+      for (i = 0; i < n; i++) {
+	len += snprintf(buf + len, TRACE_EXPORT_LINE_SIZE, "r %d %lu %lu 0x%08lx %u %u\n",
+			core, (unsigned long) records[i].cycles,
+			(unsigned long) records[i].ticks,
+			(unsigned long) records[i].task,
+			records[i].event, records[i].arg);
+      }
+      ret = httpd_resp_send_chunk(req, buf, len);
+      if (ret != ESP_OK) {
+	ESP_LOGE(LOG_TAG, "Unable to send trace");
+	break;
+      }
+    }
+  }
+  trace_pause(false);
+
+  if (ret == ESP_OK) {
+    httpd_resp_send_chunk(req, NULL, 0);
+  }
+  free(records);
   free(buf);
+  return ret;
+}
+
+static httpd_uri_t mc_trace_uri = {
+    .uri       = "/mc_trace",
+    .method    = HTTP_GET,
+    .handler   = mc_trace_handler,
+    .user_ctx  = NULL
+};
+#endif
+
+/* The sensor trace recorded by oh_tank_level_task, in the binary format
+   described in tank_filter.h, for tools/tank_replay.c */
+#define SENSOR_TRACE_CHUNK_RECORDS 256
+static esp_err_t mc_sensor_trace_handler (httpd_req_t *req) {
+  struct sensor_trace_header_t_ header;
+  uint16_t *records;
+  size_t index, n;
+  esp_err_t ret;
+
+  /* Up to a few thousand records, sent in chunks */
+  if (offload_to_async_worker(req, mc_sensor_trace_handler, &ret)) {
+    return ret;
+  }
+  count_request();
+  if (!sensor_trace_get_header(&header)) {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND,
+			"No sensor trace, start one with sensor-trace=start");
+    return ESP_OK;
+  }
+
+  records = malloc(SENSOR_TRACE_CHUNK_RECORDS * sizeof(uint16_t));
+  if (!records) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for sensor trace");
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+  httpd_resp_set_type(req, "application/octet-stream");
+  httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"trace.mcst\"");
+  if (ESP_OK != httpd_resp_send_chunk(req, (char const *) &header, sizeof(header))) {
+    free(records);
+    return ESP_FAIL;
+  }
+  for (index = 0; index < header.count; index += n) {
+    n = header.count - index;
+    if (n > SENSOR_TRACE_CHUNK_RECORDS) {
+      n = SENSOR_TRACE_CHUNK_RECORDS;
+    }
+    sensor_trace_read(index, records, n);
+    if (ESP_OK != httpd_resp_send_chunk(req, (char const *) records, n * sizeof(uint16_t))) {
+      ESP_LOGE(LOG_TAG, "Unable to send sensor trace");
+      free(records);
+      return ESP_FAIL;
+    }
+  }
+  free(records);
+  httpd_resp_send_chunk(req, NULL, 0);
   return ESP_OK;
 }
 
-static httpd_uri_t mc_ctrl_uri = {
-    .uri       = "/mc_ctrl",
-    .method    = HTTP_POST,
-    .handler   = mc_ctrl_handler,
+static httpd_uri_t mc_sensor_trace_uri = {
+    .uri       = "/mc_sensor_trace",
+    .method    = HTTP_GET,
+    .handler   = mc_sensor_trace_handler,
+    .user_ctx  = NULL
+};
+
+/* Heap report: the heap trace (see heap_mon.c) with its outstanding
+   allocations by caller, then the heap history, oldest sample first. Turn
+   the caller addresses into functions with
+     xtensa-esp32-elf-addr2line -pfiaC -e build/mc.elf <addresses> */
+#define HEAP_REPORT_CHUNK_SIZE 1536
+static esp_err_t mc_heap_handler (httpd_req_t *req) {
+  char *chunk;
+  size_t index = 0;
+  int len;
+  esp_err_t ret;
+
+  /* Walking the trace records takes the heap trace lock once per record */
+  if (offload_to_async_worker(req, mc_heap_handler, &ret)) {
+    return ret;
+  }
+  count_request();
+
+  chunk = malloc(HEAP_REPORT_CHUNK_SIZE);
+  if (!chunk) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for heap report");
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+  len = heap_mon_format_trace(chunk, HEAP_REPORT_CHUNK_SIZE);
+  if (len < 0) {
+    free(chunk);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Heap trace unavailable");
+    return ESP_FAIL;
+  }
+  if (len > HEAP_REPORT_CHUNK_SIZE - 1) {
+    /* Cut at the last full line */
+    chunk[HEAP_REPORT_CHUNK_SIZE - 1] = '\0';
+    len = strrchr(chunk, '\n') + 1 - chunk;
+  }
+  httpd_resp_set_type(req, "text/plain");
+  while (len > 0) {
+    if (ESP_OK != httpd_resp_send_chunk(req, chunk, len)) {
+      ESP_LOGE(LOG_TAG, "Unable to send heap report");
+      free(chunk);
+      return ESP_FAIL;
+    }
+    len = heap_mon_format_history(&index, chunk, HEAP_REPORT_CHUNK_SIZE);
+  }
+  free(chunk);
+  httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+static httpd_uri_t mc_heap_uri = {
+    .uri       = "/mc_heap",
+    .method    = HTTP_GET,
+    .handler   = mc_heap_handler,
+    .user_ctx  = NULL
+};
+
+/* Wi-Fi round trip probe, under each power save profile in turn, e.g.
+     curl http://192.168.29.9/mc_rtt?count=20
+   Takes count * 0.5 seconds per profile, 30 seconds at most with every ping
+   answered, so it runs on a task of its own rather than holding one of the
+   async workers. The profile in use before is put back afterwards. One run
+   at a time: an overlapping one would measure the other's profile, and put
+   back the wrong one. Not while the motor runs, when the auto profile keeps
+   power save off; a run that sees the motor start stops there. */
+#define RTT_DEFAULT_COUNT 10
+#define RTT_MAX_COUNT 20
+#define RTT_INTERVAL_MS 500
+#define RTT_RESPONSE_SIZE 384
+static bool rtt_running = false;
+static unsigned long rtt_count;
+static portMUX_TYPE rtt_running_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool is_motor_running (httpd_req_t *req) {
+  struct mc_task_args_t_ *task_args = (struct mc_task_args_t_ *) req->user_ctx;
+
+  return task_args &&
+    (xEventGroupGetBits(task_args->mc_event_group) & EVENT_MOTOR_RUNNING);
+}
+
+static void rtt_done (void) {
+  taskENTER_CRITICAL(&rtt_running_lock);
+  rtt_running = false;
+  taskEXIT_CRITICAL(&rtt_running_lock);
+}
+
+static void rtt_probe_task (void *param) {
+  static enum wifi_ps_profile_t_ const profiles[] = {
+    WIFI_PS_PROFILE_NONE, WIFI_PS_PROFILE_MIN, WIFI_PS_PROFILE_MAX
+  };
+  httpd_req_t *req = (httpd_req_t *) param;
+  struct wifi_rtt_result_t_ result;
+  enum wifi_ps_profile_t_ saved_profile;
+  char *response;
+  int len = 0;
+  size_t i;
+
+  response = malloc(RTT_RESPONSE_SIZE);
+  if (!response) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for rtt response");
+    httpd_resp_send_500(req);
+  } else {
+    power_lock(POWER_LOCK_HTTP);
+    saved_profile = wifi_ps_get_profile(NULL);
+    for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+      if (is_motor_running(req)) {
+	len += snprintf(response + len, RTT_RESPONSE_SIZE - len,
+			"profile=%s skipped, the motor is running\n",
+			wifi_ps_profile_name(profiles[i]));
+	break;
+      }
+      wifi_ps_set_profile(profiles[i]);
+      if (!wifi_rtt_probe(rtt_count, RTT_INTERVAL_MS, &result)) {
+	len += snprintf(response + len, RTT_RESPONSE_SIZE - len, "profile=%s failed\n",
+			wifi_ps_profile_name(profiles[i]));
+	continue;
+      }
+      len += snprintf(response + len, RTT_RESPONSE_SIZE - len,
+		      "profile=%s sent=%lu received=%lu min_ms=%lu avg_ms=%lu max_ms=%lu\n",
+		      wifi_ps_profile_name(profiles[i]), (unsigned long) result.sent,
+		      (unsigned long) result.received, (unsigned long) result.min_ms,
+		      (unsigned long) (result.received ? result.total_ms / result.received : 0),
+		      (unsigned long) result.max_ms);
+    }
+    wifi_ps_set_profile(saved_profile);
+    power_unlock(POWER_LOCK_HTTP);
+
+    if (ESP_OK != httpd_resp_send(req, response, len)) {
+      ESP_LOGE(LOG_TAG, "Unable to send response to rtt req");
+    }
+    free(response);
+  }
+
+  if (httpd_req_async_handler_complete(req) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "httpd_req_async_handler_complete failed");
+  }
+  rtt_done();
+  vTaskDelete(NULL);
+}
+
+static esp_err_t mc_rtt_handler (httpd_req_t *req) {
+  char query[32], value[8];
+  unsigned long count = RTT_DEFAULT_COUNT;
+  httpd_req_t *copy = NULL;
+  bool busy;
+
+  count_request();
+  if ((httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) &&
+      (httpd_query_key_value(query, "count", value, sizeof(value)) == ESP_OK)) {
+    count = strtoul(value, NULL, 10);
+    if ((count == 0) || (count > RTT_MAX_COUNT)) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "count must be 1 to 20");
+      return ESP_OK;
+    }
+  }
+  if (is_motor_running(req)) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_sendstr(req, "The motor is running, try again once it stops");
+    return ESP_OK;
+  }
+
+  taskENTER_CRITICAL(&rtt_running_lock);
+  busy = rtt_running;
+  rtt_running = true;
+  taskEXIT_CRITICAL(&rtt_running_lock);
+  if (busy) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_sendstr(req, "A round trip probe is already running, try again later");
+    return ESP_OK;
+  }
+  rtt_count = count;
+
+  if (ESP_OK != httpd_req_async_handler_begin(req, &copy)) {
+    ESP_LOGE(LOG_TAG, "Unable to start the rtt probe");
+    rtt_done();
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  if (pdPASS != xTaskCreatePinnedToCore(rtt_probe_task, "RTT Probe", 3072, copy,
+					MC_PRIO_HTTP_WORKER, NULL, MC_NETWORK_CORE)) {
+    ESP_LOGE(LOG_TAG, "Unable to start the rtt probe");
+    rtt_done();
+    httpd_resp_send_500(copy);
+    httpd_req_async_handler_complete(copy);
+  }
+  return ESP_OK;
+}
+
+static httpd_uri_t mc_rtt_uri = {
+    .uri       = "/mc_rtt",
+    .method    = HTTP_GET,
+    .handler   = mc_rtt_handler,
+    .user_ctx  = NULL /* will be filled in in start_webserver */
+};
+
+#ifdef CONFIG_WLM_BENCH
+/* Run the hot path microbenchmarks (bench.c), e.g.
+     curl http://192.168.29.9/mc_bench > bench-$(cat version.txt)-os.txt */
+static esp_err_t mc_bench_handler (httpd_req_t *req) {
+  struct mc_task_args_t_ *task_args = (struct mc_task_args_t_ *) req->user_ctx;
+  char *response;
+  int len;
+  esp_err_t ret;
+
+  if (offload_to_async_worker(req, mc_bench_handler, &ret)) {
+    return ret;
+  }
+  count_request();
+
+  response = malloc(BENCH_REPORT_SIZE);
+  if (!response) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for bench response");
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+  len = bench_run(task_args, response, BENCH_REPORT_SIZE);
+  if (len < 0) {
+    free(response);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Benchmark failed or busy");
+    return ESP_OK;
+  }
+  if (ESP_OK != httpd_resp_send(req, response, len)) {
+    ESP_LOGE(LOG_TAG, "Unable to send response to bench req");
+    free(response);
+    return ESP_FAIL;
+  }
+  free(response);
+  return ESP_OK;
+}
+
+static httpd_uri_t mc_bench_uri = {
+    .uri       = "/mc_bench",
+    .method    = HTTP_GET,
+    .handler   = mc_bench_handler,
     .user_ctx  = NULL /* will be filled in in start_webserver */
 };
+#endif
+
+#define STATS_RESPONSE_SIZE 2048
+/* Runtime statistics in `name=value` lines, one per line. This is meant to be
+   read by tools (see tools/http_bench.py), so keep the names stable and only
+   ever add new lines. */
+static esp_err_t mc_stats_handler (httpd_req_t *req) {
+  char *response;
+  int len;
+  uint32_t ota_attempts, ota_handshake_ms, ota_heap_used_peak;
+  uint32_t jitter_samples, beacons_sent, beacons_failed, requests_served;
+  int32_t jitter_min_us, jitter_max_us;
+  enum wifi_ps_profile_t_ wifi_ps_profile, wifi_ps_applied;
+
+  count_request();
+  response = malloc(STATS_RESPONSE_SIZE);
+  if (!response) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate buffer for stats response");
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+
+  taskENTER_CRITICAL(&http_stats_lock);
+  requests_served = http_requests_served;
+  taskEXIT_CRITICAL(&http_stats_lock);
+  ota_get_stats(&ota_attempts, &ota_handshake_ms, &ota_heap_used_peak);
+  oh_tank_level_jitter(&jitter_samples, &jitter_min_us, &jitter_max_us);
+  beacon_get_stats(&beacons_sent, &beacons_failed);
+  wifi_ps_profile = wifi_ps_get_profile(&wifi_ps_applied);
+  len = snprintf(response, STATS_RESPONSE_SIZE,
+		 "uptime_ms=%llu\n"
+		 "free_heap=%lu\n"
+		 "min_free_heap=%lu\n"
+		 "largest_free_block=%u\n"
+		 "httpd_max_open_sockets=%u\n"
+		 "httpd_requests=%lu\n"
+		 "ota_attempts=%lu\n"
+		 "ota_handshake_ms=%lu\n"
+		 "ota_heap_used_peak=%lu\n"
+		 "log_subscribers=%d\n"
+		 "log_subscribers_dropped=%lu\n"
+		 "tank_jitter_samples=%lu\n"
+		 "tank_jitter_min_us=%ld\n"
+		 "tank_jitter_max_us=%ld\n"
+		 "beacons_sent=%lu\n"
+		 "beacons_failed=%lu\n"
+		 "wifi_ps_profile=%s\n"
+		 "wifi_ps=%s\n",
+		 (unsigned long long) (esp_timer_get_time() / 1000),
+		 (unsigned long) esp_get_free_heap_size(),
+		 (unsigned long) esp_get_minimum_free_heap_size(),
+		 (unsigned) heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+		 http_max_open_sockets,
+		 (unsigned long) requests_served,
+		 (unsigned long) ota_attempts,
+		 (unsigned long) ota_handshake_ms,
+		 (unsigned long) ota_heap_used_peak,
+		 log_subscribers,
+		 (unsigned long) log_subscribers_dropped,
+		 (unsigned long) jitter_samples,
+		 (long) jitter_min_us,
+		 (long) jitter_max_us,
+		 (unsigned long) beacons_sent,
+		 (unsigned long) beacons_failed,
+		 wifi_ps_profile_name(wifi_ps_profile),
+		 wifi_ps_profile_name(wifi_ps_applied));
+  if ((len >= 0) && (len < STATS_RESPONSE_SIZE)) {
+    len += oh_tank_level_format_stats(response + len, STATS_RESPONSE_SIZE - len);
+  }
+  if ((len >= 0) && (len < STATS_RESPONSE_SIZE)) {
+    len += supervisor_format_stats(response + len, STATS_RESPONSE_SIZE - len);
+  }
+  if ((len >= 0) && (len < STATS_RESPONSE_SIZE)) {
+    len += power_format_stats(response + len, STATS_RESPONSE_SIZE - len);
+  }
+  if ((len >= 0) && (len < STATS_RESPONSE_SIZE)) {
+    len += heap_mon_format_stats(response + len, STATS_RESPONSE_SIZE - len);
+  }
+  if ((len >= 0) && (len < STATS_RESPONSE_SIZE)) {
+    len += replica_format_stats(response + len, STATS_RESPONSE_SIZE - len);
+  }
+  if ((len < 0) || (len >= STATS_RESPONSE_SIZE)) {
+    ESP_LOGE(LOG_TAG, "Buffer too small for stats response");
+    free(response);
+    httpd_resp_send_408(req);
+    return ESP_FAIL;
+  }
+
+  if (ESP_OK != httpd_resp_send(req, response, len)) {
+    ESP_LOGE(LOG_TAG, "Unable to send response to stats req");
+    free(response);
+    return ESP_FAIL;
+  }
+  free(response);
+  return ESP_OK;
+}
+
+static httpd_uri_t mc_stats_uri = {
+    .uri       = "/mc_stats",
+    .method    = HTTP_GET,
+    .handler   = mc_stats_handler,
+    .user_ctx  = NULL
+};
 
 static httpd_handle_t start_webserver (struct mc_task_args_t_ *task_args) {
   httpd_handle_t server = NULL;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 
+  /* Several dashboards polling with keep-alive connections quickly use up
+     the default 7 sockets. With LRU purge on, the least recently used
+     connection is closed to make room for a new one instead of the new one
+     being refused. TCP keep-alive reaps the connections of clients that went
+     away without closing. */
+  config.max_open_sockets = CONFIG_WLM_HTTPD_MAX_OPEN_SOCKETS;
+  config.backlog_conn = CONFIG_WLM_HTTPD_BACKLOG_CONN;
+  config.lru_purge_enable = true;
+  config.task_priority = MC_PRIO_HTTPD;
+  config.core_id = MC_NETWORK_CORE;
+  config.max_uri_handlers = 16;
+  config.recv_wait_timeout = CONFIG_WLM_HTTPD_RECV_TIMEOUT_S;
+  config.send_wait_timeout = CONFIG_WLM_HTTPD_SEND_TIMEOUT_S;
+#ifdef CONFIG_WLM_HTTPD_KEEP_ALIVE
+  config.keep_alive_enable = true;
+  config.keep_alive_idle = CONFIG_WLM_HTTPD_KEEP_ALIVE_IDLE_S;
+  config.keep_alive_interval = CONFIG_WLM_HTTPD_KEEP_ALIVE_INTERVAL_S;
+  config.keep_alive_count = CONFIG_WLM_HTTPD_KEEP_ALIVE_COUNT;
+#endif
+
   /* Start the httpd server */
   ESP_LOGI(LOG_TAG, "starting server on port: '%d'", config.server_port);
   
   if (httpd_start(&server, &config) == ESP_OK) {
     /* Set URI handlers */
     ESP_LOGI(LOG_TAG, "server started, registering URI handlers");
+    http_max_open_sockets = config.max_open_sockets;
     mc_status_uri.user_ctx = task_args;
     mc_ctrl_uri.user_ctx = task_args;
+    mc_rtt_uri.user_ctx = task_args;
     httpd_register_uri_handler(server, &mc_status_uri);
     httpd_register_uri_handler(server, &mc_ctrl_uri);
     httpd_register_uri_handler(server, &mc_version_info_uri);
+    httpd_register_uri_handler(server, &mc_stats_uri);
+    httpd_register_uri_handler(server, &mc_ota_uri);
+    httpd_register_uri_handler(server, &mc_logs_uri);
+    httpd_register_uri_handler(server, &mc_coredump_uri);
+    httpd_register_uri_handler(server, &mc_coredump_delete_uri);
+    httpd_register_uri_handler(server, &mc_sensor_trace_uri);
+    httpd_register_uri_handler(server, &mc_rtt_uri);
+    httpd_register_uri_handler(server, &mc_heap_uri);
+#ifdef CONFIG_WLM_TRACE
+    httpd_register_uri_handler(server, &mc_trace_uri);
+#endif
+#ifdef CONFIG_WLM_BENCH
+    mc_bench_uri.user_ctx = task_args;
+    httpd_register_uri_handler(server, &mc_bench_uri);
+#endif
     return server;
   }
 
@@ -315,6 +1414,9 @@ void http_server_task (void *param) {
   httpd_handle_t server = NULL;
   EventBits_t bits;
   struct mc_task_args_t_ *mc_task_args = (struct mc_task_args_t_ *) param;
+
+  /* The workers outlive the server, which is restarted with the wifi */
+  start_async_workers();
   
   while (pdTRUE) {
     bits = xEventGroupWaitBits(mc_task_args->mc_event_group,
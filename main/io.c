@@ -0,0 +1,109 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#include "esp_log.h"
+#include "io.h"
+#include "trace.h"
+
+static char const *LOG_TAG = "mc|io";
+
+/* The ESP32 backend of io.h */
+static gpio_num_t const input_pins[IO_INPUTS] = {
+  [IO_MOTOR_RUNNING_SENSE] = GPIO_NUM_4,
+  [IO_WATER_LEVEL] = GPIO_NUM_39,
+};
+
+static gpio_num_t const output_pins[IO_OUTPUTS] = {
+  [IO_BEEP] = GPIO_NUM_27,
+  [IO_ERR_STATUS] = GPIO_NUM_33,
+  [IO_MOTOR] = GPIO_NUM_32,
+  [IO_WATER_LEVEL_ENABLE] = GPIO_NUM_13,
+};
+
+static struct io_snapshot_t_ snapshot;
+static bool snapshot_taken = false;
+static portMUX_TYPE snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void set_motor_out_line_high (void) {
+  /* The relay we use for the MOTOR_OUT function is Active Low, i.e. contacts
+     are in Normal state when the GPIO is High, and click to non-Normal state
+     when GPIO goes low. At bootup we want contacts to be in their Normal states
+     so we set the MOTOR_OUT GPIO line to High.*/
+  gpio_set_level(output_pins[IO_MOTOR], 1);
+}
+
+void io_init (void) {
+  gpio_config_t gpio_conf;
+  unsigned int i;
+
+  /* Seems a little weird to be doing this BEFORE configuring the GPIO pins,
+     but it works. If we don't do this, our relay will click for an instant when
+     our board is booting up, which we don't want */
+  set_motor_out_line_high();
+
+  /* Set up the GPIO output pins */
+  memset(&gpio_conf, 0, sizeof(gpio_conf));
+  gpio_conf.intr_type = GPIO_INTR_DISABLE;
+  gpio_conf.mode = GPIO_MODE_OUTPUT;
+  for (i = 0; i < IO_OUTPUTS; i++) {
+    gpio_conf.pin_bit_mask |= 1ull << output_pins[i];
+  }
+  gpio_conf.pull_down_en = 0;
+  gpio_conf.pull_up_en = 0;
+  if (gpio_config(&gpio_conf) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to init GPIOs for outputs");
+    return;
+  }
+
+  /* May not be needed because we've already done it. But it looks like a
+     polite thing to do now, after formally configuring the GPIO outputs */
+  set_motor_out_line_high();
+
+  memset(&gpio_conf, 0, sizeof(gpio_conf));
+  gpio_conf.intr_type = GPIO_INTR_DISABLE;
+  gpio_conf.mode = GPIO_MODE_INPUT;
+  for (i = 0; i < IO_INPUTS; i++) {
+    gpio_conf.pin_bit_mask |= 1ull << input_pins[i];
+  }
+  gpio_conf.pull_down_en = 1;
+
+  if (gpio_config(&gpio_conf) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to init GPIO for input");
+  }
+}
+
+/* The inputs of this tick. The first reader in a tick reads both input
+   registers (GPIO0-31 and GPIO32-39) in one go, instead of a
+   gpio_get_level() per pin; the others get a copy. */
+void io_snapshot (struct io_snapshot_t_ *copy) {
+  TickType_t now = xTaskGetTickCount();
+  uint64_t levels;
+  unsigned int i;
+
+  taskENTER_CRITICAL(&snapshot_lock);
+  if (!snapshot_taken || (snapshot.tick != now)) {
+    levels = REG_READ(GPIO_IN_REG) |
+      ((uint64_t) (REG_READ(GPIO_IN1_REG) & 0xff) << 32); /* GPIO32-39 */
+    snapshot.inputs = 0;
+    for (i = 0; i < IO_INPUTS; i++) {
+      snapshot.inputs |= ((levels >> input_pins[i]) & 1) << i;
+    }
+    snapshot.tick = now;
+    snapshot.seq++;
+    snapshot_taken = true;
+  }
+  *copy = snapshot;
+  taskEXIT_CRITICAL(&snapshot_lock);
+}
+
+void io_set (enum io_output_t_ output, uint32_t level) {
+  gpio_set_level(output_pins[output], level);
+  MC_TRACE(TRACE_GPIO_WRITE, TRACE_GPIO_ARG(output_pins[output], level));
+}
+
+uint16_t io_trace_arg (enum io_input_t_ input, uint32_t level) {
+  return TRACE_GPIO_ARG(input_pins[input], level);
+}
@@ -0,0 +1,48 @@
+#ifndef __IO_H__
+#define __IO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The unit's inputs and outputs, by what they do rather than by pin. The pins
+   are in the backend: io.c on the ESP32. io_mock.c is the host one, where the
+   inputs are set and the outputs read back by the caller, so that the control
+   path runs and is timed without the board (tools/control_host.c).
+
+   Inputs are read as a snapshot of all of them at once, taken at most once a
+   tick: every reader in the same tick gets the same one, so the decisions
+   taken on a tick all see one consistent sample of the inputs. */
+
+enum io_input_t_ {
+  IO_MOTOR_RUNNING_SENSE,
+  IO_WATER_LEVEL,
+  IO_INPUTS
+};
+
+enum io_output_t_ {
+  IO_BEEP,
+  IO_ERR_STATUS,
+  IO_MOTOR,			/* active low relay, toggled to turn the motor on/off */
+  IO_WATER_LEVEL_ENABLE,	/* powers the probe */
+  IO_OUTPUTS
+};
+
+struct io_snapshot_t_ {
+  uint32_t inputs;		/* bit per enum io_input_t_ */
+  uint32_t tick;		/* FreeRTOS tick it was taken on */
+  uint32_t seq;			/* of the snapshots taken */
+};
+
+#define IO_LEVEL(snapshot, input) (((snapshot)->inputs >> (input)) & 1)
+
+extern void io_init(void);
+extern void io_snapshot(struct io_snapshot_t_ *snapshot);
+extern void io_set(enum io_output_t_ output, uint32_t level);
+/* TRACE_GPIO_READ argument for an input, by its pin */
+extern uint16_t io_trace_arg(enum io_input_t_ input, uint32_t level);
+
+/* io_mock.c only */
+extern void io_mock_set_input(enum io_input_t_ input, uint32_t level);
+extern uint32_t io_mock_get_output(enum io_output_t_ output);
+
+#endif
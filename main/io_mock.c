@@ -0,0 +1,61 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "io.h"
+#include "trace.h"
+
+/* The host backend of io.h: no pins, just levels. The inputs are
+   whatever io_mock_set_input() last set, sampled a tick at a time as on the
+   board; the outputs are kept for io_mock_get_output(). Trace records carry
+   the io.h input or output number in place of the pin. */
+
+static uint32_t mock_inputs = 0;
+static uint32_t mock_outputs = 0;
+static struct io_snapshot_t_ snapshot;
+static bool snapshot_taken = false;
+static portMUX_TYPE io_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void io_init (void) {
+  /* As on the board, the motor relay starts in its Normal state */
+  mock_outputs = 1 << IO_MOTOR;
+}
+
+void io_snapshot (struct io_snapshot_t_ *copy) {
+  TickType_t now = xTaskGetTickCount();
+
+  taskENTER_CRITICAL(&io_lock);
+  if (!snapshot_taken || (snapshot.tick != now)) {
+    snapshot.inputs = mock_inputs;
+    snapshot.tick = now;
+    snapshot.seq++;
+    snapshot_taken = true;
+  }
+  *copy = snapshot;
+  taskEXIT_CRITICAL(&io_lock);
+}
+
+void io_set (enum io_output_t_ output, uint32_t level) {
+  taskENTER_CRITICAL(&io_lock);
+  mock_outputs = (mock_outputs & ~(1 << output)) | ((level & 1) << output);
+  taskEXIT_CRITICAL(&io_lock);
+  MC_TRACE(TRACE_GPIO_WRITE, TRACE_GPIO_ARG(output, level));
+}
+
+uint16_t io_trace_arg (enum io_input_t_ input, uint32_t level) {
+  return TRACE_GPIO_ARG(input, level);
+}
+
+/* Takes effect at the next tick's snapshot */
+void io_mock_set_input (enum io_input_t_ input, uint32_t level) {
+  taskENTER_CRITICAL(&io_lock);
+  mock_inputs = (mock_inputs & ~(1 << input)) | ((level & 1) << input);
+  taskEXIT_CRITICAL(&io_lock);
+}
+
+uint32_t io_mock_get_output (enum io_output_t_ output) {
+  uint32_t level;
+
+  taskENTER_CRITICAL(&io_lock);
+  level = (mock_outputs >> output) & 1;
+  taskEXIT_CRITICAL(&io_lock);
+  return level;
+}
@@ -0,0 +1,254 @@
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "mc.h"
+
+/* Per-tag log levels, settable with `loglevel=<tag>:<level>` on /mc_ctrl and
+   persisted in NVS as one string of "<tag>:<level>;" entries (tags are too
+   long to be NVS keys). esp_log_level_set() does the actual filtering, before
+   anything is formatted.
+
+   On top of that, each tag gets a token bucket: a burst of
+   CONFIG_WLM_LOG_RATE_LIMIT_BURST lines, refilled at
+   CONFIG_WLM_LOG_RATE_LIMIT_PER_S lines a second. Lines beyond that are
+   dropped before they are formatted, and counted; the next line that gets
+   through is preceded by an "N messages suppressed" summary. Errors are never
+   dropped. */
+#define LOG_LEVELS_NAMESPACE "mc_loglevel"
+#define LOG_LEVELS_KEY "levels"
+#define LOG_LEVELS_MAX_LEN 256
+#define LOG_RATE_LIMIT_TAGS 16
+
+struct log_bucket_t_ {
+  char const *tag;
+  uint32_t tokens_milli; /* tokens, in thousandths */
+  TickType_t last_refill;
+  uint32_t suppressed;
+};
+
+static struct log_bucket_t_ log_buckets[LOG_RATE_LIMIT_TAGS];
+static char const *LOG_TAG = "mc|log_filter";
+
+static char const *level_names[] = {
+  [ESP_LOG_NONE] = "none",
+  [ESP_LOG_ERROR] = "error",
+  [ESP_LOG_WARN] = "warn",
+  [ESP_LOG_INFO] = "info",
+  [ESP_LOG_DEBUG] = "debug",
+  [ESP_LOG_VERBOSE] = "verbose",
+};
+
+static bool parse_level (char const *name, size_t len, esp_log_level_t *level) {
+  int i;
+
+  for (i = ESP_LOG_NONE; i <= ESP_LOG_VERBOSE; i++) {
+    if ((strlen(level_names[i]) == len) && (strncmp(name, level_names[i], len) == 0)) {
+      *level = (esp_log_level_t) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Apply "<tag>:<level>" (tag "*" means all tags). `len` is the length of the
+   entry, which need not be NUL terminated. */
+static bool apply_level_entry (char const *entry, size_t len) {
+  char tag[32];
+  char const *colon;
+  esp_log_level_t level;
+
+  colon = memchr(entry, ':', len);
+  if (!colon || (colon == entry) || ((size_t) (colon - entry) >= sizeof(tag))) {
+    return false;
+  }
+  if (!parse_level(colon + 1, len - (colon + 1 - entry), &level)) {
+    return false;
+  }
+  memcpy(tag, entry, colon - entry);
+  tag[colon - entry] = '\0';
+  esp_log_level_set(tag, level);
+  return true;
+}
+
+/* Called from app_main once NVS is up */
+void log_levels_restore (void) {
+  nvs_handle_t nvs;
+  char *levels, *entry, *end;
+  size_t len = LOG_LEVELS_MAX_LEN;
+
+  if (nvs_open(LOG_LEVELS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+    return;
+  }
+  levels = malloc(LOG_LEVELS_MAX_LEN);
+  if (levels && (nvs_get_str(nvs, LOG_LEVELS_KEY, levels, &len) == ESP_OK)) {
+    for (entry = levels; *entry; entry = end + 1) {
+      end = strchr(entry, ';');
+      if (!end) {
+	break;
+      }
+      if (apply_level_entry(entry, end - entry)) {
+	ESP_LOGI(LOG_TAG, "Log level %.*s", (int) (end - entry), entry);
+      }
+    }
+  }
+  free(levels);
+  nvs_close(nvs);
+}
+
+/* Handle `loglevel=<tag>:<level>`; `arg` is what follows the '=' */
+bool log_level_command (char const *arg) {
+  nvs_handle_t nvs;
+  char *levels, *entry, *end;
+  size_t len = LOG_LEVELS_MAX_LEN, tag_len;
+  char const *colon;
+  bool ok = false;
+
+  if (!apply_level_entry(arg, strlen(arg))) {
+    ESP_LOGE(LOG_TAG, "\"%s\" is not <tag>:<none|error|warn|info|debug|verbose>", arg);
+    return false;
+  }
+  ESP_LOGI(LOG_TAG, "Log level %s", arg);
+
+  /* Persist it, replacing any earlier entry for the same tag */
+  if (nvs_open(LOG_LEVELS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to open NVS to save log level");
+    return false;
+  }
+  levels = calloc(1, LOG_LEVELS_MAX_LEN);
+  if (!levels) {
+    nvs_close(nvs);
+    return false;
+  }
+  if (nvs_get_str(nvs, LOG_LEVELS_KEY, levels, &len) != ESP_OK) {
+    levels[0] = '\0';
+  }
+
+  colon = strchr(arg, ':');
+  tag_len = colon - arg;
+  for (entry = levels; (end = strchr(entry, ';')) != NULL; ) {
+    if ((strncmp(entry, arg, tag_len + 1) == 0) ||
+	((tag_len == 1) && (arg[0] == '*'))) {
+      /* Drop this entry (a "*" entry overrides all the others) */
+      memmove(entry, end + 1, strlen(end + 1) + 1);
+    } else {
+      entry = end + 1;
+    }
+  }
+
+  if (strlen(levels) + strlen(arg) + 2 > LOG_LEVELS_MAX_LEN) {
+    ESP_LOGE(LOG_TAG, "Too many log level settings to save");
+  } else {
+    strcat(levels, arg);
+    strcat(levels, ";");
+    ok = (nvs_set_str(nvs, LOG_LEVELS_KEY, levels) == ESP_OK) &&
+      (nvs_commit(nvs) == ESP_OK);
+  }
+  free(levels);
+  nvs_close(nvs);
+  return ok;
+}
+
+/* Pick the level and the tag out of an ESP_LOGx() line without formatting
+   it. The format is [color]<letter> (<timestamp>) %s: ..., and the first two
+   arguments are the timestamp (a string or a number, depending on the
+   timestamp source) and the tag. Returns NULL if the line isn't in that
+   format. */
+static char const *log_line_tag (char const *fmt, va_list args, char *letter) {
+  char const *p = fmt;
+  char const *tag;
+  va_list copy;
+
+  if (*p == '\033') {
+    p = strchr(p, 'm');
+    if (!p) {
+      return NULL;
+    }
+    p++;
+  }
+  if (!strchr("EWIDV", *p) || (strncmp(p + 1, " (%", 3) != 0)) {
+    return NULL;
+  }
+  *letter = *p;
+  p += 4;
+
+  va_copy(copy, args);
+  if (strncmp(p, "s) %s: ", 7) == 0) {
+    (void) va_arg(copy, char const *);
+  } else if ((strncmp(p, PRIu32, strlen(PRIu32)) == 0) &&
+	     (strncmp(p + strlen(PRIu32), ") %s: ", 6) == 0)) {
+    (void) va_arg(copy, uint32_t);
+  } else {
+    va_end(copy);
+    return NULL;
+  }
+  tag = va_arg(copy, char const *);
+  va_end(copy);
+  return tag;
+}
+
+/* Called for every log line, before it is formatted, with the logging lock
+   held. Returns false if the line should be dropped. If lines of this tag
+   were dropped before this one, returns their number in `*suppressed` and
+   the tag in `*tag`. */
+bool log_rate_limit (char const *fmt, va_list args, char const **tag,
+		     uint32_t *suppressed) {
+  struct log_bucket_t_ *bucket = NULL;
+  TickType_t now = xTaskGetTickCount(), elapsed;
+  uint32_t refill;
+  char letter;
+  int i;
+
+  *suppressed = 0;
+  if (CONFIG_WLM_LOG_RATE_LIMIT_PER_S == 0) {
+    return true;
+  }
+
+  *tag = log_line_tag(fmt, args, &letter);
+  if (!*tag || (letter == 'E')) {
+    return true;
+  }
+
+  for (i = 0; i < LOG_RATE_LIMIT_TAGS; i++) {
+    if (log_buckets[i].tag == *tag) {
+      bucket = &log_buckets[i];
+      break;
+    }
+    if (!log_buckets[i].tag) {
+      bucket = &log_buckets[i];
+      bucket->tag = *tag;
+      bucket->tokens_milli = CONFIG_WLM_LOG_RATE_LIMIT_BURST * 1000;
+      bucket->last_refill = now;
+      break;
+    }
+  }
+  if (!bucket) {
+    /* Out of buckets; don't limit the tags that didn't fit */
+    return true;
+  }
+
+  /* A bucket refills within BURST seconds (at PER_S >= 1), so a longer quiet
+     spell counts as that, rather than overflowing the multiplication */
+  elapsed = now - bucket->last_refill;
+  if (elapsed > pdMS_TO_TICKS(CONFIG_WLM_LOG_RATE_LIMIT_BURST * 1000)) {
+    elapsed = pdMS_TO_TICKS(CONFIG_WLM_LOG_RATE_LIMIT_BURST * 1000);
+  }
+  refill = pdTICKS_TO_MS(elapsed) * CONFIG_WLM_LOG_RATE_LIMIT_PER_S;
+  bucket->last_refill = now;
+  bucket->tokens_milli += refill;
+  if (bucket->tokens_milli > CONFIG_WLM_LOG_RATE_LIMIT_BURST * 1000) {
+    bucket->tokens_milli = CONFIG_WLM_LOG_RATE_LIMIT_BURST * 1000;
+  }
+
+  if (bucket->tokens_milli < 1000) {
+    bucket->suppressed++;
+    return false;
+  }
+  bucket->tokens_milli -= 1000;
+  *suppressed = bucket->suppressed;
+  bucket->suppressed = 0;
+  return true;
+}
@@ -0,0 +1,129 @@
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "mc.h"
+
+/* All log output is copied into this ring, from the start of app_main. It
+   lives in RTC memory that is not initialized at startup, so whatever was in
+   it survives a soft reset (panic, watchdog, esp_restart), and the tail of the
+   previous boot's log, crash included, can be sent out once the network is up.
+
+   `head` counts every byte ever written, and the byte at position `pos` lives
+   at data[pos % LOG_RING_SIZE]. Readers keep their own position (cursor) into
+   the ring; a reader that falls more than LOG_RING_SIZE bytes behind has lost
+   data, and is told so, rather than holding up the writers. */
+#define LOG_RING_SIZE CONFIG_WLM_LOG_RING_SIZE
+#define LOG_RING_MAGIC 0x6d636c67 /* "mclg" */
+
+/* `head` wraps around at 2^32, which only works out for a power of 2 */
+_Static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0,
+	       "CONFIG_WLM_LOG_RING_SIZE must be a power of 2");
+
+struct log_ring_t_ {
+  uint32_t magic;
+  uint32_t head;
+  char data[LOG_RING_SIZE];
+};
+
+static RTC_NOINIT_ATTR struct log_ring_t_ log_ring;
+static portMUX_TYPE log_ring_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Copy of the previous boot's tail, taken before the ring is reused */
+static char *prev_boot_log = NULL;
+static size_t prev_boot_log_len = 0;
+
+void log_ring_init (void) {
+  uint32_t start, i;
+
+  /* After a power on the RTC memory holds garbage */
+  if ((esp_reset_reason() != ESP_RST_POWERON) && (log_ring.magic == LOG_RING_MAGIC)) {
+    prev_boot_log_len = (log_ring.head < LOG_RING_SIZE) ? log_ring.head : LOG_RING_SIZE;
+    prev_boot_log = malloc(prev_boot_log_len);
+    if (prev_boot_log) {
+      start = log_ring.head - prev_boot_log_len;
+      for (i = 0; i < prev_boot_log_len; i++) {
+	prev_boot_log[i] = log_ring.data[(start + i) % LOG_RING_SIZE];
+      }
+    } else {
+      prev_boot_log_len = 0;
+    }
+  }
+
+  log_ring.head = 0;
+  log_ring.magic = LOG_RING_MAGIC;
+}
+
+void log_ring_write (char const *buf, size_t len) {
+  uint32_t offset, chunk;
+
+  if (len > LOG_RING_SIZE) {
+    buf += len - LOG_RING_SIZE;
+    len = LOG_RING_SIZE;
+  }
+
+  taskENTER_CRITICAL(&log_ring_lock);
+  offset = log_ring.head % LOG_RING_SIZE;
+  chunk = LOG_RING_SIZE - offset;
+  if (chunk > len) {
+    chunk = len;
+  }
+  memcpy(&log_ring.data[offset], buf, chunk);
+  memcpy(&log_ring.data[0], buf + chunk, len - chunk);
+  log_ring.head += len;
+  taskEXIT_CRITICAL(&log_ring_lock);
+}
+
+uint32_t log_ring_head (void) {
+  return log_ring.head;
+}
+
+/* Position of the oldest byte still in the ring */
+uint32_t log_ring_tail (void) {
+  uint32_t head = log_ring.head;
+
+  return (head < LOG_RING_SIZE) ? 0 : head - LOG_RING_SIZE;
+}
+
+/* Copy up to `len` bytes from `*cursor` onwards into `buf`, and advance the
+   cursor. Returns the number of bytes copied (0 if the reader has caught up).
+   If the reader has fallen behind by more than the ring size, the cursor is
+   moved up to the oldest byte still in the ring, and the number of bytes
+   skipped is returned in `*lost`. */
+size_t log_ring_read (uint32_t *cursor, char *buf, size_t len, uint32_t *lost) {
+  uint32_t head, offset, chunk;
+
+  *lost = 0;
+  taskENTER_CRITICAL(&log_ring_lock);
+  head = log_ring.head;
+  if (head - *cursor > LOG_RING_SIZE) {
+    *lost = head - LOG_RING_SIZE - *cursor;
+    *cursor = head - LOG_RING_SIZE;
+  }
+  if (len > head - *cursor) {
+    len = head - *cursor;
+  }
+  offset = *cursor % LOG_RING_SIZE;
+  chunk = LOG_RING_SIZE - offset;
+  if (chunk > len) {
+    chunk = len;
+  }
+  memcpy(buf, &log_ring.data[offset], chunk);
+  memcpy(buf + chunk, &log_ring.data[0], len - chunk);
+  *cursor += len;
+  taskEXIT_CRITICAL(&log_ring_lock);
+  return len;
+}
+
+/* The tail of the previous boot's log, if it survived the reset */
+char const *log_ring_prev_boot (size_t *len) {
+  *len = prev_boot_log_len;
+  return prev_boot_log;
+}
+
+void log_ring_free_prev_boot (void) {
+  free(prev_boot_log);
+  prev_boot_log = NULL;
+  prev_boot_log_len = 0;
+}
@@ -1,13 +1,13 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
-#include "driver/gpio.h"
 #include "nvs_flash.h"
 #include "esp_event.h"
 #include "esp_system.h"
-#include "pins.h"
+#include "io.h"
 #include "esp_log.h"
 #include "mc.h"
 
@@ -19,12 +19,20 @@ void app_main() {
   EventGroupHandle_t mc_event_group;
 
   struct mc_task_args_t_ mc_task_args;
+
+  /* Capture logs into the RTC log ring from here on; they are sent to the
+     UDP logging host once wifi is up */
+  start_log_capture();
+
+  /* Clock scaling and light sleep, before anything takes a lock */
+  power_init();
   
-  init_gpio_pins();
+  io_init();
+  pattern_init();
 
   /* We'll start off by turning the error LED on, and turn it off once
      everything starts off fine */
-  gpio_set_level(ERR_STATUS_OUT, 1);
+  status_set(STATUS_BOOTING, true);
   vTaskDelay(5000 / portTICK_PERIOD_MS);
 
   ret = nvs_flash_init();
@@ -34,6 +42,12 @@ void app_main() {
   }
   ESP_ERROR_CHECK(ret);
 
+  /* Per-tag log levels set earlier with `loglevel=` */
+  log_levels_restore();
+
+  /* Say why the last boot crashed, if it left a core dump behind */
+  coredump_report();
+
   ESP_ERROR_CHECK(esp_event_loop_create_default());
 
   /* Create the event group that the tasks in this application will use */
@@ -69,60 +83,114 @@ void app_main() {
   mc_task_args.ota_q = ota_q;
 
   /* Start the task that accepts requests to sound the beep */
-  ret = xTaskCreate(beep_task, "Beep Task", 2048, (void *) &mc_task_args,
-		    tskIDLE_PRIORITY, NULL);
+  ret = xTaskCreatePinnedToCore(beep_task, "Beep Task", 2048, (void *) &mc_task_args,
+				MC_PRIO_BEEP, NULL, MC_CONTROL_CORE);
   if (ret != pdPASS) {
     ESP_LOGE(LOG_TAG, "Failed to create beep task");
     return;
   }
   
   /* Start the task that starts/stops/handles the HTTP server. */
-  ret = xTaskCreate(http_server_task, "HTTP Server Task", 4096, &mc_task_args,
-		    tskIDLE_PRIORITY,NULL);
+  ret = xTaskCreatePinnedToCore(http_server_task, "HTTP Server Task", 4096, &mc_task_args,
+				MC_PRIO_HTTPD, NULL, MC_NETWORK_CORE);
   if (ret != pdPASS) {
     ESP_LOGE(LOG_TAG, "Failed to create http server task");
     return;
   }
   
   /* Start the task that handles UDP logging. */
-  ret = xTaskCreate(udp_logging_task, "UDP Logging Task", 2048, &mc_task_args,
-		    tskIDLE_PRIORITY, NULL);
+  ret = xTaskCreatePinnedToCore(udp_logging_task, "UDP Logging Task", 2048, &mc_task_args,
+				MC_PRIO_LOGGING, NULL, MC_NETWORK_CORE);
   if (ret != pdPASS) {
     ESP_LOGE(LOG_TAG, "Failed to create UDP logger task");
     return;
   }
   
+#ifdef CONFIG_WLM_BEACON
+  /* Start the task that multicasts the status beacon. */
+  ret = xTaskCreatePinnedToCore(beacon_task, "Beacon Task", 3072, &mc_task_args,
+				MC_PRIO_BEACON, NULL, MC_NETWORK_CORE);
+  if (ret != pdPASS) {
+    ESP_LOGE(LOG_TAG, "Failed to create beacon task");
+    return;
+  }
+#endif
+
+#ifdef CONFIG_WLM_MQTT
+  /* Start the task that runs the MQTT client. */
+  ret = xTaskCreatePinnedToCore(mqtt_task, "MQTT Task", 3072, &mc_task_args,
+				MC_PRIO_MQTT, NULL, MC_NETWORK_CORE);
+  if (ret != pdPASS) {
+    ESP_LOGE(LOG_TAG, "Failed to create MQTT task");
+    return;
+  }
+#endif
+
+#ifdef CONFIG_WLM_REPLICA
+  /* Start the task that keeps this unit in step with its hot standby peer,
+     before the control tasks that ask it whether they may drive the motor */
+  ret = xTaskCreatePinnedToCore(replica_task, "Replica Task", 3072, NULL,
+				MC_PRIO_REPLICA, NULL, MC_NETWORK_CORE);
+  if (ret != pdPASS) {
+    ESP_LOGE(LOG_TAG, "Failed to create replica task");
+    return;
+  }
+#endif
+
   /* Start the task that turns the motor on/off. */
-  ret = xTaskCreate(motor_task, "Motor on/off Task", 2048, (void *) &mc_task_args,
-		    tskIDLE_PRIORITY, NULL);
+  ret = xTaskCreatePinnedToCore(motor_task, "Motor on/off Task", 2048, (void *) &mc_task_args,
+				MC_PRIO_CONTROL, NULL, MC_CONTROL_CORE);
   if (ret != pdPASS) {
     ESP_LOGE(LOG_TAG, "Failed to create motor on/off task");
     return;
   }
 
-  /* Start the task that monitors the tank level. */
-  ret = xTaskCreate(oh_tank_level_task, "OH Tank Level Task", 2048, (void *) &mc_task_args,
-		    tskIDLE_PRIORITY, NULL);
+  /* Start the task that monitors the tank level. It logs floats and saves
+     the fill model to NVS, hence the larger stack. */
+  ret = xTaskCreatePinnedToCore(oh_tank_level_task, "OH Tank Level Task", 3072,
+				(void *) &mc_task_args, MC_PRIO_CONTROL, NULL,
+				MC_CONTROL_CORE);
   if (ret != pdPASS) {
     ESP_LOGE(LOG_TAG, "Failed to create OH Tank Level task");
     return;
   }
 
+  /* Start the task that watches over the motor and tank level tasks */
+  ret = xTaskCreatePinnedToCore(supervisor_task, "Supervisor Task", 2048, NULL,
+				MC_PRIO_SUPERVISOR, NULL, MC_CONTROL_CORE);
+  if (ret != pdPASS) {
+    ESP_LOGE(LOG_TAG, "Failed to create supervisor task");
+    return;
+  }
+
   /* Start the OTA task */
-  ret = xTaskCreate(ota_task, "OTA Task", 8192, (void *) &mc_task_args,
-		    tskIDLE_PRIORITY, NULL);
+  ret = xTaskCreatePinnedToCore(ota_task, "OTA Task", 8192, (void *) &mc_task_args,
+				MC_PRIO_OTA, NULL, MC_NETWORK_CORE);
   if (ret != pdPASS) {
     ESP_LOGE(LOG_TAG, "Failed to create OTA task");
     return;
   }
+
+  /* Start the task that samples the heap for /mc_heap */
+  ret = xTaskCreatePinnedToCore(heap_mon_task, "Heap Monitor Task", 2048, NULL,
+				MC_PRIO_HEAP_MON, NULL, MC_NETWORK_CORE);
+  if (ret != pdPASS) {
+    ESP_LOGE(LOG_TAG, "Failed to create heap monitor task");
+    return;
+  }
   
   /* Delay a bit to allow the tasks to start */
   vTaskDelay(1000 / portTICK_PERIOD_MS);
   fflush(stdout);
 
   /* If we got here, that means everything started off fine, and we can turn the
-     Err/Status LED off */
-  gpio_set_level(ERR_STATUS_OUT, 0);
+     Err/Status LED off (or over to the blink code of whatever is still
+     pending, e.g. wifi) */
+  status_set(STATUS_BOOTING, false);
+
+#if defined(CONFIG_WLM_BENCH) && defined(CONFIG_WLM_BENCH_AT_BOOT)
+  bench_run_at_boot(&mc_task_args);
+#endif
   
   while (pdTRUE) {
     vTaskDelay(portMAX_DELAY);
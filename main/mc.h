@@ -2,10 +2,54 @@
 #define __MC_H__
 
 /* Bits in the `mc_event_group` event group */
-#define EVENT_WIFI_CONNECTED BIT0
+#define EVENT_WIFI_CONNECTED BIT0	/* for http.c, see below */
 #define EVENT_WIFI_FAILED BIT1
 #define EVENT_OH_TANK_FULL BIT2
 #define EVENT_MOTOR_RUNNING BIT3
+#define EVENT_BEEPING BIT4
+/* Set once, when each part is seen working (see selftest.c) */
+#define EVENT_HEALTH_WIFI BIT5
+#define EVENT_HEALTH_HTTPD BIT6
+#define EVENT_HEALTH_MOTOR BIT7
+#define EVENT_HEALTH_TANK_LEVEL BIT8
+#define EVENT_HEALTH_LOGGING BIT9
+/* The wifi edges again, a pair per task that waits for them: each one
+   clears the bits it sees, and would take them from any other waiting on
+   the same pair. EVENT_WIFI_CONNECTED/FAILED are http.c's. */
+#define EVENT_MQTT_WIFI_CONNECTED BIT10
+#define EVENT_MQTT_WIFI_FAILED BIT11
+#define EVENT_LOGGING_WIFI_CONNECTED BIT12
+#define EVENT_LOGGING_WIFI_FAILED BIT13
+
+/* Task priorities and core affinities.
+
+   The control tasks (motor, tank level, supervisor, beep) are pinned to the
+   APP core, and run above everything else on it, so that TLS handshakes, HTTP
+   load and log traffic cannot delay a tank reading or a motor-off.
+
+   Everything that talks to the network is pinned to the PRO core, next to
+   the Wi-Fi task and lwIP (also pinned to the PRO core in sdkconfig). They
+   stay below lwIP (18) and Wi-Fi (23), so that the stack itself is never
+   starved by the application. The replication heartbeats run above the web
+   server, so that HTTP load cannot delay them into a lapsed lease. MQTT
+   commands are served at the same level as HTTP ones. The status beacon
+   sits below logging, and the OTA download, the bulkiest of them, runs below
+   that. The heap sampler, which holds the heap locks while it walks the heap,
+   runs lowest. */
+#define MC_CONTROL_CORE 1 /* APP core */
+#define MC_NETWORK_CORE 0 /* PRO core */
+
+#define MC_PRIO_SUPERVISOR (tskIDLE_PRIORITY + 12)
+#define MC_PRIO_CONTROL (tskIDLE_PRIORITY + 10)
+#define MC_PRIO_BEEP (tskIDLE_PRIORITY + 8)
+#define MC_PRIO_REPLICA (tskIDLE_PRIORITY + 7)
+#define MC_PRIO_HTTPD (tskIDLE_PRIORITY + 6)
+#define MC_PRIO_HTTP_WORKER (tskIDLE_PRIORITY + 5)
+#define MC_PRIO_MQTT (tskIDLE_PRIORITY + 5)
+#define MC_PRIO_LOGGING (tskIDLE_PRIORITY + 4)
+#define MC_PRIO_BEACON (tskIDLE_PRIORITY + 3)
+#define MC_PRIO_OTA (tskIDLE_PRIORITY + 2)
+#define MC_PRIO_HEAP_MON (tskIDLE_PRIORITY + 1)
 
 struct mc_task_args_t_ {
   EventGroupHandle_t mc_event_group;
@@ -15,28 +59,183 @@ struct mc_task_args_t_ {
 };
 
 /* wifi.c */
+enum wifi_ps_profile_t_ {
+  WIFI_PS_PROFILE_NONE,
+  WIFI_PS_PROFILE_MIN,
+  WIFI_PS_PROFILE_MAX,
+  WIFI_PS_PROFILE_AUTO,		/* none while the motor runs, max otherwise */
+  WIFI_PS_PROFILES
+};
+struct wifi_rtt_result_t_ {
+  uint32_t sent;
+  uint32_t received;
+  uint32_t min_ms;
+  uint32_t max_ms;
+  uint32_t total_ms;
+};
 extern void start_wifi(EventGroupHandle_t);
+extern void wifi_ps_motor_running(bool running);
+extern bool wifi_ps_set_profile(enum wifi_ps_profile_t_ profile);
+extern bool wifi_ps_command(char const *arg);
+extern enum wifi_ps_profile_t_ wifi_ps_get_profile(enum wifi_ps_profile_t_ *applied);
+extern char const *wifi_ps_profile_name(enum wifi_ps_profile_t_ profile);
+extern bool wifi_rtt_probe(uint32_t count, uint32_t interval_ms,
+			   struct wifi_rtt_result_t_ *result);
 
 /* oh_tank_level.c */
 extern void oh_tank_level_task(void *param);
+extern void oh_tank_level_jitter(uint32_t *samples, int32_t *min_us, int32_t *max_us);
+extern void oh_tank_level_jitter_reset(void);
+extern void oh_tank_level_fill_model_reset(void);
+extern int oh_tank_level_format_stats(char *buf, size_t len);
+struct sensor_trace_header_t_;
+extern bool sensor_trace_start(void);
+extern void sensor_trace_stop(void);
+extern bool sensor_trace_get_header(struct sensor_trace_header_t_ *header);
+extern void sensor_trace_read(size_t index, uint16_t *records, size_t n);
 
 /* motor.c */
 extern void motor_task(void *param);
+extern void motor_failsafe_off(void);
+
+/* supervisor.c */
+enum supervised_task_id_t_ {
+  SUPERVISED_MOTOR,
+  SUPERVISED_OH_TANK_LEVEL,
+  SUPERVISED_TASKS
+};
+extern void supervisor_register(enum supervised_task_id_t_ id, char const *name,
+				uint32_t period_ms);
+extern void supervisor_heartbeat(enum supervised_task_id_t_ id);
+extern int supervisor_format_stats(char *buf, size_t len);
+extern void supervisor_task(void *param);
 
 /* beep.c */
 extern void beep_task(void *param);
 
+/* pattern.c */
+enum pattern_output_t_ {
+  PATTERN_BEEP,
+  PATTERN_STATUS_LED,
+  PATTERN_OUTPUTS
+};
+struct pattern_step_t_ {
+  uint16_t on_ms;
+  uint16_t off_ms;
+};
+/* Status LED states, in increasing order of precedence */
+enum status_code_t_ {
+  STATUS_WIFI_DOWN,		/* 2 blinks */
+  STATUS_OTA,			/* slow blink: downloading, staged or applying */
+  STATUS_SENSOR_FAULT,		/* 3 blinks: motor sense not following the relay */
+  STATUS_BOOTING,		/* solid */
+  STATUS_FAULT,			/* solid: a control task stopped, until reboot */
+  STATUS_CODES
+};
+extern void pattern_init(void);
+extern void pattern_play(enum pattern_output_t_ output, struct pattern_step_t_ const *steps,
+			 size_t num_steps);
+extern void pattern_stop(enum pattern_output_t_ output);
+extern void status_set(enum status_code_t_ code, bool active);
+extern uint32_t status_get(void);
+
+/* beacon.c */
+extern void beacon_task(void *param);
+extern void beacon_notify(void);
+extern void beacon_get_stats(uint32_t *sent, uint32_t *failed);
+
 /* http.c */
+#define VERSION_INFO_RESPONSE_SIZE 768
 extern void http_server_task(void *param);
+extern bool mc_ctrl_command(struct mc_task_args_t_ *task_args, char const *cmd);
+extern int http_format_status(EventBits_t bits, char *buf, size_t len);
+extern bool http_format_version_info(char *response);
+
+/* bench.c */
+#define BENCH_REPORT_SIZE 1024
+extern int bench_run(struct mc_task_args_t_ *mc_task_args, char *buf, size_t len);
+extern void bench_run_at_boot(struct mc_task_args_t_ *mc_task_args);
 
-/* gpio.c */
-extern void init_gpio_pins(void);
+/* mqtt.c */
+extern void mqtt_task(void *param);
+
+/* power.c */
+enum power_lock_id_t_ {
+  POWER_LOCK_OTA,		/* full clock */
+  POWER_LOCK_HTTP,		/* full clock */
+  POWER_LOCK_BENCH,		/* full clock */
+  POWER_LOCK_MOTOR,		/* no light sleep */
+  POWER_LOCK_BEEP,		/* no light sleep */
+  POWER_LOCKS
+};
+extern void power_init(void);
+extern void power_lock(enum power_lock_id_t_ id);
+extern void power_unlock(enum power_lock_id_t_ id);
+extern int power_format_stats(char *buf, size_t len);
 
 /* udp_logging.c */
+extern void start_log_capture(void);
 extern void udp_logging_task(void *param);
 extern void stop_udp_logging(void);
+extern bool udp_logging_bench_line(char const *fmt, ...);
+
+/* log_ring.c */
+extern void log_ring_init(void);
+extern void log_ring_write(char const *buf, size_t len);
+extern uint32_t log_ring_head(void);
+extern uint32_t log_ring_tail(void);
+extern size_t log_ring_read(uint32_t *cursor, char *buf, size_t len, uint32_t *lost);
+extern char const *log_ring_prev_boot(size_t *len);
+extern void log_ring_free_prev_boot(void);
+
+/* log_filter.c */
+extern void log_levels_restore(void);
+extern bool log_level_command(char const *arg);
+extern bool log_rate_limit(char const *fmt, va_list args, char const **tag,
+			   uint32_t *suppressed);
+
+/* coredump.c */
+extern void coredump_report(void);
+extern bool coredump_available(size_t *size);
+extern bool coredump_read(size_t offset, void *buf, size_t len);
+extern bool coredump_erase(void);
 
 /* ota.c */
 extern void ota_task(void *param);
+extern void ota_get_stats(uint32_t *attempts, uint32_t *handshake_ms,
+			  uint32_t *heap_used_peak);
+extern bool ota_parse_sha256(char const *hex, uint8_t *digest);
+struct ota_writer_t_;
+extern struct ota_writer_t_ *ota_writer_begin(void);
+extern bool ota_writer_write(struct ota_writer_t_ *writer, void const *data, size_t len);
+extern size_t ota_writer_length(struct ota_writer_t_ *writer);
+extern void ota_writer_abort(struct ota_writer_t_ *writer);
+extern bool ota_writer_finish(struct ota_writer_t_ *writer, uint8_t const *expected_sha256);
+extern char const *ota_get_phase(char const **staged_version);
+extern size_t ota_bench_write(uint8_t *block, size_t len, uint32_t *cycles, size_t count);
+
+/* heap_mon.c */
+extern void heap_mon_task(void *param);
+extern bool heap_mon_trace_start(void);
+extern void heap_mon_trace_stop(void);
+extern int heap_mon_format_trace(char *buf, size_t len);
+extern int heap_mon_format_history(size_t *index, char *buf, size_t len);
+extern int heap_mon_format_stats(char *buf, size_t len);
+
+/* replica.c */
+struct replica_state_t_;
+extern void replica_task(void *param);
+extern bool replica_is_active(void);
+extern bool replica_may_drive(void);
+extern bool replica_holds_lease(void);
+extern void replica_publish(struct replica_state_t_ const *state);
+extern bool replica_get_state(struct replica_state_t_ *state, uint32_t *version);
+extern bool replica_resume_run(struct replica_state_t_ *state);
+extern bool replica_command(char const *arg);
+extern int replica_format_stats(char *buf, size_t len);
+
+/* selftest.c */
+extern void selftest_boot(struct mc_task_args_t_ *mc_task_args);
+extern int selftest_format(char *buf, size_t len);
 
 #endif
@@ -1,60 +1,144 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
-#include "driver/gpio.h"
 #include "esp_log.h"
-#include "pins.h"
+#include "io.h"
 #include "mc.h"
+#include "trace.h"
 
 static char const *LOG_TAG = "mc|motor";
 
+/* We keep track of the current value of the output gpio level, because
+   turning the motor on/off is a matter of toggling this value.
+   In io.c, the MOTOR_OUT GPIO pin is set to 1 during bootup.
+   The supervisor can also toggle it (motor_failsafe_off), hence the lock. */
+static uint32_t current_motor_out_gpio_level = 1;
+static portMUX_TYPE motor_out_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* After the relay is toggled, the motor running sense has to follow within
+   this long, or the sensor (or the relay) is taken to be faulty. The fault
+   clears once the sense does follow. */
+#define MOTOR_SENSE_TIMEOUT_MS 5000
+
+static void toggle_motor_relay (void) {
+  taskENTER_CRITICAL(&motor_out_lock);
+  if (current_motor_out_gpio_level == 1) {
+    current_motor_out_gpio_level = 0;
+  } else {
+    current_motor_out_gpio_level = 1;
+  }
+  io_set(IO_MOTOR, current_motor_out_gpio_level);
+  taskEXIT_CRITICAL(&motor_out_lock);
+}
+
+/* Called by the supervisor when a control task has stopped running, and so
+   may not be around to turn the motor off, and by replica.c when the lease
+   is about to lapse. Does not go through motor_task, which may be the one
+   that is stuck. A unit without the lease leaves the relay to the active
+   one (see replica.c). */
+void motor_failsafe_off (void) {
+  struct io_snapshot_t_ inputs;
+
+  io_snapshot(&inputs);
+  if (IO_LEVEL(&inputs, IO_MOTOR_RUNNING_SENSE) != 0) {
+    if (!replica_holds_lease()) {
+      ESP_LOGE(LOG_TAG, "Fail-safe: leaving the motor to the active unit");
+      return;
+    }
+    ESP_LOGE(LOG_TAG, "Fail-safe: turning the motor off");
+    toggle_motor_relay();
+  }
+}
+
 void motor_task (void *param) {
   struct mc_task_args_t_ *mc_task_args = (struct mc_task_args_t_ *) param;
   bool motor_running = false;
   bool desired_state = false;
-  
-  /* We keep track of the current value of the output gpio level, because
-     turning the motor on/off is a matter of toggling this value.
-     In gpio.c, the MOTOR_OUT GPIO pin is set to 1 during bootup. */
-  uint32_t current_motor_out_gpio_level = 1;
+  bool sense_pending = false, sense_expected = false, sense_fault = false;
+  bool reported_healthy = false;
+  TickType_t sense_deadline = 0;
+  struct io_snapshot_t_ inputs;
+
+  supervisor_register(SUPERVISED_MOTOR, "motor", 1000);
 
   /* loop, waiting for enqueues to the queue, and obey.
      Monitor the gpio input and set the bit in the event group */
   while (pdTRUE) {
+    supervisor_heartbeat(SUPERVISED_MOTOR);
+
     /* Read the Input GPIO to see if the motor is running */
-    if (gpio_get_level(MOTOR_RUNNING_SENSE_IN) == 0) {
+    io_snapshot(&inputs);
+    if (IO_LEVEL(&inputs, IO_MOTOR_RUNNING_SENSE) == 0) {
       if (motor_running) {
 	motor_running = false;
+	MC_TRACE(TRACE_GPIO_READ, io_trace_arg(IO_MOTOR_RUNNING_SENSE, 0));
 	xEventGroupClearBits(mc_task_args->mc_event_group, EVENT_MOTOR_RUNNING);
+	MC_TRACE(TRACE_EVENT_CLEAR, EVENT_MOTOR_RUNNING);
+	beacon_notify();
+	wifi_ps_motor_running(false);
+	power_unlock(POWER_LOCK_MOTOR);
       } else {
 	/* Motor is not running, no change in state */
       }
     } else {
       if (!motor_running) {
 	motor_running = true;
+	MC_TRACE(TRACE_GPIO_READ, io_trace_arg(IO_MOTOR_RUNNING_SENSE, 1));
 	xEventGroupSetBits(mc_task_args->mc_event_group, EVENT_MOTOR_RUNNING);
+	MC_TRACE(TRACE_EVENT_SET, EVENT_MOTOR_RUNNING);
+	beacon_notify();
+	wifi_ps_motor_running(true);
+	power_lock(POWER_LOCK_MOTOR);
       } else {
 	/* Motor is running, no change in state */
       }      
     }
+    if (!reported_healthy) {
+      xEventGroupSetBits(mc_task_args->mc_event_group, EVENT_HEALTH_MOTOR);
+      reported_healthy = true;
+    }
+
+    /* Check that the sense followed the last toggle of the relay */
+    if (sense_pending) {
+      if (motor_running == sense_expected) {
+	sense_pending = false;
+	if (sense_fault) {
+	  sense_fault = false;
+	  ESP_LOGW(LOG_TAG, "Motor running sense follows the relay again");
+	  status_set(STATUS_SENSOR_FAULT, false);
+	}
+      } else if (!sense_fault && ((int32_t) (xTaskGetTickCount() - sense_deadline) >= 0)) {
+	sense_fault = true;
+	ESP_LOGE(LOG_TAG, "Motor running sense did not follow the relay within %d ms "
+		 "(expected %s)", MOTOR_SENSE_TIMEOUT_MS, sense_expected ? "on" : "off");
+	status_set(STATUS_SENSOR_FAULT, true);
+      }
+    }
     
     if (pdTRUE == xQueueReceive(mc_task_args->motor_on_off_q, (void *) &desired_state,
 				pdMS_TO_TICKS(1000))) {
+      MC_TRACE(TRACE_MOTOR_Q_RECV, desired_state);
       ESP_LOGI(LOG_TAG, "rx request on q, desired_state = %s", desired_state ? "on" : "off");
       if (desired_state == motor_running) {
 	ESP_LOGI(LOG_TAG, "Ignoring request because desired state "
 		 "(%s) == motor running state", desired_state ? "on" : "off");
+      } else if (sense_pending && (desired_state == sense_expected)) {
+	/* Repeated (see the fill time cutoff in oh_tank_level.c) before the
+	   sense followed the last toggle: toggling again would undo it */
+	ESP_LOGI(LOG_TAG, "Ignoring request because the relay was already toggled "
+		 "to %s", desired_state ? "on" : "off");
+      } else if (!replica_may_drive()) {
+	ESP_LOGW(LOG_TAG, "Ignoring request because this unit is not the one driving "
+		 "the motor (replica_role in /mc_stats)");
       } else {
 	ESP_LOGI(LOG_TAG, "Obeying request because desired state "
 		 "(%s) != motor running state (%s)",
 		 desired_state ? "on" : "off", motor_running ? "on" : "off");
 	
 	/* Toggle the relay state */
-	if (current_motor_out_gpio_level == 1) {
-	  current_motor_out_gpio_level = 0;
-	} else {
-	  current_motor_out_gpio_level = 1;
-	}
-	gpio_set_level(MOTOR_OUT, current_motor_out_gpio_level);
+	toggle_motor_relay();
+	sense_pending = true;
+	sense_expected = desired_state;
+	sense_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(MOTOR_SENSE_TIMEOUT_MS);
       }
     } else {
       /* Nothing was enqueued, go back to the beginning of the loop to read the
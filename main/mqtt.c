@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_wifi.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "mqtt_client.h"
+#include "mc.h"
+
+#ifdef CONFIG_WLM_MQTT
+
+static char const *LOG_TAG = "mc|mqtt";
+
+/* MQTT client. All topics are under mc/<station MAC>/:
+
+     state/motor      on|off                 retained
+     state/tank_full  full|not full          retained
+     state/beep       on|off                 retained
+     state/ota        OTA phase              retained
+     online           online|offline         retained, offline is the will
+     telemetry        JSON, every CONFIG_WLM_MQTT_TELEMETRY_PERIOD_S
+     cmd              subscribed: any /mc_ctrl command, e.g. motor=on
+     cmd/result       ok|error <command>
+
+   A state topic is published when its value changes (checked every second)
+   and all of them again after every (re)connect, so a subscriber always
+   finds the current values retained on the broker. The client is started
+   when wifi comes up and stopped when it goes down; esp-mqtt itself
+   reconnects to the broker while wifi stays up. */
+#define MQTT_TOPIC_SIZE 64
+#define MQTT_CMD_SIZE 256
+#define MQTT_TELEMETRY_SIZE 256
+
+enum mqtt_state_topic_t_ {
+  MQTT_STATE_MOTOR,
+  MQTT_STATE_TANK_FULL,
+  MQTT_STATE_BEEP,
+  MQTT_STATE_OTA,
+  MQTT_STATE_TOPICS
+};
+
+static char const *mqtt_state_topic_names[MQTT_STATE_TOPICS] = {
+  [MQTT_STATE_MOTOR] = "state/motor",
+  [MQTT_STATE_TANK_FULL] = "state/tank_full",
+  [MQTT_STATE_BEEP] = "state/beep",
+  [MQTT_STATE_OTA] = "state/ota",
+};
+
+static esp_mqtt_client_handle_t mqtt_client = NULL;
+static char mqtt_base_topic[32];
+static char mqtt_cmd_topic[MQTT_TOPIC_SIZE];
+static volatile bool mqtt_connected = false;
+static volatile bool mqtt_republish = false;
+
+static void topic_name (char *topic, char const *name) {
+  snprintf(topic, MQTT_TOPIC_SIZE, "%s/%s", mqtt_base_topic, name);
+}
+
+static void publish (char const *name, char const *value, int qos, bool retain) {
+  char topic[MQTT_TOPIC_SIZE];
+
+  topic_name(topic, name);
+  /* Queued in the client's outbox, so this does not wait for the network */
+  if (esp_mqtt_client_enqueue(mqtt_client, topic, value, 0, qos, retain, true) < 0) {
+    ESP_LOGE(LOG_TAG, "Failed to queue a publish to %s", topic);
+  }
+}
+
+/* A command from the cmd topic goes through the same path as a POST to
+   /mc_ctrl */
+static void handle_command (struct mc_task_args_t_ *mc_task_args,
+			    esp_mqtt_event_handle_t event) {
+  char cmd[MQTT_CMD_SIZE + 1], result[MQTT_CMD_SIZE + 8];
+  bool ok;
+
+  if ((event->topic_len != strlen(mqtt_cmd_topic)) ||
+      (strncmp(event->topic, mqtt_cmd_topic, event->topic_len) != 0)) {
+    return;
+  }
+  if ((event->data_len != event->total_data_len) || (event->data_len > MQTT_CMD_SIZE)) {
+    ESP_LOGE(LOG_TAG, "Command too long (%d bytes)", event->total_data_len);
+    publish("cmd/result", "error command too long", 1, false);
+    return;
+  }
+  memcpy(cmd, event->data, event->data_len);
+  cmd[event->data_len] = '\0';
+
+  ESP_LOGI(LOG_TAG, "Command \"%s\"", cmd);
+  ok = mc_ctrl_command(mc_task_args, cmd);
+  snprintf(result, sizeof(result), "%s %s", ok ? "ok" : "error", cmd);
+  publish("cmd/result", result, 1, false);
+}
+
+/* Runs in the esp-mqtt task */
+static void mqtt_event_handler (void *arg, esp_event_base_t event_base, int32_t event_id,
+				void *event_data) {
+  struct mc_task_args_t_ *mc_task_args = (struct mc_task_args_t_ *) arg;
+  esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t) event_data;
+
+  switch ((esp_mqtt_event_id_t) event_id) {
+  case MQTT_EVENT_CONNECTED:
+    ESP_LOGI(LOG_TAG, "Connected to %s", CONFIG_WLM_MQTT_BROKER_URI);
+    publish("online", "online", 1, true);
+    esp_mqtt_client_subscribe(mqtt_client, mqtt_cmd_topic, 1);
+    mqtt_connected = true;
+    mqtt_republish = true;
+    break;
+  case MQTT_EVENT_DISCONNECTED:
+    ESP_LOGW(LOG_TAG, "Disconnected from the broker");
+    mqtt_connected = false;
+    break;
+  case MQTT_EVENT_DATA:
+    handle_command(mc_task_args, event);
+    break;
+  case MQTT_EVENT_ERROR:
+    if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
+      ESP_LOGE(LOG_TAG, "Transport error (%s)",
+	       esp_err_to_name(event->error_handle->esp_tls_last_esp_err));
+    } else {
+      ESP_LOGE(LOG_TAG, "Error type %d", event->error_handle->error_type);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static bool start_mqtt (struct mc_task_args_t_ *mc_task_args) {
+  static char online_topic[MQTT_TOPIC_SIZE];
+  esp_mqtt_client_config_t mqtt_config = {
+    .broker.address.uri = CONFIG_WLM_MQTT_BROKER_URI,
+    .credentials.client_id = mqtt_base_topic,
+    .session.last_will = {
+      .topic = online_topic,
+      .msg = "offline",
+      .qos = 1,
+      .retain = 1,
+    },
+    .task.priority = MC_PRIO_MQTT,
+  };
+
+  if (!mqtt_client) {
+    topic_name(online_topic, "online");
+    mqtt_client = esp_mqtt_client_init(&mqtt_config);
+    if (!mqtt_client) {
+      ESP_LOGE(LOG_TAG, "Failed to create the MQTT client");
+      return false;
+    }
+    esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler,
+				   mc_task_args);
+  }
+  if (esp_mqtt_client_start(mqtt_client) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Failed to start the MQTT client");
+    return false;
+  }
+  return true;
+}
+
+static void stop_mqtt (void) {
+  mqtt_connected = false;
+  esp_mqtt_client_stop(mqtt_client);
+}
+
+/* One message with everything that is only worth looking at periodically */
+static void publish_telemetry (void) {
+  char telemetry[MQTT_TELEMETRY_SIZE];
+  wifi_ap_record_t ap_info;
+  uint32_t jitter_samples;
+  int32_t jitter_min_us, jitter_max_us;
+  int rssi = 0;
+
+  if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+    rssi = ap_info.rssi;
+  }
+  oh_tank_level_jitter(&jitter_samples, &jitter_min_us, &jitter_max_us);
+  snprintf(telemetry, sizeof(telemetry),
+	   "{\"uptime_s\":%lu,\"rssi\":%d,\"free_heap\":%lu,\"min_free_heap\":%lu,"
+	   "\"status\":%lu,\"tank_jitter_min_us\":%ld,\"tank_jitter_max_us\":%ld}",
+	   (unsigned long) (esp_timer_get_time() / 1000000), rssi,
+	   (unsigned long) esp_get_free_heap_size(),
+	   (unsigned long) esp_get_minimum_free_heap_size(),
+	   (unsigned long) status_get(), (long) jitter_min_us, (long) jitter_max_us);
+  publish("telemetry", telemetry, 0, false);
+}
+
+void mqtt_task (void *param) {
+  struct mc_task_args_t_ *mc_task_args = (struct mc_task_args_t_ *) param;
+  char const *state[MQTT_STATE_TOPICS], *published[MQTT_STATE_TOPICS] = {NULL};
+  char const *staged_version;
+  uint8_t mac[6];
+  EventBits_t bits;
+  TickType_t last_telemetry = 0;
+  bool started = false;
+  int i;
+
+  esp_read_mac(mac, ESP_MAC_WIFI_STA);
+  snprintf(mqtt_base_topic, sizeof(mqtt_base_topic), "mc/%02x%02x%02x%02x%02x%02x",
+	   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  topic_name(mqtt_cmd_topic, "cmd");
+
+  while (pdTRUE) {
+    bits = xEventGroupWaitBits(mc_task_args->mc_event_group,
+			       EVENT_MQTT_WIFI_CONNECTED | EVENT_MQTT_WIFI_FAILED,
+			       pdTRUE, pdFALSE, pdMS_TO_TICKS(1000));
+    if (bits & EVENT_MQTT_WIFI_CONNECTED) {
+      if (!started) {
+	ESP_LOGI(LOG_TAG, "Wifi up, starting MQTT");
+	started = start_mqtt(mc_task_args);
+      }
+    } else if (bits & EVENT_MQTT_WIFI_FAILED) {
+      if (started) {
+	ESP_LOGI(LOG_TAG, "Wifi down, stopping MQTT");
+	stop_mqtt();
+	started = false;
+      }
+    }
+
+    if (!mqtt_connected) {
+      continue;
+    }
+
+    /* The state strings are all constants, so comparing the pointers is
+       enough to spot a change */
+    bits = xEventGroupGetBits(mc_task_args->mc_event_group);
+    state[MQTT_STATE_MOTOR] = (bits & EVENT_MOTOR_RUNNING) ? "on" : "off";
+    state[MQTT_STATE_TANK_FULL] = (bits & EVENT_OH_TANK_FULL) ? "full" : "not full";
+    state[MQTT_STATE_BEEP] = (bits & EVENT_BEEPING) ? "on" : "off";
+    state[MQTT_STATE_OTA] = ota_get_phase(&staged_version);
+    if (mqtt_republish) {
+      mqtt_republish = false;
+      memset(published, 0, sizeof(published));
+    }
+    for (i = 0; i < MQTT_STATE_TOPICS; i++) {
+      if (state[i] != published[i]) {
+	publish(mqtt_state_topic_names[i], state[i], 1, true);
+	published[i] = state[i];
+      }
+    }
+
+    if ((xTaskGetTickCount() - last_telemetry) >=
+	pdMS_TO_TICKS(CONFIG_WLM_MQTT_TELEMETRY_PERIOD_S * 1000)) {
+      publish_telemetry();
+      last_telemetry = xTaskGetTickCount();
+    }
+  }
+}
+
+#endif
@@ -1,102 +1,418 @@
+#include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "esp_log.h"
-#include "driver/gpio.h"
-#include "pins.h"
+#include "nvs.h"
+#include "esp_timer.h"
+#include "io.h"
 #include "mc.h"
+#include "trace.h"
+#include "tank_filter.h"
+#include "fill_model.h"
+#include "replica_fsm.h"
 
-#define SUCCESSIVE_FULL_INDICATIONS_FOR_BEEP 4
-#define SUCCESSIVE_FULL_INDICATIONS_FOR_MOTOR_OFF 5
-    
 static char const *LOG_TAG = "mc|oh_tank_level";
 
 static void beep_on (struct mc_task_args_t_ *mc_task_args) {
   static bool on = true; /* I think this needs to be static */
   if (pdTRUE != xQueueSend(mc_task_args->beep_q, (void *) &on, pdMS_TO_TICKS(1000))) {
+    MC_TRACE(TRACE_BEEP_Q_SEND_FAILED, on);
     ESP_LOGE(LOG_TAG, "Failed to enqueue beep ON");
+  } else {
+    MC_TRACE(TRACE_BEEP_Q_SEND, on);
   }
 }
 
 static void beep_off (struct mc_task_args_t_ *mc_task_args) {
   static bool on = false; /* I think this needs to be static */
   if (pdTRUE != xQueueSend(mc_task_args->beep_q, (void *) &on, pdMS_TO_TICKS(1000))) {
+    MC_TRACE(TRACE_BEEP_Q_SEND_FAILED, on);
     ESP_LOGE(LOG_TAG, "Failed to enqueue beep OFF");
+  } else {
+    MC_TRACE(TRACE_BEEP_Q_SEND, on);
   }
 }
 
 static void motor_off (struct mc_task_args_t_ *mc_task_args) {
   static bool on = false; /* I think this needs to be static */
   if (pdTRUE != xQueueSend(mc_task_args->motor_on_off_q, (void *) &on, pdMS_TO_TICKS(1000))) {
+    MC_TRACE(TRACE_MOTOR_Q_SEND_FAILED, on);
     ESP_LOGE(LOG_TAG, "Failed to enqueue motor OFF");
+  } else {
+    MC_TRACE(TRACE_MOTOR_Q_SEND, on);
   }
 }
 
-/* Reading the GPIO and counting a single high as `full` and a single low as
-   `not full` is too unreliable.
-   Even when the tank is full, we get the occasional not-full reading.
-   And even when the tank is not full, we get a few spurious tank-full readings in
-   succession.
-   To address this, we average out a few readings by maintaining a circular buffer
-   of booleans.
-   Once the number of `trues` in the circular buffer crosses a threshold, we treat
-   that as a SINGLE tank-full.
-
-   We use `n` successive tank-full indications derived using this method to
-   sound the beep.
-   We use `m` successive tank-full indications derived using this method to
-   turn the motor off.
-   Where n = SUCCESSIVE_FULL_INDICATIONS_FOR_BEEP and m is
-   SUCCESSIVE_FULL_INDICATIONS_FOR_MOTOR_OFF */
-   
-#define FULL_REPORTS_CIRC_BUFF_SIZE 10
-#define FULL_REPORTS_THRESHOLD 4
-static bool full_reports_circ_buff[FULL_REPORTS_CIRC_BUFF_SIZE];
-static unsigned int full_reports_circ_buff_index = 0;
+/* The filter that turns the unreliable sensor readings into tank-full
+   decisions is in tank_filter.c */
+static struct tank_filter_t_ tank_filter;
 
 /* We want to log the full reports for debugging reasons, but since that
    is updated every second it generates a lot of unnecessary logs. So
    we log it only when its value has changed.
    It's initially set to an impossible value. */
-static unsigned int full_reports_last_logged = FULL_REPORTS_CIRC_BUFF_SIZE + 1;
+static unsigned int full_reports_last_logged = TANK_FILTER_MAX_WINDOW + 1;
 
-/* Take one GPIO reading, add it to the circular buffer, average out the
-   circular buffer readings, and return whether the threshold was crossed. */
-static bool update_and_report_tank_full (bool is_reporting_full_now) {
-  unsigned int i, full_reports;
-  
-  full_reports_circ_buff[full_reports_circ_buff_index++] = is_reporting_full_now;
-  full_reports_circ_buff_index %= FULL_REPORTS_CIRC_BUFF_SIZE;
+/* Sensor trace: while it is on (`sensor-trace=start`), every reading taken
+   while the motor runs is recorded, along with the motor stopping, in the
+   16 bit records described in tank_filter.h. /mc_sensor_trace returns it, and
+   tools/tank_replay.c replays it through the filter. Recording stops when
+   the buffer is full. */
+#define SENSOR_TRACE_RECORDS CONFIG_WLM_SENSOR_TRACE_RECORDS
+
+static uint16_t *sensor_trace = NULL;
+static struct sensor_trace_header_t_ sensor_trace_header;
+static bool sensor_trace_on = false;
+static int64_t sensor_trace_last_ms = 0;
+static portMUX_TYPE sensor_trace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+bool sensor_trace_start (void) {
+  uint16_t *buf, *old;
+  time_t now;
+
+  buf = malloc(SENSOR_TRACE_RECORDS * sizeof(uint16_t));
+  if (!buf) {
+    ESP_LOGE(LOG_TAG, "Unable to allocate the sensor trace buffer");
+    return false;
+  }
+  time(&now);
+
+  taskENTER_CRITICAL(&sensor_trace_lock);
+  old = sensor_trace;
+  sensor_trace = buf;
+  memcpy(sensor_trace_header.magic, SENSOR_TRACE_MAGIC, sizeof(sensor_trace_header.magic));
+  sensor_trace_header.version = SENSOR_TRACE_VERSION;
+  sensor_trace_header.tick_ms = SENSOR_TRACE_TICK_MS;
+  sensor_trace_header.count = 0;
+  sensor_trace_header.start_ms = esp_timer_get_time() / 1000;
+  /* Anything before 2020 means the time was never set */
+  sensor_trace_header.start_epoch = (now > 1577836800) ? (uint32_t) now : 0;
+  sensor_trace_last_ms = sensor_trace_header.start_ms;
+  sensor_trace_on = true;
+  taskEXIT_CRITICAL(&sensor_trace_lock);
+
+  free(old);
+  ESP_LOGI(LOG_TAG, "Sensor trace started (%u records max)", SENSOR_TRACE_RECORDS);
+  return true;
+}
+
+/* Stop recording; what was recorded can still be fetched */
+void sensor_trace_stop (void) {
+  taskENTER_CRITICAL(&sensor_trace_lock);
+  sensor_trace_on = false;
+  taskEXIT_CRITICAL(&sensor_trace_lock);
+  ESP_LOGI(LOG_TAG, "Sensor trace stopped");
+}
 
-  full_reports = 0;
-  for (i = 0; i < FULL_REPORTS_CIRC_BUFF_SIZE; i++) {
-    if (full_reports_circ_buff[i]) {
-      full_reports++;
+static void sensor_trace_record (bool motor_running, bool full) {
+  int64_t now_ms = esp_timer_get_time() / 1000;
+  uint32_t delta;
+  bool now_full = false;
+
+  taskENTER_CRITICAL(&sensor_trace_lock);
+  if (sensor_trace_on) {
+    delta = (now_ms - sensor_trace_last_ms) / SENSOR_TRACE_TICK_MS;
+    if (delta > SENSOR_TRACE_DELTA_MASK) {
+      delta = SENSOR_TRACE_DELTA_MASK;
+    }
+    sensor_trace[sensor_trace_header.count++] = delta |
+      (motor_running ? SENSOR_TRACE_MOTOR_RUNNING : 0) |
+      (full ? SENSOR_TRACE_LEVEL_FULL : 0);
+    sensor_trace_last_ms = now_ms;
+    if (sensor_trace_header.count == SENSOR_TRACE_RECORDS) {
+      sensor_trace_on = false;
+      now_full = true;
     }
   }
+  taskEXIT_CRITICAL(&sensor_trace_lock);
 
-  if (full_reports != full_reports_last_logged) {
-    ESP_LOGI(LOG_TAG, "GPIO now = %s, full reports in last %u seconds = %u",
-	     is_reporting_full_now ? "full" : "not full",
-	     FULL_REPORTS_CIRC_BUFF_SIZE, full_reports);
-    full_reports_last_logged = full_reports;
+  if (now_full) {
+    ESP_LOGW(LOG_TAG, "Sensor trace buffer full, recording stopped");
   }
-  
-  if (full_reports >= FULL_REPORTS_THRESHOLD) {
-    return true;
+}
+
+/* Snapshot of the header; the records [0, header->count) can then be read
+   with sensor_trace_read() even while recording goes on. Returns false if
+   there is no trace. */
+bool sensor_trace_get_header (struct sensor_trace_header_t_ *header) {
+  bool ret;
+
+  taskENTER_CRITICAL(&sensor_trace_lock);
+  ret = (sensor_trace != NULL);
+  *header = sensor_trace_header;
+  taskEXIT_CRITICAL(&sensor_trace_lock);
+  return ret;
+}
+
+void sensor_trace_read (size_t index, uint16_t *records, size_t n) {
+  taskENTER_CRITICAL(&sensor_trace_lock);
+  if (sensor_trace) {
+    memcpy(records, &sensor_trace[index], n * sizeof(uint16_t));
+  }
+  taskEXIT_CRITICAL(&sensor_trace_lock);
+}
+
+/* Wakeup jitter of the sampling loop: how far each sleep is off from what
+   was asked for. With a 10ms tick, the spread (max - min) is at most one tick
+   on an otherwise idle unit; anything beyond that is time the task spent
+   waiting for the CPU after it was due to wake up. Reported in /mc_stats,
+   and reset with `jitter=reset` to measure over a window (e.g. a benchmark
+   run, or an OTA download).
+
+   The loop sleeps SAMPLE_PERIOD_MS, less the PROBE_SETTLE_MS the probe takes
+   to read when it is read fast, so that fast readings are SAMPLE_PERIOD_MS
+   apart. */
+#define SAMPLE_PERIOD_MS 1000
+#define PROBE_SETTLE_MS 500
+
+static uint32_t jitter_samples = 0;
+static int32_t jitter_min_us = INT32_MAX;
+static int32_t jitter_max_us = INT32_MIN;
+static portMUX_TYPE jitter_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void record_jitter (int64_t slept_us, uint32_t sleep_ms) {
+  int32_t jitter_us = slept_us - (int64_t) sleep_ms * 1000;
+
+  taskENTER_CRITICAL(&jitter_lock);
+  jitter_samples++;
+  if (jitter_us < jitter_min_us) {
+    jitter_min_us = jitter_us;
+  }
+  if (jitter_us > jitter_max_us) {
+    jitter_max_us = jitter_us;
+  }
+  taskEXIT_CRITICAL(&jitter_lock);
+}
+
+void oh_tank_level_jitter (uint32_t *samples, int32_t *min_us, int32_t *max_us) {
+  taskENTER_CRITICAL(&jitter_lock);
+  *samples = jitter_samples;
+  *min_us = jitter_samples ? jitter_min_us : 0;
+  *max_us = jitter_samples ? jitter_max_us : 0;
+  taskEXIT_CRITICAL(&jitter_lock);
+}
+
+void oh_tank_level_jitter_reset (void) {
+  taskENTER_CRITICAL(&jitter_lock);
+  jitter_samples = 0;
+  jitter_min_us = INT32_MAX;
+  jitter_max_us = INT32_MIN;
+  taskEXIT_CRITICAL(&jitter_lock);
+}
+
+/* Fill time model (fill_model.c), saved in NVS after every fill learned.
+   Only this task changes it; /mc_stats reads a copy. */
+#define FILL_MODEL_NAMESPACE "mc_fill"
+#define FILL_MODEL_KEY "model"
+
+static struct fill_model_t_ fill_model;
+static uint32_t fill_probe_reads = 0;
+static uint32_t fill_cutoffs = 0;
+static volatile bool fill_model_reset_requested = false;
+static portMUX_TYPE fill_model_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void load_fill_model (void) {
+  struct fill_model_config_t_ config = {
+    .min_runs = CONFIG_WLM_FILL_MODEL_MIN_RUNS,
+    .max_runs = CONFIG_WLM_FILL_MODEL_MAX_RUNS,
+    .slow_period_s = CONFIG_WLM_FILL_SLOW_PERIOD_S,
+    .fast_lead_s = CONFIG_WLM_FILL_FAST_LEAD_S,
+    .max_runtime_s = CONFIG_WLM_FILL_MAX_RUNTIME_S,
+  };
+  struct fill_model_stats_t_ stats;
+  size_t len = sizeof(stats);
+  nvs_handle_t nvs;
+  bool restored = false;
+
+  if (!fill_model_init(&fill_model, &config)) {
+    /* Kconfig ranges keep this from happening */
+    ESP_LOGE(LOG_TAG, "Bad fill model configuration");
+  }
+  if (nvs_open(FILL_MODEL_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    restored = (nvs_get_blob(nvs, FILL_MODEL_KEY, &stats, &len) == ESP_OK) &&
+      (len == sizeof(stats)) && fill_model_restore(&fill_model, &stats);
+    nvs_close(nvs);
+  }
+  if (restored) {
+    ESP_LOGI(LOG_TAG, "Fill model: %lu fills, mean %.0fs, stddev %.0fs",
+	     (unsigned long) fill_model.stats.runs, fill_model.stats.mean_s,
+	     fill_model_stddev_s(&fill_model));
   } else {
-    return false;
+    ESP_LOGI(LOG_TAG, "No fill model yet, the probe is read every %d ms",
+	     SAMPLE_PERIOD_MS);
+  }
+}
+
+/* Write the model to NVS, or erase it there if it has no fills */
+static void save_fill_model (struct fill_model_stats_t_ const *stats) {
+  nvs_handle_t nvs;
+  esp_err_t err;
+
+  err = nvs_open(FILL_MODEL_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err == ESP_OK) {
+    if (stats->runs > 0) {
+      err = nvs_set_blob(nvs, FILL_MODEL_KEY, stats, sizeof(*stats));
+    } else {
+      err = nvs_erase_key(nvs, FILL_MODEL_KEY);
+      if (err == ESP_ERR_NVS_NOT_FOUND) {
+	err = ESP_OK;
+      }
+    }
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to save the fill model (%s)", esp_err_to_name(err));
   }
 }
 
-/* Utility function to clear out the full reports circular buffer */
-static void clear_full_reports (void) {
+static void learn_fill (uint32_t fill_s) {
+  struct fill_model_t_ model = fill_model;
+  bool learned;
+
+  learned = fill_model_learn(&model, fill_s);
+  if (!learned) {
+    ESP_LOGW(LOG_TAG, "Tank full after %lus, before the earliest expected full at %lus "
+	     "(it was not empty?); not learned", (unsigned long) fill_s,
+	     (unsigned long) fill_model_fast_after_s(&fill_model));
+    return;
+  }
+  taskENTER_CRITICAL(&fill_model_lock);
+  fill_model = model;
+  taskEXIT_CRITICAL(&fill_model_lock);
+  save_fill_model(&model.stats);
+  ESP_LOGI(LOG_TAG, "Tank full after %lus; fill model: %lu fills, mean %.0fs, "
+	   "stddev %.0fs", (unsigned long) fill_s, (unsigned long) model.stats.runs,
+	   model.stats.mean_s, fill_model_stddev_s(&model));
+}
+
+/* Forget the learned fill times, e.g. after the tank or the pump was
+   changed. Takes effect at the next loop of the task. */
+void oh_tank_level_fill_model_reset (void) {
+  fill_model_reset_requested = true;
+}
+
+static void handle_fill_model_reset (void) {
+  struct fill_model_t_ model = fill_model;
+
+  fill_model_reset_requested = false;
+  fill_model_reset(&model);
+  taskENTER_CRITICAL(&fill_model_lock);
+  fill_model = model;
+  taskEXIT_CRITICAL(&fill_model_lock);
+  save_fill_model(&model.stats);
+  ESP_LOGI(LOG_TAG, "Fill model reset");
+}
+
+/* `fill_*` lines for /mc_stats */
+int oh_tank_level_format_stats (char *buf, size_t len) {
+  struct fill_model_t_ model;
+  uint32_t probe_reads, cutoffs;
+
+  taskENTER_CRITICAL(&fill_model_lock);
+  model = fill_model;
+  probe_reads = fill_probe_reads;
+  cutoffs = fill_cutoffs;
+  taskEXIT_CRITICAL(&fill_model_lock);
+
+  return snprintf(buf, len,
+		  "fill_runs=%lu\n"
+		  "fill_mean_s=%lu\n"
+		  "fill_stddev_s=%lu\n"
+		  "fill_fast_after_s=%lu\n"
+		  "fill_cutoff_s=%lu\n"
+		  "fill_cutoffs=%lu\n"
+		  "fill_probe_reads=%lu\n",
+		  (unsigned long) model.stats.runs,
+		  (unsigned long) model.stats.mean_s,
+		  (unsigned long) fill_model_stddev_s(&model),
+		  (unsigned long) fill_model_fast_after_s(&model),
+		  (unsigned long) fill_model_cutoff_s(&model),
+		  (unsigned long) cutoffs,
+		  (unsigned long) probe_reads);
+}
+
+/* Hot standby (replica.c): the active unit publishes the run, the filter and
+   the fill model every loop; the standby one leaves the probe alone, follows
+   the fill model and the tank full state, and picks up the run where the
+   active one left it if it takes over. */
+static void publish_replica (struct mc_task_args_t_ *mc_task_args, bool motor_running,
+			     int64_t run_start_us) {
+  struct replica_state_t_ state;
+  unsigned int i;
+
+  memset(&state, 0, sizeof(state));
+  state.motor_running = motor_running;
+  state.tank_full = (xEventGroupGetBits(mc_task_args->mc_event_group) &
+		     EVENT_OH_TANK_FULL) != 0;
+  state.run_start_ms = run_start_us / 1000;
+  for (i = 0; i < tank_filter.config.window; i++) {
+    if (tank_filter.readings[i]) {
+      state.filter_readings |= 1UL << i;
+    }
+  }
+  state.filter_index = tank_filter.index;
+  state.filter_successive = tank_filter.successive_full_indications;
+  state.fill = fill_model.stats;
+  replica_publish(&state);
+}
+
+static void follow_replica (struct mc_task_args_t_ *mc_task_args, uint32_t *version) {
+  struct replica_state_t_ state;
+  struct fill_model_t_ model = fill_model;
+  EventBits_t bits;
+
+  if (!replica_get_state(&state, version)) {
+    return;
+  }
+  bits = xEventGroupGetBits(mc_task_args->mc_event_group);
+  if (((bits & EVENT_OH_TANK_FULL) != 0) != state.tank_full) {
+    if (state.tank_full) {
+      xEventGroupSetBits(mc_task_args->mc_event_group, EVENT_OH_TANK_FULL);
+    } else {
+      xEventGroupClearBits(mc_task_args->mc_event_group, EVENT_OH_TANK_FULL);
+    }
+    beacon_notify();
+  }
+
+  if ((state.fill.runs == model.stats.runs) && (state.fill.mean_s == model.stats.mean_s) &&
+      (state.fill.m2 == model.stats.m2)) {
+    return;
+  }
+  if (state.fill.runs == 0) {
+    fill_model_reset(&model);
+  } else if (!fill_model_restore(&model, &state.fill)) {
+    return;
+  }
+  taskENTER_CRITICAL(&fill_model_lock);
+  fill_model = model;
+  taskEXIT_CRITICAL(&fill_model_lock);
+  save_fill_model(&model.stats);
+  ESP_LOGI(LOG_TAG, "Fill model from the active unit: %lu fills, mean %.0fs",
+	   (unsigned long) model.stats.runs, model.stats.mean_s);
+}
+
+/* Returns false if the state does not fit the filter's configuration */
+static bool resume_filter (struct replica_state_t_ const *state) {
   unsigned int i;
 
-  for (i = 0; i < FULL_REPORTS_CIRC_BUFF_SIZE; i++) {
-    full_reports_circ_buff[i] = false;
+  if ((state->filter_index >= tank_filter.config.window) ||
+      (state->filter_readings >> (tank_filter.config.window - 1) >> 1)) {
+    return false;
+  }
+  tank_filter.full_reports = 0;
+  for (i = 0; i < tank_filter.config.window; i++) {
+    tank_filter.readings[i] = (state->filter_readings >> i) & 1;
+    tank_filter.full_reports += tank_filter.readings[i];
   }
-  full_reports_circ_buff_index = 0;
+  tank_filter.index = state->filter_index;
+  tank_filter.successive_full_indications = state->filter_successive;
+  return true;
 }
 
 static bool is_motor_running_now (struct mc_task_args_t_ *mc_task_args) {
@@ -111,19 +427,63 @@ static bool is_motor_running_now (struct mc_task_args_t_ *mc_task_args) {
 
 void oh_tank_level_task (void *param) {
   bool beeping_now, motor_was_running, is_reporting_full_now;
+  bool fast_sampling = true, cut_off = false, reported_healthy = false;
+  bool following = false, resume = false;
   struct mc_task_args_t_ *mc_task_args = (struct mc_task_args_t_ *) param;
-  unsigned int successive_full_indications = 0;
+  struct tank_filter_config_t_ filter_config = TANK_FILTER_DEFAULT_CONFIG;
+  struct replica_state_t_ resumed;
+  unsigned int actions;
+  int64_t sleep_start_us, run_start_us = 0, last_read_us = 0;
+  uint32_t sleep_ms, run_s, fast_after_s = 0, cutoff_s = 0, replica_version = 0;
+  struct io_snapshot_t_ inputs;
 
-  clear_full_reports();
+  tank_filter_init(&tank_filter, &filter_config);
+  load_fill_model();
   
   beeping_now = false;
   motor_was_running = false;
-  successive_full_indications = 0;
+
+  /* 1 second, plus 500ms to read the sensor while the motor runs */
+  supervisor_register(SUPERVISED_OH_TANK_LEVEL, "oh_tank_level", 1500);
   
   while (pdTRUE) {
-    vTaskDelay(pdMS_TO_TICKS(1000));
+    supervisor_heartbeat(SUPERVISED_OH_TANK_LEVEL);
+    if (fill_model_reset_requested) {
+      handle_fill_model_reset();
+    }
+    if (replica_is_active()) {
+      if (following) {
+	/* Just took over: the run the active unit had going, if any, before
+	   it is published over */
+	following = false;
+	resume = replica_resume_run(&resumed);
+      }
+      publish_replica(mc_task_args, motor_was_running, run_start_us);
+    }
+    sleep_ms = (motor_was_running && fast_sampling) ? SAMPLE_PERIOD_MS - PROBE_SETTLE_MS :
+      SAMPLE_PERIOD_MS;
+    sleep_start_us = esp_timer_get_time();
+    vTaskDelay(pdMS_TO_TICKS(sleep_ms));
+    record_jitter(esp_timer_get_time() - sleep_start_us, sleep_ms);
+    if (!reported_healthy) {
+      xEventGroupSetBits(mc_task_args->mc_event_group, EVENT_HEALTH_TANK_LEVEL);
+      reported_healthy = true;
+    }
+
+    if (!replica_is_active()) {
+      /* The probe is the active unit's to read */
+      if (beeping_now) {
+	beep_off(mc_task_args);
+	beeping_now = false;
+      }
+      motor_was_running = false;
+      following = true;
+      follow_replica(mc_task_args, &replica_version);
+      continue;
+    }
 
     if (!is_motor_running_now(mc_task_args)) {
+      resume = false;
       /* If we are beeping, stop it because the motor is now off */
       if (beeping_now) {
 	ESP_LOGI(LOG_TAG, "Turning beep off now because motor is not running");
@@ -132,41 +492,119 @@ void oh_tank_level_task (void *param) {
       }
       if (motor_was_running) {
 	motor_was_running = false;
+	sensor_trace_record(false, false);
 	ESP_LOGI(LOG_TAG, "Motor was running, now stopped");
       }
     } else {
       if (!motor_was_running) {
 	motor_was_running = true;
-	successive_full_indications = 0;
-	clear_full_reports();
+	tank_filter_reset(&tank_filter);
+	/* The tank is being filled again */
+	if (xEventGroupClearBits(mc_task_args->mc_event_group, EVENT_OH_TANK_FULL) &
+	    EVENT_OH_TANK_FULL) {
+	  beacon_notify();
+	}
 	ESP_LOGI(LOG_TAG, "Motor was stopped, now running");
+
+	/* The plan for this run, from the fills learned so far. The first
+	   reading is taken right away, in case the tank is already full. */
+	run_start_us = esp_timer_get_time();
+	if (resume) {
+	  /* Took over from the active unit during its run */
+	  resume = false;
+	  if (resume_filter(&resumed)) {
+	    run_start_us -= (int64_t) ((uint32_t) (run_start_us / 1000) -
+				       resumed.run_start_ms) * 1000;
+	    ESP_LOGI(LOG_TAG, "Resuming the run the active unit started %lus ago",
+		     (unsigned long) ((esp_timer_get_time() - run_start_us) / 1000000));
+	  } else {
+	    ESP_LOGW(LOG_TAG, "Could not resume the active unit's run (filter mismatch)");
+	  }
+	}
+	last_read_us = run_start_us - (int64_t) CONFIG_WLM_FILL_SLOW_PERIOD_S * 1000000;
+	fast_after_s = fill_model_fast_after_s(&fill_model);
+	cutoff_s = fill_model_cutoff_s(&fill_model);
+	fast_sampling = (fast_after_s == 0);
+	cut_off = false;
+	if (!fast_sampling) {
+	  ESP_LOGI(LOG_TAG, "Reading the probe every %ds until %lus into the run, "
+		   "cutoff at %lus", CONFIG_WLM_FILL_SLOW_PERIOD_S,
+		   (unsigned long) fast_after_s, (unsigned long) cutoff_s);
+	}
       }
 
+      run_s = (esp_timer_get_time() - run_start_us) / 1000000;
+      if (run_s >= cutoff_s) {
+	/* The probe should have seen the tank full by now. Counted once per
+	   run, but asked for every loop until the motor does stop: the request
+	   can time out on the queue, or be dropped by a fenced unit. */
+	if (!cut_off) {
+	  cut_off = true;
+	  taskENTER_CRITICAL(&fill_model_lock);
+	  fill_cutoffs++;
+	  taskEXIT_CRITICAL(&fill_model_lock);
+	  ESP_LOGE(LOG_TAG, "Motor has run for %lus without the tank reading full, "
+		   "turning it off (cutoff at %lus; fill-model=reset if the fill time "
+		   "has changed)", (unsigned long) run_s, (unsigned long) cutoff_s);
+	}
+	motor_off(mc_task_args);
+	continue;
+      }
+      if (!fast_sampling) {
+	if (run_s >= fast_after_s) {
+	  fast_sampling = true;
+	  ESP_LOGI(LOG_TAG, "%lus into the run, reading the probe every %d ms",
+		   (unsigned long) run_s, SAMPLE_PERIOD_MS);
+	} else if ((esp_timer_get_time() - last_read_us) <
+		   (int64_t) CONFIG_WLM_FILL_SLOW_PERIOD_S * 1000000) {
+	  continue;
+	}
+      }
+      last_read_us = esp_timer_get_time();
+
       /* Enable the water level sensor and wait for 500ms*/
-      gpio_set_level(WATER_LEVEL_ENABLE_OUT, 1);
-      vTaskDelay(pdMS_TO_TICKS(500));
+      io_set(IO_WATER_LEVEL_ENABLE, 1);
+      vTaskDelay(pdMS_TO_TICKS(PROBE_SETTLE_MS));
 
       /* Read the water level and disable the water level sensor */
-      is_reporting_full_now = gpio_get_level(WATER_LEVEL_IN);
-      gpio_set_level(WATER_LEVEL_ENABLE_OUT, 0);
-      
-      if (update_and_report_tank_full(is_reporting_full_now)) {
-	successive_full_indications++;
-      } else {
-	successive_full_indications = 0;
+      io_snapshot(&inputs);
+      is_reporting_full_now = IO_LEVEL(&inputs, IO_WATER_LEVEL);
+      MC_TRACE(TRACE_GPIO_READ, io_trace_arg(IO_WATER_LEVEL, is_reporting_full_now));
+      io_set(IO_WATER_LEVEL_ENABLE, 0);
+      sensor_trace_record(true, is_reporting_full_now);
+      taskENTER_CRITICAL(&fill_model_lock);
+      fill_probe_reads++;
+      taskEXIT_CRITICAL(&fill_model_lock);
+
+      if (is_reporting_full_now && !fast_sampling) {
+	/* Earlier than expected: the tank was not empty at the start */
+	fast_sampling = true;
+	ESP_LOGI(LOG_TAG, "Full reading %lus into the run, reading the probe every "
+		 "%d ms", (unsigned long) run_s, SAMPLE_PERIOD_MS);
+      }
+
+      actions = tank_filter_sample(&tank_filter, is_reporting_full_now);
+      if (tank_filter.full_reports != full_reports_last_logged) {
+	ESP_LOGI(LOG_TAG, "GPIO now = %s, full reports in last %u readings = %u",
+		 is_reporting_full_now ? "full" : "not full",
+		 tank_filter.config.window, tank_filter.full_reports);
+	full_reports_last_logged = tank_filter.full_reports;
       }
 
-      if (successive_full_indications == SUCCESSIVE_FULL_INDICATIONS_FOR_BEEP) {
+      if (actions & TANK_FILTER_BEEP) {
 	ESP_LOGI(LOG_TAG, "Successive tank full indications have crossed the beep "
 		 "threshold");
 	beep_on(mc_task_args);
 	beeping_now = true;
       }
 
-      if (successive_full_indications == SUCCESSIVE_FULL_INDICATIONS_FOR_MOTOR_OFF) {
+      if (actions & TANK_FILTER_MOTOR_OFF) {
 	ESP_LOGI(LOG_TAG, "Successive tank full indications have crossed the motor"
 		 " off threshold");
+	xEventGroupSetBits(mc_task_args->mc_event_group, EVENT_OH_TANK_FULL);
+	beacon_notify();
 	motor_off(mc_task_args);
+	learn_fill((esp_timer_get_time() - run_start_us) / 1000000);
       }
     }
   }
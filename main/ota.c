@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
@@ -11,6 +15,11 @@
 #include "esp_http_client.h"
 #include "esp_flash_partitions.h"
 #include "esp_partition.h"
+#include "esp_timer.h"
+#include "esp_app_desc.h"
+#include "esp_cpu.h"
+#include "nvs.h"
+#include "mbedtls/sha256.h"
 #include "errno.h"
 #include "mc.h"
 
@@ -24,9 +33,63 @@ extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
 
 static char const *LOG_TAG = "mc|ota";
 
+/* The HTTP client used for OTA is created once and kept across attempts. It
+   holds on to the TLS session of the last successful handshake
+   (`save_client_session`), so that a retry, or the next upgrade from the same
+   server, resumes that session (by ticket, or by session ID if the server does
+   not do tickets) instead of doing a full handshake. Only the CA embedded from
+   server_certs/ca_cert.pem is trusted; the default certificate bundle is not
+   built in, and mbedTLS uses dynamic buffers so the 16 KB record buffer is
+   only allocated while a record is actually being received. */
+static esp_http_client_handle_t ota_client = NULL;
+
+/* Measurements of the last OTA attempt, reported by /mc_stats */
+static uint32_t ota_attempts = 0;
+static uint32_t ota_last_handshake_ms = 0;
+static uint32_t ota_last_heap_used_peak = 0;
+
+static esp_http_client_handle_t get_ota_client (char const *url) {
+  esp_http_client_config_t config = {
+    .url = url,
+    .cert_pem = (char *)server_cert_pem_start,
+    .timeout_ms = 10000,
+    .keep_alive_enable = true,
+    .save_client_session = true,
+  };
+
+  if (ota_client) {
+    if (esp_http_client_set_url(ota_client, url) == ESP_OK) {
+      return ota_client;
+    }
+    ESP_LOGW(LOG_TAG, "Unable to reuse OTA client, creating a new one");
+    esp_http_client_cleanup(ota_client);
+  }
+  ota_client = esp_http_client_init(&config);
+  return ota_client;
+}
+
+/* Closes the connection, but keeps the client (and its saved TLS session) for
+   the next attempt */
 static void http_cleanup (esp_http_client_handle_t client) {
   esp_http_client_close(client);
-  esp_http_client_cleanup(client);
+}
+
+/* Keep track of the lowest free heap seen during the download */
+static void sample_heap (uint32_t heap_before, uint32_t *lowest_free) {
+  uint32_t free_now = esp_get_free_heap_size();
+
+  if (free_now < *lowest_free) {
+    *lowest_free = free_now;
+    if (heap_before > free_now) {
+      ota_last_heap_used_peak = heap_before - free_now;
+    }
+  }
+}
+
+void ota_get_stats (uint32_t *attempts, uint32_t *handshake_ms, uint32_t *heap_used_peak) {
+  *attempts = ota_attempts;
+  *handshake_ms = ota_last_handshake_ms;
+  *heap_used_peak = ota_last_heap_used_peak;
 }
 
 static void print_sha256 (const uint8_t *image_hash, const char *label) {
@@ -38,20 +101,94 @@ static void print_sha256 (const uint8_t *image_hash, const char *label) {
   ESP_LOGI(LOG_TAG, "%s: %s", label, hash_print);
 }
 
-static bool do_ota(char const *url) {
-  esp_err_t err;
-  esp_ota_handle_t update_handle = 0 ;
-  esp_partition_t const *update_partition, *configured, *running, *last_invalid_app;
-  esp_http_client_config_t config = {
-    .url = url,
-    .cert_pem = (char *)server_cert_pem_start,
-    .timeout_ms = 10000,
-    .keep_alive_enable = true,
-  };
-  int binary_file_length, data_read;
+/* An OTA writer streams an image into the next update partition, hashing it on
+   the way, so that neither the pull (do_ota) nor the push (/mc_ota) path ever
+   holds more than one block of the image in RAM, or has to read the image
+   back from flash to verify it. Only one writer can exist at a time. */
+struct ota_writer_t_ {
+  esp_ota_handle_t update_handle;
+  esp_partition_t const *update_partition;
+  mbedtls_sha256_context sha_ctx;
+  size_t length;
   bool image_header_was_checked;
-  esp_app_desc_t new_app_info, running_app_info, invalid_app_info;
-  esp_http_client_handle_t client;
+  char version[sizeof(((esp_app_desc_t *) 0)->version)];
+};
+
+static portMUX_TYPE ota_writer_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool ota_writer_busy = false;
+
+/* A firmware upgrade goes through two phases. The download phase (ota_task
+   at idle priority for a pull, or the /mc_ota handler for a push) writes and
+   verifies the image, and leaves it staged in the update partition. The
+   apply phase, run by ota_task, makes the staged image the boot partition and
+   restarts, but only once the motor has been idle for a while (and, if one is
+   configured, within the maintenance window), so that an upgrade never
+   interrupts a fill. */
+enum ota_phase_t_ {
+  OTA_PHASE_IDLE,
+  OTA_PHASE_DOWNLOADING,
+  OTA_PHASE_STAGED,
+  OTA_PHASE_APPLYING
+};
+
+static enum ota_phase_t_ ota_phase = OTA_PHASE_IDLE;
+static esp_partition_t const *staged_partition = NULL;
+static char staged_version[sizeof(((esp_app_desc_t *) 0)->version)];
+
+/* The status LED blinks slowly for as long as an upgrade is under way */
+static void set_ota_phase (enum ota_phase_t_ phase) {
+  ota_phase = phase;
+  status_set(STATUS_OTA, phase != OTA_PHASE_IDLE);
+}
+
+char const *ota_get_phase (char const **version) {
+  *version = (ota_phase >= OTA_PHASE_STAGED) ? staged_version : NULL;
+  switch (ota_phase) {
+  case OTA_PHASE_DOWNLOADING:
+    return "downloading";
+  case OTA_PHASE_STAGED:
+    return "staged, waiting for the motor to be idle";
+  case OTA_PHASE_APPLYING:
+    return "applying";
+  default:
+    return "idle";
+  }
+}
+
+/* Parse a SHA-256 digest given as exactly 64 hex characters */
+bool ota_parse_sha256 (char const *hex, uint8_t *digest) {
+  int i;
+  unsigned int byte;
+
+  if ((strspn(hex, "0123456789abcdefABCDEF") != HASH_LEN * 2) || (hex[HASH_LEN * 2] != '\0')) {
+    return false;
+  }
+  for (i = 0; i < HASH_LEN; i++) {
+    if (sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+      return false;
+    }
+    digest[i] = (uint8_t) byte;
+  }
+  return true;
+}
+
+struct ota_writer_t_ *ota_writer_begin (void) {
+  struct ota_writer_t_ *writer;
+  esp_partition_t const *configured, *running;
+  bool busy;
+
+  /* Not while a staged image is being applied: this would erase the
+     partition it is making the boot one */
+  taskENTER_CRITICAL(&ota_writer_lock);
+  busy = ota_writer_busy || (ota_phase == OTA_PHASE_APPLYING);
+  if (!busy) {
+    ota_writer_busy = true;
+  }
+  taskEXIT_CRITICAL(&ota_writer_lock);
+  if (busy) {
+    ESP_LOGE(LOG_TAG, "Another firmware upgrade is in progress");
+    return NULL;
+  }
 
   configured = esp_ota_get_boot_partition();
   running = esp_ota_get_running_partition();
@@ -62,101 +199,378 @@ static bool do_ota(char const *url) {
     ESP_LOGW(LOG_TAG, "(This can happen if either the OTA boot data or preferred boot "
 	     "image become corrupted somehow.)");
   }
-  
-  client = esp_http_client_init(&config);
+
+  writer = calloc(1, sizeof(*writer));
+  if (!writer) {
+    ESP_LOGE(LOG_TAG, "Failed to allocate OTA writer");
+    ota_writer_busy = false;
+    return NULL;
+  }
+
+  writer->update_partition = esp_ota_get_next_update_partition(NULL);
+  if (!writer->update_partition) {
+    ESP_LOGE(LOG_TAG, "Update partition is NULL, not doing OTA");
+    free(writer);
+    ota_writer_busy = false;
+    return NULL;
+  }
+  ESP_LOGI(LOG_TAG, "Writing to partition subtype %d at offset 0x%"PRIx32,
+	   writer->update_partition->subtype, writer->update_partition->address);
+
+  mbedtls_sha256_init(&writer->sha_ctx);
+  mbedtls_sha256_starts(&writer->sha_ctx, 0);
+
+  /* A new download overwrites whatever was staged */
+  staged_partition = NULL;
+  set_ota_phase(OTA_PHASE_DOWNLOADING);
+  return writer;
+}
+
+/* Look at the app description in the first block of the image, refuse a
+   version that has already failed to boot, and start the flash write. */
+static bool check_image_header (struct ota_writer_t_ *writer, void const *data,
+				size_t len) {
+  esp_app_desc_t new_app_info, running_app_info, invalid_app_info;
+  esp_partition_t const *last_invalid_app;
+  esp_err_t err;
+
+  if (len <= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) +
+      sizeof(esp_app_desc_t)) {
+    ESP_LOGE(LOG_TAG, "first block of the image is too small (%u bytes)", (unsigned) len);
+    return false;
+  }
+
+  memcpy(&new_app_info,
+	 (uint8_t const *) data + sizeof(esp_image_header_t) +
+	 sizeof(esp_image_segment_header_t),
+	 sizeof(esp_app_desc_t));
+  ESP_LOGI(LOG_TAG, "Incoming version: %s", new_app_info.version);
+  strlcpy(writer->version, new_app_info.version, sizeof(writer->version));
+
+  if (esp_ota_get_partition_description(esp_ota_get_running_partition(),
+					&running_app_info) == ESP_OK) {
+    ESP_LOGI(LOG_TAG, "Running version: %s", running_app_info.version);
+  }
+
+  last_invalid_app = esp_ota_get_last_invalid_partition();
+  if (esp_ota_get_partition_description(last_invalid_app, &invalid_app_info) ==
+      ESP_OK) {
+    ESP_LOGI(LOG_TAG, "Last invalid firmware version: %s", invalid_app_info.version);
+  }
+
+  if (last_invalid_app != NULL) {
+    if (memcmp(invalid_app_info.version, new_app_info.version,
+	       sizeof(new_app_info.version)) == 0) {
+      ESP_LOGW(LOG_TAG, "New version is the same as invalid version.");
+      ESP_LOGW(LOG_TAG, "Previously, there was an attempt to launch the firmware "
+	       "with %s version, but it failed.", invalid_app_info.version);
+      ESP_LOGW(LOG_TAG, "The firmware has been rolled back to the previous version.");
+      return false;
+    }
+  }
+
+  err = esp_ota_begin(writer->update_partition, OTA_WITH_SEQUENTIAL_WRITES,
+		      &writer->update_handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+    return false;
+  }
+  ESP_LOGI(LOG_TAG, "esp_ota_begin succeeded");
+  writer->image_header_was_checked = true;
+  return true;
+}
+
+/* The first call must pass at least the image header and app description */
+bool ota_writer_write (struct ota_writer_t_ *writer, void const *data, size_t len) {
+  esp_err_t err;
+
+  if (!writer->image_header_was_checked) {
+    if (!check_image_header(writer, data, len)) {
+      return false;
+    }
+  }
+
+  mbedtls_sha256_update(&writer->sha_ctx, data, len);
+  err = esp_ota_write(writer->update_handle, data, len);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "esp_ota_write() failed (%s)", esp_err_to_name(err));
+    return false;
+  }
+  writer->length += len;
+  return true;
+}
+
+size_t ota_writer_length (struct ota_writer_t_ *writer) {
+  return writer->length;
+}
+
+static void free_writer (struct ota_writer_t_ *writer) {
+  mbedtls_sha256_free(&writer->sha_ctx);
+  free(writer);
+  ota_writer_busy = false;
+}
+
+void ota_writer_abort (struct ota_writer_t_ *writer) {
+  if (writer->image_header_was_checked) {
+    esp_ota_abort(writer->update_handle);
+  }
+  free_writer(writer);
+  set_ota_phase(OTA_PHASE_IDLE);
+}
+
+/* Validate the image, check its digest against `expected_sha256` (if not
+   NULL), and stage it for ota_task to apply. The writer is freed in all
+   cases. */
+bool ota_writer_finish (struct ota_writer_t_ *writer, uint8_t const *expected_sha256) {
+  uint8_t sha_256[HASH_LEN];
+  esp_err_t err;
+
+  if (!writer->image_header_was_checked) {
+    ESP_LOGE(LOG_TAG, "No image data was written");
+    ota_writer_abort(writer);
+    return false;
+  }
+
+  mbedtls_sha256_finish(&writer->sha_ctx, sha_256);
+  print_sha256(sha_256, "SHA-256 for the received image");
+  if (expected_sha256 && (memcmp(sha_256, expected_sha256, HASH_LEN) != 0)) {
+    print_sha256(expected_sha256, "Expected SHA-256");
+    ESP_LOGE(LOG_TAG, "Image digest mismatch, discarding image");
+    ota_writer_abort(writer);
+    return false;
+  }
+
+  err = esp_ota_end(writer->update_handle);
+  writer->image_header_was_checked = false; /* the handle is gone now */
+  if (err != ESP_OK) {
+    if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+      ESP_LOGE(LOG_TAG, "Image validation failed, image is corrupted");
+    } else {
+      ESP_LOGE(LOG_TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
+    }
+    ota_writer_abort(writer);
+    return false;
+  }
+
+  ESP_LOGI(LOG_TAG, "Wrote %u byte image, version %s staged", (unsigned) writer->length,
+	   writer->version);
+  strlcpy(staged_version, writer->version, sizeof(staged_version));
+  staged_partition = writer->update_partition;
+  set_ota_phase(OTA_PHASE_STAGED);
+  free_writer(writer);
+  return true;
+}
+
+#ifdef CONFIG_WLM_BENCH_OTA_WRITE
+/* For bench.c: time `count` esp_ota_write() calls of `len` bytes from
+   `block` into the update partition, in CPU cycles each. Each block starts
+   a new flash sector, so every write includes the sector erase, as in a
+   download. This destroys whatever was in the update partition (the image
+   to roll back to), so it refuses to run while an upgrade is under way or
+   staged. Returns the number of writes timed. */
+size_t ota_bench_write (uint8_t *block, size_t len, uint32_t *cycles, size_t count) {
+  esp_partition_t const *partition;
+  esp_ota_handle_t handle;
+  uint32_t start;
+  size_t i = 0;
+  bool busy;
+
+  taskENTER_CRITICAL(&ota_writer_lock);
+  busy = ota_writer_busy || (ota_phase != OTA_PHASE_IDLE);
+  if (!busy) {
+    ota_writer_busy = true;
+  }
+  taskEXIT_CRITICAL(&ota_writer_lock);
+  if (busy) {
+    ESP_LOGE(LOG_TAG, "A firmware upgrade is in progress or staged, not benchmarking");
+    return 0;
+  }
+
+  partition = esp_ota_get_next_update_partition(NULL);
+  if (!partition || (count * len > partition->size) ||
+      (esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &handle) != ESP_OK)) {
+    ESP_LOGE(LOG_TAG, "Unable to start writing the update partition");
+    ota_writer_busy = false;
+    return 0;
+  }
+  ESP_LOGW(LOG_TAG, "Benchmarking esp_ota_write(), overwriting the partition at 0x%"PRIx32,
+	   partition->address);
+
+  /* The first block has to look like the start of an image */
+  block[0] = ESP_IMAGE_HEADER_MAGIC;
+  for (i = 0; i < count; i++) {
+    start = esp_cpu_get_cycle_count();
+    if (esp_ota_write(handle, block, len) != ESP_OK) {
+      ESP_LOGE(LOG_TAG, "esp_ota_write() failed after %u blocks", (unsigned) i);
+      break;
+    }
+    cycles[i] = esp_cpu_get_cycle_count() - start;
+  }
+  esp_ota_abort(handle);
+  ota_writer_busy = false;
+  return i;
+}
+#endif
+
+static void apply_staged_image (void) {
+  esp_partition_t const *partition = NULL;
+  esp_err_t err;
+
+  /* Takes the writer, so that an upload cannot start overwriting the staged
+     image (or unstage it) while it is being made the boot partition */
+  taskENTER_CRITICAL(&ota_writer_lock);
+  if (!ota_writer_busy && (ota_phase == OTA_PHASE_STAGED) && staged_partition) {
+    ota_writer_busy = true;
+    ota_phase = OTA_PHASE_APPLYING;
+    partition = staged_partition;
+  }
+  taskEXIT_CRITICAL(&ota_writer_lock);
+  if (!partition) {
+    return;
+  }
+
+  err = esp_ota_set_boot_partition(partition);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+    staged_partition = NULL;
+    set_ota_phase(OTA_PHASE_IDLE);
+    ota_writer_busy = false;
+    return;
+  }
+  ESP_LOGI(LOG_TAG, "OTA firmware upgrade to %s completed, restarting", staged_version);
+  stop_udp_logging();
+  esp_restart();
+}
+
+/* Whether the current time of day is inside the maintenance window. If the
+   system time has not been set (see `timeofday=`), we can't tell, and don't
+   apply. */
+static bool in_maintenance_window (void) {
+#ifdef CONFIG_WLM_OTA_APPLY_WINDOW
+  time_t now;
+  struct tm tm;
+
+  time(&now);
+  localtime_r(&now, &tm);
+  if (tm.tm_year < (2024 - 1900)) {
+    return false;
+  }
+  if (CONFIG_WLM_OTA_APPLY_WINDOW_START_HOUR <= CONFIG_WLM_OTA_APPLY_WINDOW_END_HOUR) {
+    return (tm.tm_hour >= CONFIG_WLM_OTA_APPLY_WINDOW_START_HOUR) &&
+      (tm.tm_hour < CONFIG_WLM_OTA_APPLY_WINDOW_END_HOUR);
+  }
+  /* The window wraps around midnight */
+  return (tm.tm_hour >= CONFIG_WLM_OTA_APPLY_WINDOW_START_HOUR) ||
+    (tm.tm_hour < CONFIG_WLM_OTA_APPLY_WINDOW_END_HOUR);
+#else
+  return true;
+#endif
+}
+
+/* Fetch the digest of the image from a sidecar file next to it, i.e.
+   <url>.sha256, in the format written by `sha256sum`. This goes over the same
+   client, so the image download that follows resumes this TLS session. */
+static bool fetch_sidecar_sha256 (char const *url, uint8_t *digest) {
+  esp_http_client_handle_t client;
+  char *sidecar_url;
+  char buf[HASH_LEN * 2 + 1];
+  int len, status;
+  bool ok = false;
+
+  sidecar_url = malloc(strlen(url) + sizeof(".sha256"));
+  if (!sidecar_url) {
+    return false;
+  }
+  sprintf(sidecar_url, "%s.sha256", url);
+  client = get_ota_client(sidecar_url);
+  free(sidecar_url);
+  if (!client) {
+    return false;
+  }
+
+  if (esp_http_client_open(client, 0) == ESP_OK) {
+    esp_http_client_fetch_headers(client);
+    status = esp_http_client_get_status_code(client);
+    if (status == 200) {
+      len = esp_http_client_read(client, buf, sizeof(buf) - 1);
+      if (len == sizeof(buf) - 1) {
+	buf[len] = '\0';
+	ok = ota_parse_sha256(buf, digest);
+      }
+    } else {
+      ESP_LOGW(LOG_TAG, "No digest sidecar (HTTP status %d)", status);
+    }
+  }
+  http_cleanup(client);
+  return ok;
+}
+
+/* `expected_sha256` is the digest given with the command, or NULL. If NULL,
+   a sidecar file with the digest is looked for next to the image. */
+static bool do_ota(char const *url, uint8_t const *expected_sha256) {
+  esp_err_t err;
+  uint8_t sidecar_sha256[HASH_LEN];
+  struct ota_writer_t_ *writer;
+  int data_read;
+  esp_http_client_handle_t client;
+  uint32_t heap_before, lowest_free;
+  int64_t start;
+
+  if (!expected_sha256) {
+    if (fetch_sidecar_sha256(url, sidecar_sha256)) {
+      print_sha256(sidecar_sha256, "Expected SHA-256 (from sidecar)");
+      expected_sha256 = sidecar_sha256;
+    } else {
+      ESP_LOGW(LOG_TAG, "No expected digest for the image, it will not be verified");
+    }
+  }
+
+  client = get_ota_client(url);
   if (client == NULL) {
     ESP_LOGE(LOG_TAG, "Failed to initialize HTTP connection");
     return false;
   }
-  
+
+  ota_attempts++;
+  ota_last_heap_used_peak = 0;
+  heap_before = esp_get_free_heap_size();
+  lowest_free = heap_before;
+
+  /* esp_http_client_open() does the TCP connect and the TLS handshake */
+  start = esp_timer_get_time();
   err = esp_http_client_open(client, 0);
+  ota_last_handshake_ms = (uint32_t) ((esp_timer_get_time() - start) / 1000);
   if (err != ESP_OK) {
     ESP_LOGE(LOG_TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
-    esp_http_client_cleanup(client);
+    http_cleanup(client);
     return false;
   }
+  sample_heap(heap_before, &lowest_free);
+  ESP_LOGI(LOG_TAG, "Connected in %lu ms, free heap %lu (was %lu)",
+	   (unsigned long) ota_last_handshake_ms, (unsigned long) lowest_free,
+	   (unsigned long) heap_before);
   esp_http_client_fetch_headers(client);
 
-  update_partition = esp_ota_get_next_update_partition(NULL);
-  if (!update_partition) {
-    ESP_LOGE(LOG_TAG, "Update partition is NULL, not doing OTA");
+  writer = ota_writer_begin();
+  if (!writer) {
     http_cleanup(client);
     return false;
   }
-  ESP_LOGI(LOG_TAG, "Writing to partition subtype %d at offset 0x%"PRIx32,
-	   update_partition->subtype, update_partition->address);
-
-  binary_file_length = 0;
-  image_header_was_checked = false;
 
   while (1) {
     data_read = esp_http_client_read(client, ota_write_data, BUFFSIZE);
+    sample_heap(heap_before, &lowest_free);
     if (data_read < 0) {
       ESP_LOGE(LOG_TAG, "Error: SSL data read error");
       http_cleanup(client);
+      ota_writer_abort(writer);
       return false;
     } else if (data_read > 0) {
-      if (!image_header_was_checked) {
-	if (data_read > sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) +
-	    sizeof(esp_app_desc_t)) {
-	  
-	  memcpy(&new_app_info,
-		 &ota_write_data[sizeof(esp_image_header_t) +
-				 sizeof(esp_image_segment_header_t)],
-		 sizeof(esp_app_desc_t));
-	  ESP_LOGI(LOG_TAG, "Incoming version: %s", new_app_info.version);
-
-	  if (esp_ota_get_partition_description(running, &running_app_info) == ESP_OK) {
-	    ESP_LOGI(LOG_TAG, "Running version: %s", running_app_info.version);
-	  }
-
-	  last_invalid_app = esp_ota_get_last_invalid_partition();
-	  if (esp_ota_get_partition_description(last_invalid_app, &invalid_app_info) ==
-	      ESP_OK) {
-	    ESP_LOGI(LOG_TAG, "Last invalid firmware version: %s", invalid_app_info.version);
-	  }
-
-	  if (last_invalid_app != NULL) {
-	    if (memcmp(invalid_app_info.version, new_app_info.version,
-		       sizeof(new_app_info.version)) == 0) {
-	      ESP_LOGW(LOG_TAG, "New version is the same as invalid version.");
-	      ESP_LOGW(LOG_TAG, "Previously, there was an attempt to launch the firmware "
-		       "with %s version, but it failed.", invalid_app_info.version);
-	      ESP_LOGW(LOG_TAG, "The firmware has been rolled back to the previous version.");
-	      http_cleanup(client);
-	      return false;
-	    }
-	  }
-	  
-	  image_header_was_checked = true;
-
-	  err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
-	  if (err != ESP_OK) {
-	    ESP_LOGE(LOG_TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-	    http_cleanup(client);
-	    esp_ota_abort(update_handle);
-	    return false;
-	  }
-	  ESP_LOGI(LOG_TAG, "esp_ota_begin succeeded");
-	} else {
-	  ESP_LOGE(LOG_TAG, "data received from server is too small (%d bytes)", data_read);
-	  http_cleanup(client);
-	  esp_ota_abort(update_handle);
-	  return false;
-	}
-      }
-
-      err = esp_ota_write(update_handle, (const void *)ota_write_data, data_read);
-      if (err != ESP_OK) {
-	ESP_LOGE(LOG_TAG, "esp_ota_write() failed");
+      if (!ota_writer_write(writer, ota_write_data, data_read)) {
 	http_cleanup(client);
-	esp_ota_abort(update_handle);
+	ota_writer_abort(writer);
 	return false;
       }
-      binary_file_length += data_read;
-      /*
-      ESP_LOGI(LOG_TAG, "Written image length %d", binary_file_length);
-      */
     } else if (data_read == 0) {
       /*
        * As esp_http_client_read never returns negative error code, we rely on
@@ -173,87 +587,167 @@ static bool do_ota(char const *url) {
     }
   }
   
-  ESP_LOGI(LOG_TAG, "Total Write binary data length: %d", binary_file_length);
+  ESP_LOGI(LOG_TAG, "Total Write binary data length: %u",
+	   (unsigned) ota_writer_length(writer));
+  ESP_LOGI(LOG_TAG, "Handshake took %lu ms, peak heap used during OTA %lu bytes",
+	   (unsigned long) ota_last_handshake_ms, (unsigned long) ota_last_heap_used_peak);
   if (esp_http_client_is_complete_data_received(client) != true) {
     ESP_LOGE(LOG_TAG, "Error in receiving complete file");
     http_cleanup(client);
-    esp_ota_abort(update_handle);
+    ota_writer_abort(writer);
     return false;
   }
+  http_cleanup(client);
 
-  err = esp_ota_end(update_handle);
-  if (err != ESP_OK) {
-    if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-      ESP_LOGE(LOG_TAG, "Image validation failed, image is corrupted");
-    } else {
-      ESP_LOGE(LOG_TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
-    }
-    http_cleanup(client);
-    return false;
+  return ota_writer_finish(writer, expected_sha256);
+}
+
+/* The digests of the partition table, the bootloader and the running app are
+   logged at every boot. Hashing the whole app partition takes a while, so the
+   digests are cached in NVS, keyed by the address of the region, along with
+   the ELF SHA-256 of the running app. A new app invalidates all of them. */
+#define DIGEST_CACHE_NAMESPACE "mc_digests"
+
+struct digest_cache_entry_t_ {
+  uint8_t app_elf_sha256[HASH_LEN];
+  uint8_t digest[HASH_LEN];
+};
+
+static bool get_partition_sha256 (nvs_handle_t nvs, esp_partition_t const *partition,
+				  uint8_t *sha_256) {
+  struct digest_cache_entry_t_ entry;
+  uint8_t const *app_elf_sha256 = esp_app_get_description()->app_elf_sha256;
+  size_t len = sizeof(entry);
+  char key[NVS_KEY_NAME_MAX_SIZE];
+
+  snprintf(key, sizeof(key), "d%08"PRIx32, partition->address);
+  if (nvs && (nvs_get_blob(nvs, key, &entry, &len) == ESP_OK) &&
+      (len == sizeof(entry)) &&
+      (memcmp(entry.app_elf_sha256, app_elf_sha256, HASH_LEN) == 0)) {
+    memcpy(sha_256, entry.digest, HASH_LEN);
+    return true;
   }
 
-  err = esp_ota_set_boot_partition(update_partition);
-  if (err != ESP_OK) {
-    ESP_LOGE(LOG_TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
-    http_cleanup(client);
-    return false;
+  esp_partition_get_sha256(partition, sha_256);
+  if (nvs) {
+    memcpy(entry.app_elf_sha256, app_elf_sha256, HASH_LEN);
+    memcpy(entry.digest, sha_256, HASH_LEN);
+    if (nvs_set_blob(nvs, key, &entry, sizeof(entry)) != ESP_OK) {
+      ESP_LOGW(LOG_TAG, "Unable to cache digest for 0x%08"PRIx32, partition->address);
+    }
   }
-  ESP_LOGI(LOG_TAG, "OTA firmware upgrade completed, restarting");
-  stop_udp_logging();
-  esp_restart();
-  return true;
+  return false;
 }
 
-void ota_task (void *param) {
-  char *firmware_upgrade_command, *url;
-  QueueHandle_t ota_q = ((struct mc_task_args_t_ *) param)->ota_q;
+static void print_boot_digests (void) {
   esp_partition_t partition;
-  esp_partition_t const *running;
   uint8_t sha_256[HASH_LEN] = {0};
-  esp_ota_img_states_t ota_state;
+  nvs_handle_t nvs = 0;
+  bool cached;
+
+  if (nvs_open(DIGEST_CACHE_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "Unable to open digest cache");
+    nvs = 0;
+  }
 
   /* get sha256 digest for the partition table */
+  memset(&partition, 0, sizeof(partition));
   partition.address   = ESP_PARTITION_TABLE_OFFSET;
   partition.size      = ESP_PARTITION_TABLE_MAX_LEN;
   partition.type      = ESP_PARTITION_TYPE_DATA;
-  esp_partition_get_sha256(&partition, sha_256);
-  print_sha256(sha_256, "SHA-256 for the partition table: ");
+  cached = get_partition_sha256(nvs, &partition, sha_256);
+  print_sha256(sha_256, cached ? "SHA-256 for the partition table (cached): " :
+	       "SHA-256 for the partition table: ");
 
   /* get sha256 digest for bootloader */
   partition.address   = ESP_BOOTLOADER_OFFSET;
   partition.size      = ESP_PARTITION_TABLE_OFFSET;
   partition.type      = ESP_PARTITION_TYPE_APP;
-  esp_partition_get_sha256(&partition, sha_256);
-  print_sha256(sha_256, "SHA-256 for bootloader: ");
+  cached = get_partition_sha256(nvs, &partition, sha_256);
+  print_sha256(sha_256, cached ? "SHA-256 for bootloader (cached): " :
+	       "SHA-256 for bootloader: ");
 
   /* get sha256 digest for running partition */
-  esp_partition_get_sha256(esp_ota_get_running_partition(), sha_256);
-  print_sha256(sha_256, "SHA-256 for current firmware: ");
+  cached = get_partition_sha256(nvs, esp_ota_get_running_partition(), sha_256);
+  print_sha256(sha_256, cached ? "SHA-256 for current firmware (cached): " :
+	       "SHA-256 for current firmware: ");
 
-  running = esp_ota_get_running_partition();
-  if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
-    if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
-      esp_ota_mark_app_valid_cancel_rollback();
+  if (nvs) {
+    nvs_commit(nvs);
+    nvs_close(nvs);
+  }
+}
+
+/* Split "firmware-upgrade=<url>[&sha256=<hex>]" into the URL and the expected
+   digest. Modifies `command`. Returns the URL, or NULL if malformed. */
+static char *parse_upgrade_command (char *command, uint8_t *digest, bool *have_digest) {
+  char *url, *arg;
+
+  *have_digest = false;
+  if (strstr(command, "firmware-upgrade=") != command) {
+    return NULL;
+  }
+  url = command + strlen("firmware-upgrade=");
+
+  arg = strchr(url, '&');
+  if (arg) {
+    *arg++ = '\0';
+    if (strstr(arg, "sha256=") != arg) {
+      return NULL;
+    }
+    if (!ota_parse_sha256(arg + strlen("sha256="), digest)) {
+      return NULL;
     }
+    *have_digest = true;
   }
+  return url;
+}
 
-  /* Loop forever, looking for enqueues to the ota_q */
+void ota_task (void *param) {
+  char *firmware_upgrade_command, *url;
+  struct mc_task_args_t_ *mc_task_args = (struct mc_task_args_t_ *) param;
+  uint8_t expected_sha256[HASH_LEN];
+  bool have_digest;
+  TickType_t motor_idle_since;
+
+  /* Hashing the partitions is the slowest part of a boot */
+  power_lock(POWER_LOCK_OTA);
+  print_boot_digests();
+  power_unlock(POWER_LOCK_OTA);
+
+  /* A new image only gets this far if it passes its self-test */
+  selftest_boot(mc_task_args);
+
+  motor_idle_since = xTaskGetTickCount();
+
+  /* Loop forever, looking for enqueues to the ota_q, and applying the staged
+     image (if any) once it is safe to do so */
   while (1) {
-    if (pdTRUE == xQueueReceive(ota_q, (void *) &firmware_upgrade_command,
-				portMAX_DELAY)) {
+    if (xEventGroupGetBits(mc_task_args->mc_event_group) & EVENT_MOTOR_RUNNING) {
+      motor_idle_since = xTaskGetTickCount();
+    } else if ((ota_phase == OTA_PHASE_STAGED) &&
+	       ((xTaskGetTickCount() - motor_idle_since) >=
+		pdMS_TO_TICKS(CONFIG_WLM_OTA_APPLY_IDLE_S * 1000)) &&
+	       in_maintenance_window()) {
+      apply_staged_image();
+    }
+
+    if (pdTRUE == xQueueReceive(mc_task_args->ota_q, (void *) &firmware_upgrade_command,
+				pdMS_TO_TICKS(1000))) {
       ESP_LOGI(LOG_TAG, "upgrade request:  %s",firmware_upgrade_command);
-      /* firmware-upgrade=https://192.168.29.76:59443/mc.bin */
-      if (strstr(firmware_upgrade_command, "firmware-upgrade=") == firmware_upgrade_command) {
-	url = firmware_upgrade_command + strlen("firmware-upgrade=");
+      /* firmware-upgrade=https://192.168.29.76:59443/mc.bin[&sha256=<hex>] */
+      url = parse_upgrade_command(firmware_upgrade_command, expected_sha256, &have_digest);
+      if (url) {
 	ESP_LOGI(LOG_TAG, "Invoking do_ota(\"%s\")", url);
-	if (!do_ota(url)) {
+	power_lock(POWER_LOCK_OTA);
+	if (!do_ota(url, have_digest ? expected_sha256 : NULL)) {
 	  ESP_LOGE(LOG_TAG, "do_ota() failed");
-	  free(firmware_upgrade_command);
 	}
+	power_unlock(POWER_LOCK_OTA);
       } else {
-	ESP_LOGE(LOG_TAG, "\%s\" is not in the expected format", firmware_upgrade_command);
-	free(firmware_upgrade_command);
+	ESP_LOGE(LOG_TAG, "\"%s\" is not in the expected format", firmware_upgrade_command);
       }
+      free(firmware_upgrade_command);
     }
   }
 }
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "io.h"
+#include "mc.h"
+
+static char const *LOG_TAG = "mc|pattern";
+
+/* Plays on/off patterns on the beeper and the Err/Status LED.
+
+   A pattern is an array of {on_ms, off_ms} steps, played in a loop until it
+   is replaced or stopped. Each output has a one-shot esp_timer that fires at
+   the next edge only: the callback sets the level and arms the timer for the
+   length of the next on or off part. Nothing runs between the edges, and a
+   pattern that never changes level (e.g. solid on) stops arming the timer
+   altogether. Replacing or stopping a pattern takes effect at once, from
+   whichever task asks for it.
+
+   Patterns are not copied, so they have to outlive the playing (all of them
+   are static const arrays). */
+struct pattern_player_t_ {
+  enum io_output_t_ output;
+  esp_timer_handle_t timer;
+  portMUX_TYPE lock;
+  struct pattern_step_t_ const *steps; /* NULL when stopped */
+  size_t num_steps;
+  size_t part;			/* 2 * step, + 1 for the off part */
+};
+
+static struct pattern_player_t_ pattern_players[PATTERN_OUTPUTS] = {
+  [PATTERN_BEEP] = {
+    .output = IO_BEEP,
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+  },
+  [PATTERN_STATUS_LED] = {
+    .output = IO_ERR_STATUS,
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+  },
+};
+
+static void set_level (struct pattern_player_t_ *player, uint32_t level) {
+  io_set(player->output, level);
+}
+
+/* Move on to the next non-empty part of the pattern, set the output for it,
+   and arm the timer for its end. Called with the player's lock held. */
+static void next_edge (struct pattern_player_t_ *player) {
+  struct pattern_step_t_ const *step;
+  size_t parts = player->num_steps * 2, prev_part = player->part, i;
+  uint32_t ms;
+
+  for (i = 0; i < parts; i++) {
+    player->part = (player->part + 1) % parts;
+    step = &player->steps[player->part / 2];
+    ms = (player->part % 2) ? step->off_ms : step->on_ms;
+    if (ms == 0) {
+      continue;
+    }
+    set_level(player, (player->part % 2) ? 0 : 1);
+    if ((player->part == prev_part) && (i > 0)) {
+      /* The only non-empty part, so there are no more edges */
+      return;
+    }
+    esp_timer_start_once(player->timer, (uint64_t) ms * 1000);
+    return;
+  }
+  /* Nothing but empty parts */
+  set_level(player, 0);
+}
+
+static void pattern_timer_cb (void *arg) {
+  struct pattern_player_t_ *player = (struct pattern_player_t_ *) arg;
+
+  taskENTER_CRITICAL(&player->lock);
+  /* The timer is active again if the pattern was replaced between the timer
+     firing and this callback running; the new pattern has its own edges */
+  if (player->steps && !esp_timer_is_active(player->timer)) {
+    next_edge(player);
+  }
+  taskEXIT_CRITICAL(&player->lock);
+}
+
+void pattern_init (void) {
+  esp_timer_create_args_t timer_args = {
+    .callback = pattern_timer_cb,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "pattern",
+  };
+  enum pattern_output_t_ output;
+
+  for (output = 0; output < PATTERN_OUTPUTS; output++) {
+    timer_args.arg = &pattern_players[output];
+    if (esp_timer_create(&timer_args, &pattern_players[output].timer) != ESP_OK) {
+      ESP_LOGE(LOG_TAG, "Unable to create the timer for output %d, patterns on "
+	       "it will be a steady level", output);
+      pattern_players[output].timer = NULL;
+    }
+  }
+}
+
+/* Play `steps` in a loop on `output`, in place of whatever it was playing */
+void pattern_play (enum pattern_output_t_ output, struct pattern_step_t_ const *steps,
+		   size_t num_steps) {
+  struct pattern_player_t_ *player = &pattern_players[output];
+
+  taskENTER_CRITICAL(&player->lock);
+  if (!player->timer) {
+    /* No timer, so on for as long as the pattern plays */
+    set_level(player, (num_steps > 0) && (steps[0].on_ms > 0));
+  } else {
+    esp_timer_stop(player->timer);
+    player->steps = steps;
+    player->num_steps = num_steps;
+    if (num_steps > 0) {
+      player->part = num_steps * 2 - 1; /* so that next_edge starts at step 0 */
+      next_edge(player);
+    } else {
+      set_level(player, 0);
+    }
+  }
+  taskEXIT_CRITICAL(&player->lock);
+}
+
+/* Stop `output`, and turn it off */
+void pattern_stop (enum pattern_output_t_ output) {
+  struct pattern_player_t_ *player = &pattern_players[output];
+
+  taskENTER_CRITICAL(&player->lock);
+  if (player->timer) {
+    esp_timer_stop(player->timer);
+  }
+  player->steps = NULL;
+  set_level(player, 0);
+  taskEXIT_CRITICAL(&player->lock);
+}
+
+/* Status LED blink codes. When several states are active, the LED shows
+   the one that comes last in `enum status_code_t_`. */
+struct status_pattern_t_ {
+  char const *name;
+  struct pattern_step_t_ const *steps;
+  size_t num_steps;
+};
+
+#define STATUS_PATTERN(name, steps) { name, steps, sizeof(steps) / sizeof(steps[0]) }
+
+static struct pattern_step_t_ const two_blinks[] = { {200, 300}, {200, 1800} };
+static struct pattern_step_t_ const three_blinks[] = { {200, 300}, {200, 300}, {200, 1800} };
+static struct pattern_step_t_ const slow_blink[] = { {1000, 1000} };
+static struct pattern_step_t_ const solid[] = { {1000, 0} };
+
+static struct status_pattern_t_ const status_patterns[STATUS_CODES] = {
+  [STATUS_WIFI_DOWN] = STATUS_PATTERN("wifi down", two_blinks),
+  [STATUS_OTA] = STATUS_PATTERN("OTA in progress", slow_blink),
+  [STATUS_SENSOR_FAULT] = STATUS_PATTERN("sensor fault", three_blinks),
+  [STATUS_BOOTING] = STATUS_PATTERN("booting", solid),
+  [STATUS_FAULT] = STATUS_PATTERN("fault", solid),
+};
+
+static uint32_t status_active = 0; /* bit per status code */
+static int status_shown = -1;	 /* status code on the LED, -1 for none */
+static portMUX_TYPE status_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Bit per active status code */
+uint32_t status_get (void) {
+  uint32_t active;
+
+  taskENTER_CRITICAL(&status_lock);
+  active = status_active;
+  taskEXIT_CRITICAL(&status_lock);
+  return active;
+}
+
+void status_set (enum status_code_t_ code, bool active) {
+  int shown;
+  bool changed;
+
+  taskENTER_CRITICAL(&status_lock);
+  if (active) {
+    status_active |= (1 << code);
+  } else {
+    status_active &= ~(1 << code);
+  }
+  for (shown = STATUS_CODES - 1; shown >= 0; shown--) {
+    if (status_active & (1 << shown)) {
+      break;
+    }
+  }
+  changed = (shown != status_shown);
+  if (changed) {
+    status_shown = shown;
+    if (shown < 0) {
+      pattern_stop(PATTERN_STATUS_LED);
+    } else {
+      pattern_play(PATTERN_STATUS_LED, status_patterns[shown].steps,
+		   status_patterns[shown].num_steps);
+    }
+  }
+  taskEXIT_CRITICAL(&status_lock);
+
+  if (changed) {
+    ESP_LOGI(LOG_TAG, "%s %s, status LED shows %s", status_patterns[code].name,
+	     active ? "set" : "cleared", (shown < 0) ? "nothing" : status_patterns[shown].name);
+  }
+}
@@ -1,7 +0,0 @@
-#define BEEP_OUT                  27
-#define ERR_STATUS_OUT            33
-#define MOTOR_OUT                 32
-#define WATER_LEVEL_ENABLE_OUT    13
-
-#define MOTOR_RUNNING_SENSE_IN    4
-#define WATER_LEVEL_IN            39
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "mc.h"
+
+static char const *LOG_TAG = "mc|power";
+
+/* Power management. With CONFIG_PM_ENABLE, the CPU clock scales between
+   CONFIG_WLM_PM_MIN_FREQ_MHZ and CONFIG_WLM_PM_MAX_FREQ_MHZ, and (with
+   CONFIG_WLM_PM_LIGHT_SLEEP) the chip goes into light sleep whenever both
+   cores are idle until the next tick, timer or wifi beacon. Most of the time
+   all the tasks are in vTaskDelay() or waiting on a queue, so that is most
+   of the time.
+
+   Code that needs more than the lowest clock, or must not be held up by
+   the wakeup from light sleep, brackets itself with power_lock() and
+   power_unlock(). Each lock keeps count of how often and for how long it
+   was held, reported in /mc_stats: the time held is the time the unit
+   could not scale down (or sleep) on its account.
+
+   Without CONFIG_PM_ENABLE the locks do nothing but keep the counts. */
+struct power_lock_t_ {
+  char const *name;
+  esp_pm_lock_type_t type;
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_lock_handle_t handle;
+#endif
+  uint32_t depth;		/* nested power_lock() calls */
+  uint32_t acquired;		/* times taken from depth 0 */
+  int64_t held_since_us;
+  int64_t held_us;		/* not counting the current hold */
+};
+
+static struct power_lock_t_ power_locks[POWER_LOCKS] = {
+  /* TLS handshake, and hashing and writing the image */
+  [POWER_LOCK_OTA] = { .name = "ota", .type = ESP_PM_CPU_FREQ_MAX },
+  /* Requests run on the async workers (/mc_ctrl, /mc_ota ...), and /mc_rtt */
+  [POWER_LOCK_HTTP] = { .name = "http", .type = ESP_PM_CPU_FREQ_MAX },
+  /* Cycle counts only convert to time at a fixed clock */
+  [POWER_LOCK_BENCH] = { .name = "bench", .type = ESP_PM_CPU_FREQ_MAX },
+  /* The tank sensor is read every second while the motor runs, and a
+     motor-off must not wait for a wakeup */
+  [POWER_LOCK_MOTOR] = { .name = "motor", .type = ESP_PM_NO_LIGHT_SLEEP },
+  /* Keeps the beep edges sharp */
+  [POWER_LOCK_BEEP] = { .name = "beep", .type = ESP_PM_NO_LIGHT_SLEEP },
+};
+
+static portMUX_TYPE power_lock_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void power_init (void) {
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_config_t pm_config = {
+    .max_freq_mhz = CONFIG_WLM_PM_MAX_FREQ_MHZ,
+    .min_freq_mhz = CONFIG_WLM_PM_MIN_FREQ_MHZ,
+#ifdef CONFIG_WLM_PM_LIGHT_SLEEP
+    .light_sleep_enable = true,
+#else
+    .light_sleep_enable = false,
+#endif
+  };
+  enum power_lock_id_t_ id;
+  esp_err_t err;
+
+  for (id = 0; id < POWER_LOCKS; id++) {
+    err = esp_pm_lock_create(power_locks[id].type, 0, power_locks[id].name,
+			     &power_locks[id].handle);
+    if (err != ESP_OK) {
+      ESP_LOGE(LOG_TAG, "Unable to create the %s lock (%s)", power_locks[id].name,
+	       esp_err_to_name(err));
+      power_locks[id].handle = NULL;
+    }
+  }
+
+  err = esp_pm_configure(&pm_config);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to configure power management (%s), staying at %d MHz",
+	     esp_err_to_name(err), CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+    return;
+  }
+  ESP_LOGI(LOG_TAG, "CPU clock %d-%d MHz, light sleep %s", CONFIG_WLM_PM_MIN_FREQ_MHZ,
+	   CONFIG_WLM_PM_MAX_FREQ_MHZ, pm_config.light_sleep_enable ? "on" : "off");
+#else
+  ESP_LOGI(LOG_TAG, "Power management is off, CPU clock fixed at %d MHz",
+	   CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+#endif
+}
+
+void power_lock (enum power_lock_id_t_ id) {
+  struct power_lock_t_ *lock = &power_locks[id];
+
+  /* The esp_pm lock first, so that the time counted as held is never
+     shorter than the time it was */
+#ifdef CONFIG_PM_ENABLE
+  if (lock->handle) {
+    esp_pm_lock_acquire(lock->handle);
+  }
+#endif
+  taskENTER_CRITICAL(&power_lock_lock);
+  if (lock->depth++ == 0) {
+    lock->acquired++;
+    lock->held_since_us = esp_timer_get_time();
+  }
+  taskEXIT_CRITICAL(&power_lock_lock);
+}
+
+void power_unlock (enum power_lock_id_t_ id) {
+  struct power_lock_t_ *lock = &power_locks[id];
+  bool underflow = false;
+
+  taskENTER_CRITICAL(&power_lock_lock);
+  if (lock->depth == 0) {
+    underflow = true;
+  } else if (--lock->depth == 0) {
+    lock->held_us += esp_timer_get_time() - lock->held_since_us;
+  }
+  taskEXIT_CRITICAL(&power_lock_lock);
+
+  if (underflow) {
+    ESP_LOGE(LOG_TAG, "The %s lock was released more often than taken", lock->name);
+    return;
+  }
+#ifdef CONFIG_PM_ENABLE
+  if (lock->handle) {
+    esp_pm_lock_release(lock->handle);
+  }
+#endif
+}
+
+/* `pm_<lock>_acquired` and `pm_<lock>_held_ms` lines for /mc_stats, the time
+   held including the current hold, if any */
+int power_format_stats (char *buf, size_t len) {
+  struct power_lock_t_ locks[POWER_LOCKS];
+  int64_t now_us;
+  int i, n, written = 0;
+
+  taskENTER_CRITICAL(&power_lock_lock);
+  now_us = esp_timer_get_time();
+  for (i = 0; i < POWER_LOCKS; i++) {
+    locks[i] = power_locks[i];
+  }
+  taskEXIT_CRITICAL(&power_lock_lock);
+
+  n = snprintf(buf, len, "pm_enabled=%d\n",
+#ifdef CONFIG_PM_ENABLE
+	       1
+#else
+	       0
+#endif
+	       );
+  if (n < 0) {
+    return n;
+  }
+  written += n;
+  for (i = 0; i < POWER_LOCKS; i++) {
+    if (locks[i].depth > 0) {
+      locks[i].held_us += now_us - locks[i].held_since_us;
+    }
+    n = snprintf(buf + written, (written < (int) len) ? len - written : 0,
+		 "pm_%s_acquired=%lu\n"
+		 "pm_%s_held_ms=%llu\n",
+		 locks[i].name, (unsigned long) locks[i].acquired,
+		 locks[i].name, (unsigned long long) (locks[i].held_us / 1000));
+    if (n < 0) {
+      return n;
+    }
+    written += n;
+  }
+  return written;
+}
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "mc.h"
+#include "replica_fsm.h"
+
+static char const *LOG_TAG = "mc|replica";
+
+/* Hot standby: two units wired to the same motor relay and probes, one of
+   them active, the other following its state over UDP and taking over when
+   it goes silent. The protocol, and what keeps the two from ever driving the
+   relay at once, is in replica_fsm.c; this is the socket, the task, and the
+   hooks the control tasks call:
+
+   - motor.c only toggles the relay while replica_may_drive(), and its
+     fail-safe only while replica_holds_lease().
+   - oh_tank_level.c only reads the probe on the active unit, and publishes
+     its state (motor run, filter, fill model) with replica_publish() every
+     loop. The standby one follows it with replica_get_state(), and a unit
+     that takes over in the middle of a run picks it up with
+     replica_resume_run() instead of starting the run over.
+
+   Without CONFIG_WLM_REPLICA the unit is always the active one. */
+
+#ifdef CONFIG_WLM_REPLICA
+
+#define REPLICA_NAMESPACE "mc_replica"
+#define REPLICA_TERM_KEY "term"
+
+/* The task runs the protocol this often, between messages received */
+#define REPLICA_TICK_MS (CONFIG_WLM_REPLICA_HEARTBEAT_MS / 4)
+
+static struct replica_fsm_t_ fsm;
+static volatile bool send_requested = false;
+static portMUX_TYPE fsm_lock = portMUX_INITIALIZER_UNLOCKED;
+static int fd_socket = -1;
+static struct sockaddr_in peer_addr;
+
+static uint32_t now_ms (void) {
+  return esp_timer_get_time() / 1000;
+}
+
+bool replica_is_active (void) {
+  bool ret;
+
+  taskENTER_CRITICAL(&fsm_lock);
+  ret = (fsm.role == REPLICA_ACTIVE);
+  taskEXIT_CRITICAL(&fsm_lock);
+  return ret;
+}
+
+/* May turn the motor on or off: active, and not fenced */
+bool replica_may_drive (void) {
+  bool ret;
+
+  taskENTER_CRITICAL(&fsm_lock);
+  ret = replica_fsm_may_drive(&fsm, now_ms()) && !fsm.fenced;
+  taskEXIT_CRITICAL(&fsm_lock);
+  return ret;
+}
+
+/* May still turn the motor off: the lease has not lapsed, even if fenced */
+bool replica_holds_lease (void) {
+  bool ret;
+
+  taskENTER_CRITICAL(&fsm_lock);
+  ret = replica_fsm_may_drive(&fsm, now_ms());
+  taskEXIT_CRITICAL(&fsm_lock);
+  return ret;
+}
+
+/* The active unit's state, to be sent to the standby one (now, if it
+   changed) */
+void replica_publish (struct replica_state_t_ const *state) {
+  unsigned int events;
+
+  taskENTER_CRITICAL(&fsm_lock);
+  events = replica_fsm_publish(&fsm, state);
+  taskEXIT_CRITICAL(&fsm_lock);
+  if (events & REPLICA_EVENT_SEND) {
+    send_requested = true;
+  }
+}
+
+/* The state last received from the active unit, if newer than `*version`.
+   Returns false if there is none. */
+bool replica_get_state (struct replica_state_t_ *state, uint32_t *version) {
+  bool ret;
+
+  taskENTER_CRITICAL(&fsm_lock);
+  ret = (fsm.version != 0) && (fsm.version != *version);
+  if (ret) {
+    *state = fsm.state;
+    *version = fsm.version;
+  }
+  taskEXIT_CRITICAL(&fsm_lock);
+  return ret;
+}
+
+/* Just took over: the run the previous active unit had going, if any. Only
+   returns it once, and not after anything was published. */
+bool replica_resume_run (struct replica_state_t_ *state) {
+  bool ret;
+
+  taskENTER_CRITICAL(&fsm_lock);
+  ret = (fsm.role == REPLICA_ACTIVE) && fsm.resume_run && fsm.state.motor_running;
+  if (ret) {
+    *state = fsm.state;
+  }
+  fsm.resume_run = false;
+  taskEXIT_CRITICAL(&fsm_lock);
+  return ret;
+}
+
+/* `replica=takeover`: take over now, without waiting for the peer to go
+   silent. For when the peer is known to be down (e.g. powered off for
+   repair); if it is not, the two settle on the newer term, and the other
+   one steps down. */
+bool replica_command (char const *arg) {
+  unsigned int events;
+
+  if (strcmp(arg, "takeover") != 0) {
+    ESP_LOGE(LOG_TAG, "Unknown replica command \"%s\"", arg);
+    return false;
+  }
+  taskENTER_CRITICAL(&fsm_lock);
+  events = replica_fsm_take_over(&fsm, now_ms());
+  taskEXIT_CRITICAL(&fsm_lock);
+  if (events & REPLICA_EVENT_SEND) {
+    send_requested = true;
+  }
+  ESP_LOGW(LOG_TAG, "Takeover requested%s", events ? "" : ", already the active unit");
+  return true;
+}
+
+/* `replica_*` lines for /mc_stats */
+int replica_format_stats (char *buf, size_t len) {
+  struct replica_fsm_t_ copy;
+  bool leased;
+
+  taskENTER_CRITICAL(&fsm_lock);
+  copy = fsm;
+  leased = replica_fsm_may_drive(&fsm, now_ms()) && !fsm.fenced;
+  taskEXIT_CRITICAL(&fsm_lock);
+
+  return snprintf(buf, len,
+		  "replica_role=%s\n"
+		  "replica_term=%lu\n"
+		  "replica_leased=%d\n"
+		  "replica_peer_heard=%d\n"
+		  "replica_takeovers=%lu\n"
+		  "replica_fences=%lu\n"
+		  "replica_rx=%lu\n"
+		  "replica_rx_bad=%lu\n"
+		  "replica_tx=%lu\n",
+		  replica_role_name(copy.role),
+		  (unsigned long) copy.term,
+		  leased,
+		  copy.peer_heard,
+		  (unsigned long) copy.takeovers,
+		  (unsigned long) copy.fences,
+		  (unsigned long) copy.rx,
+		  (unsigned long) copy.rx_bad,
+		  (unsigned long) copy.tx);
+}
+
+/* The term is kept across restarts, so that a unit that restarts does not
+   come back in a term its peer has long left behind */
+static uint32_t load_term (void) {
+  nvs_handle_t nvs;
+  uint32_t term = 0;
+
+  if (nvs_open(REPLICA_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    if (nvs_get_u32(nvs, REPLICA_TERM_KEY, &term) != ESP_OK) {
+      term = 0;
+    }
+    nvs_close(nvs);
+  }
+  return term;
+}
+
+static void save_term (uint32_t term) {
+  nvs_handle_t nvs;
+  esp_err_t err;
+
+  err = nvs_open(REPLICA_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err == ESP_OK) {
+    err = nvs_set_u32(nvs, REPLICA_TERM_KEY, term);
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to save the term (%s)", esp_err_to_name(err));
+  }
+}
+
+static bool open_socket (void) {
+  struct sockaddr_in addr;
+  struct timeval timeout = {
+    .tv_sec = 0,
+    .tv_usec = REPLICA_TICK_MS * 1000,
+  };
+
+  fd_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd_socket < 0) {
+    ESP_LOGE(LOG_TAG, "Failed to create socket: %s", strerror(errno));
+    fd_socket = -1;
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(CONFIG_WLM_REPLICA_PORT);
+  if ((bind(fd_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+      (setsockopt(fd_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)) {
+    ESP_LOGE(LOG_TAG, "Failed to set up the socket: %s", strerror(errno));
+    close(fd_socket);
+    fd_socket = -1;
+    return false;
+  }
+
+  memset(&peer_addr, 0, sizeof(peer_addr));
+  peer_addr.sin_family = AF_INET;
+  inet_pton(AF_INET, CONFIG_WLM_REPLICA_PEER_ADDR, &(peer_addr.sin_addr));
+  peer_addr.sin_port = htons(CONFIG_WLM_REPLICA_PEER_PORT);
+  ESP_LOGI(LOG_TAG, "Node %d, peer at %s:%d", CONFIG_WLM_REPLICA_NODE_ID,
+	   CONFIG_WLM_REPLICA_PEER_ADDR, CONFIG_WLM_REPLICA_PEER_PORT);
+  return true;
+}
+
+void replica_task (void *param) {
+  struct replica_config_t_ config = {
+    .node_id = CONFIG_WLM_REPLICA_NODE_ID,
+    .heartbeat_ms = CONFIG_WLM_REPLICA_HEARTBEAT_MS,
+    .lease_ms = CONFIG_WLM_REPLICA_LEASE_MS,
+    .takeover_ms = CONFIG_WLM_REPLICA_TAKEOVER_MS,
+  };
+  uint8_t msg[REPLICA_MSG_MAX_SIZE + 1];
+  unsigned int events;
+  uint32_t term, saved_term;
+  bool ok, may_take_over, failing = false;
+  size_t len = 0;
+  int n;
+
+  saved_term = load_term();
+  taskENTER_CRITICAL(&fsm_lock);
+  ok = replica_fsm_init(&fsm, &config, saved_term, now_ms());
+  taskEXIT_CRITICAL(&fsm_lock);
+  if (!ok) {
+    /* Stays standby, never drives the motor */
+    ESP_LOGE(LOG_TAG, "Bad configuration: the lease has to be at least 2 heartbeats, "
+	     "and the takeover at least the lease plus 2 heartbeats");
+    vTaskDelete(NULL);
+    return;
+  }
+  ESP_LOGI(LOG_TAG, "Starting as the standby unit, term %lu", (unsigned long) saved_term);
+
+  while (pdTRUE) {
+    n = -1;
+    if (fd_socket != -1) {
+      n = recv(fd_socket, msg, sizeof(msg), 0);
+    } else if (!open_socket()) {
+      vTaskDelay(pdMS_TO_TICKS(REPLICA_TICK_MS));
+    }
+
+    /* A unit with a stopped control task (see supervisor.c) is not one to
+       hand the motor to */
+    may_take_over = !(status_get() & (1 << STATUS_FAULT));
+
+    events = send_requested ? REPLICA_EVENT_SEND : 0;
+    send_requested = false;
+    taskENTER_CRITICAL(&fsm_lock);
+    if (n > 0) {
+      events |= replica_fsm_receive(&fsm, msg, n, now_ms());
+    }
+    events |= replica_fsm_tick(&fsm, now_ms(), may_take_over);
+    if (events & REPLICA_EVENT_SEND) {
+      len = replica_fsm_encode(&fsm, msg, now_ms());
+    }
+    term = fsm.term;
+    taskEXIT_CRITICAL(&fsm_lock);
+
+    if (events & REPLICA_EVENT_FENCE) {
+      /* Still holding the lease, for a heartbeat at most */
+      ESP_LOGE(LOG_TAG, "Lost touch with the standby unit, turning the motor off while "
+	       "the lease holds");
+      motor_failsafe_off();
+    }
+    if (events & REPLICA_EVENT_TAKEOVER) {
+      ESP_LOGW(LOG_TAG, "Took over as the active unit, term %lu", (unsigned long) term);
+    }
+    if (events & REPLICA_EVENT_STEP_DOWN) {
+      ESP_LOGW(LOG_TAG, "Stepped down to standby, term %lu", (unsigned long) term);
+    }
+    if (events & REPLICA_EVENT_LEASED) {
+      ESP_LOGI(LOG_TAG, "Leased, driving the motor");
+    }
+    if (term != saved_term) {
+      save_term(term);
+      saved_term = term;
+    }
+
+    if ((events & REPLICA_EVENT_SEND) && (fd_socket != -1)) {
+      if (0 > sendto(fd_socket, msg, len, 0, (struct sockaddr *) &peer_addr,
+		     sizeof(peer_addr))) {
+	/* Once per streak of failures, e.g. while the wifi is down */
+	if (!failing) {
+	  ESP_LOGE(LOG_TAG, "sendto() failed: %s", strerror(errno));
+	  failing = true;
+	}
+      } else {
+	failing = false;
+      }
+    }
+  }
+}
+
+#else
+
+bool replica_is_active (void) {
+  return true;
+}
+
+bool replica_may_drive (void) {
+  return true;
+}
+
+bool replica_holds_lease (void) {
+  return true;
+}
+
+void replica_publish (struct replica_state_t_ const *state) {
+}
+
+bool replica_get_state (struct replica_state_t_ *state, uint32_t *version) {
+  return false;
+}
+
+bool replica_resume_run (struct replica_state_t_ *state) {
+  return false;
+}
+
+bool replica_command (char const *arg) {
+  ESP_LOGE(LOG_TAG, "Replication is not enabled (CONFIG_WLM_REPLICA)");
+  return false;
+}
+
+int replica_format_stats (char *buf, size_t len) {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,467 @@
+#include <string.h>
+#include "replica_fsm.h"
+
+/* Active/standby protocol between two units wired to the same motor relay.
+   Only the active unit drives MOTOR_OUT, and only while it holds a lease;
+   the standby follows its state, and takes over when it stops hearing it.
+
+   Both units send a message every config.heartbeat_ms: the active one with
+   its state (as a delta against what the standby last confirmed having),
+   the standby one with the version of the state it has. Each carries a
+   term, bumped by every takeover; a unit that hears a higher term than its
+   own follows it, stepping down if it was active.
+
+   The lease is what keeps the two from ever driving the relay at once:
+
+   - A standby that receives a heartbeat acks it, echoing the sender's
+     timestamp, and promises not to take over until takeover_ms after it
+     received it.
+   - The active unit may drive until lease_ms after it sent the last
+     heartbeat acked (on its own clock, so no clock is compared with the
+     other). lease_ms < takeover_ms, and the heartbeat was sent before the
+     standby received it, so the lease always lapses before the standby may
+     take over. A heartbeat before the lapse, the active unit reports the
+     lease as fenced (REPLICA_EVENT_FENCE), for the caller to turn the
+     motor off while it still may.
+   - Standby messages also carry the time left on the promise, so that an
+     active unit whose heartbeats do not get acked (it only just took over,
+     or the standby stopped hearing it) still has a lease for as long as the
+     standby is bound to stay standby anyway, less a heartbeat period for
+     the message in flight.
+   - A unit that takes over while it hears nothing from its peer, or only
+     a fenced active peer of an older term, leases itself (solo) until it
+     hears from the peer otherwise: the peer is dead, or cannot drive.
+
+   A standby stops acking an active unit that has been fenced for
+   takeover_ms (it cannot hear the acks), so that the standby takes over
+   instead of the two waiting on each other forever. Two standby units that
+   hear each other leave the takeover to the lower node_id.
+
+   What this cannot tell apart is a dead peer from one it cannot reach. An
+   active unit that loses its peer is fenced, and stays fenced, since the
+   peer may have taken over; and two units that come up unable to reach
+   each other both take over. */
+
+#define REPLICA_MAGIC "MR"
+#define REPLICA_VERSION 1
+
+/* Message layout, all little endian */
+#define MSG_MAGIC 0		/* 2 bytes */
+#define MSG_VERSION 2
+#define MSG_NODE_ID 3
+#define MSG_ROLE 4
+#define MSG_FLAGS 5
+#define MSG_MASK 6		/* REPLICA_GROUP_* present after the header */
+#define MSG_TERM 8
+#define MSG_SEQ 12
+#define MSG_SENT_MS 16		/* sender's uptime */
+#define MSG_ECHO_MS 20		/* standby: MSG_SENT_MS of the heartbeat acked */
+#define MSG_PROMISE_MS 24	/* standby: time left before it may take over */
+#define MSG_STATE_VERSION 28	/* active: of the state after the delta; standby: held */
+#define MSG_BASE_VERSION 32	/* active: the delta applies to, 0 for the full state */
+#define MSG_HEADER_SIZE 36
+
+/* Bits of MSG_FLAGS */
+#define MSG_LEASED 0x01		/* active, and not fenced */
+#define MSG_ACK 0x02		/* MSG_ECHO_MS is valid */
+
+/* Groups of state, in the order they follow the header */
+#define REPLICA_GROUP_MOTOR 0x01	/* u8 bits, u32 run age in ms */
+#define REPLICA_GROUP_FILTER 0x02	/* u32 readings, u8 index, u8 successive */
+#define REPLICA_GROUP_FILL 0x04		/* u32 runs, f32 mean_s, f32 m2 */
+#define REPLICA_GROUPS 0x07
+
+#define MOTOR_RUNNING 0x01
+#define MOTOR_TANK_FULL 0x02
+
+_Static_assert(MSG_HEADER_SIZE + 5 + 6 + 12 <= REPLICA_MSG_MAX_SIZE, "message too large");
+
+static bool before (uint32_t a, uint32_t b) {
+  return (int32_t) (a - b) < 0;
+}
+
+static void put32 (uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get32 (uint8_t const *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void putf (uint8_t *p, float f) {
+  uint32_t v;
+
+  memcpy(&v, &f, sizeof(v));
+  put32(p, v);
+}
+
+static float getf (uint8_t const *p) {
+  uint32_t v = get32(p);
+  float f;
+
+  memcpy(&f, &v, sizeof(f));
+  return f;
+}
+
+bool replica_fsm_init (struct replica_fsm_t_ *fsm, struct replica_config_t_ const *config,
+		       uint32_t term, uint32_t now_ms) {
+  if ((config->node_id == 0) || (config->heartbeat_ms == 0) ||
+      (config->lease_ms < 2 * config->heartbeat_ms) ||
+      (config->takeover_ms < config->lease_ms + 2 * config->heartbeat_ms)) {
+    return false;
+  }
+  memset(fsm, 0, sizeof(*fsm));
+  fsm->config = *config;
+  fsm->role = REPLICA_STANDBY;
+  fsm->term = term;
+  fsm->fenced = true;
+  /* As if an ack had just been sent: a unit that acked just before it
+     restarted is still bound by it */
+  fsm->promised_at_ms = now_ms;
+  fsm->last_sent_ms = now_ms - config->heartbeat_ms;
+  return true;
+}
+
+static bool same_state (struct replica_state_t_ const *a, struct replica_state_t_ const *b,
+			unsigned int group) {
+  switch (group) {
+  case REPLICA_GROUP_MOTOR:
+    return (a->motor_running == b->motor_running) && (a->tank_full == b->tank_full) &&
+      (!a->motor_running || (a->run_start_ms == b->run_start_ms));
+  case REPLICA_GROUP_FILTER:
+    return (a->filter_readings == b->filter_readings) &&
+      (a->filter_index == b->filter_index) && (a->filter_successive == b->filter_successive);
+  case REPLICA_GROUP_FILL:
+    return (a->fill.runs == b->fill.runs) && (a->fill.mean_s == b->fill.mean_s) &&
+      (a->fill.m2 == b->fill.m2);
+  }
+  return true;
+}
+
+static bool may_lease_solo (struct replica_fsm_t_ const *fsm) {
+  /* A fenced active peer of an older term cannot get a lease back: the one
+     unit that could grant it is us */
+  return !fsm->peer_heard || ((fsm->peer_role == REPLICA_ACTIVE) && !fsm->peer_leased &&
+			      before(fsm->peer_term, fsm->term));
+}
+
+static unsigned int become_active (struct replica_fsm_t_ *fsm, uint32_t now_ms) {
+  fsm->role = REPLICA_ACTIVE;
+  fsm->term = (before(fsm->term, fsm->peer_term) ? fsm->peer_term : fsm->term) + 1;
+  fsm->solo = may_lease_solo(fsm);
+  fsm->fenced = !fsm->solo;
+  fsm->lease_until_ms = now_ms;
+  fsm->base_version = 0;
+  fsm->takeovers++;
+  return REPLICA_EVENT_TAKEOVER | REPLICA_EVENT_SEND | (fsm->solo ? REPLICA_EVENT_LEASED : 0);
+}
+
+static unsigned int become_standby (struct replica_fsm_t_ *fsm, uint32_t now_ms) {
+  fsm->role = REPLICA_STANDBY;
+  fsm->fenced = true;
+  fsm->solo = false;
+  fsm->promised_at_ms = now_ms;
+  fsm->echo_valid = false;
+  fsm->resume_run = false;
+  /* Our versions mean nothing to the active unit; take its state whole */
+  fsm->version = 0;
+  return REPLICA_EVENT_STEP_DOWN;
+}
+
+/* Called at least every heartbeat_ms / 2. `may_take_over` is false while
+   the unit could not do the job (e.g. its wifi is down). */
+unsigned int replica_fsm_tick (struct replica_fsm_t_ *fsm, uint32_t now_ms,
+			       bool may_take_over) {
+  unsigned int events = 0;
+  bool defer;
+
+  if (fsm->peer_heard && !before(now_ms, fsm->peer_heard_ms + fsm->config.takeover_ms)) {
+    fsm->peer_heard = false;
+    fsm->peer_fenced = false;
+  }
+
+  if (fsm->role == REPLICA_STANDBY) {
+    defer = fsm->peer_heard && (fsm->peer_role == REPLICA_STANDBY) &&
+      (fsm->peer_id < fsm->config.node_id);
+    if (may_take_over && !defer &&
+	!before(now_ms, fsm->promised_at_ms + fsm->config.takeover_ms)) {
+      events |= become_active(fsm, now_ms);
+    }
+  } else if (!fsm->solo) {
+    if (!fsm->fenced && !before(now_ms + fsm->config.heartbeat_ms, fsm->lease_until_ms)) {
+      fsm->fenced = true;
+      fsm->fences++;
+      events |= REPLICA_EVENT_FENCE | REPLICA_EVENT_SEND;
+    }
+  }
+
+  if (!before(now_ms, fsm->last_sent_ms + fsm->config.heartbeat_ms)) {
+    events |= REPLICA_EVENT_SEND;
+  }
+  return events;
+}
+
+static void extend_lease (struct replica_fsm_t_ *fsm, uint32_t until_ms) {
+  if (before(fsm->lease_until_ms, until_ms)) {
+    fsm->lease_until_ms = until_ms;
+  }
+}
+
+/* Apply the state groups of an active unit's message, returns false if it
+   does not add up */
+static bool decode_state (struct replica_fsm_t_ *fsm, uint8_t const *p, size_t len,
+			  unsigned int mask, uint32_t now_ms) {
+  struct replica_state_t_ state = fsm->state;
+  size_t need = 0;
+
+  need += (mask & REPLICA_GROUP_MOTOR) ? 5 : 0;
+  need += (mask & REPLICA_GROUP_FILTER) ? 6 : 0;
+  need += (mask & REPLICA_GROUP_FILL) ? 12 : 0;
+  if (len != need) {
+    return false;
+  }
+  if (mask & REPLICA_GROUP_MOTOR) {
+    state.motor_running = (p[0] & MOTOR_RUNNING) != 0;
+    state.tank_full = (p[0] & MOTOR_TANK_FULL) != 0;
+    /* The run age is as of the sending; the message took a moment */
+    state.run_start_ms = now_ms - get32(p + 1);
+    p += 5;
+  }
+  if (mask & REPLICA_GROUP_FILTER) {
+    state.filter_readings = get32(p);
+    state.filter_index = p[4];
+    state.filter_successive = p[5];
+    p += 6;
+  }
+  if (mask & REPLICA_GROUP_FILL) {
+    state.fill.version = FILL_MODEL_VERSION;
+    state.fill.runs = get32(p);
+    state.fill.mean_s = getf(p + 4);
+    state.fill.m2 = getf(p + 8);
+    p += 12;
+  }
+  fsm->state = state;
+  return true;
+}
+
+unsigned int replica_fsm_receive (struct replica_fsm_t_ *fsm, void const *msg, size_t len,
+				  uint32_t now_ms) {
+  uint8_t const *p = msg;
+  unsigned int events = 0, mask;
+  enum replica_role_t_ role;
+  uint32_t term, version, base_version;
+  bool leased;
+
+  if ((len < MSG_HEADER_SIZE) || (memcmp(p + MSG_MAGIC, REPLICA_MAGIC, 2) != 0) ||
+      (p[MSG_VERSION] != REPLICA_VERSION) || (p[MSG_NODE_ID] == 0) ||
+      (p[MSG_NODE_ID] == fsm->config.node_id) || (p[MSG_ROLE] >= REPLICA_ROLES) ||
+      (p[MSG_MASK] & ~REPLICA_GROUPS)) {
+    fsm->rx_bad++;
+    return 0;
+  }
+  fsm->rx++;
+  role = p[MSG_ROLE];
+  leased = (p[MSG_FLAGS] & MSG_LEASED) != 0;
+  mask = p[MSG_MASK];
+  term = get32(p + MSG_TERM);
+  version = get32(p + MSG_STATE_VERSION);
+  base_version = get32(p + MSG_BASE_VERSION);
+
+  /* A higher term wins; so does the lower node_id if both took over at
+     once, in the same term */
+  if (fsm->role == REPLICA_ACTIVE) {
+    if ((role == REPLICA_ACTIVE) ? (before(fsm->term, term) ||
+				    ((term == fsm->term) &&
+				     (p[MSG_NODE_ID] < fsm->config.node_id))) :
+	before(fsm->term, term)) {
+      events |= become_standby(fsm, now_ms);
+    }
+  }
+  if (before(fsm->term, term)) {
+    fsm->term = term;
+    /* Versions are counted, and acks given, per term */
+    fsm->version = 0;
+    fsm->echo_valid = false;
+  }
+
+  if ((role == REPLICA_ACTIVE) && !leased && (term == fsm->term)) {
+    if (!fsm->peer_fenced) {
+      fsm->peer_fenced = true;
+      fsm->peer_fenced_ms = now_ms;
+    }
+  } else {
+    fsm->peer_fenced = false;
+  }
+  fsm->peer_heard = true;
+  fsm->peer_heard_ms = now_ms;
+  fsm->peer_id = p[MSG_NODE_ID];
+  fsm->peer_role = role;
+  fsm->peer_leased = leased;
+  fsm->peer_term = term;
+
+  if (fsm->role == REPLICA_STANDBY) {
+    if ((role != REPLICA_ACTIVE) || (term != fsm->term)) {
+      return events;
+    }
+    /* Ack, unless the active unit has been fenced too long to be hearing
+       the acks */
+    if (leased || before(now_ms, fsm->peer_fenced_ms + fsm->config.takeover_ms)) {
+      fsm->promised_at_ms = now_ms;
+      fsm->echo_ms = get32(p + MSG_SENT_MS);
+      fsm->echo_valid = true;
+      events |= REPLICA_EVENT_SEND;
+    }
+    if (version && (version != fsm->version) &&
+	((base_version == 0) || (base_version == fsm->version))) {
+      if (decode_state(fsm, p + MSG_HEADER_SIZE, len - MSG_HEADER_SIZE,
+		       (base_version == 0) ? REPLICA_GROUPS : mask, now_ms)) {
+	fsm->version = version;
+	fsm->resume_run = true;
+	events |= REPLICA_EVENT_STATE;
+      } else {
+	fsm->rx_bad++;
+      }
+    }
+    return events;
+  }
+
+  /* Active */
+  if (role == REPLICA_STANDBY) {
+    if ((p[MSG_FLAGS] & MSG_ACK) && (term == fsm->term) &&
+	before(now_ms - get32(p + MSG_ECHO_MS), fsm->config.lease_ms)) {
+      extend_lease(fsm, get32(p + MSG_ECHO_MS) + fsm->config.lease_ms);
+    }
+    if (get32(p + MSG_PROMISE_MS) > fsm->config.heartbeat_ms) {
+      extend_lease(fsm, now_ms + get32(p + MSG_PROMISE_MS) - fsm->config.heartbeat_ms);
+    }
+    if (term == fsm->term) {
+      if (version && (version == fsm->pending_version)) {
+	fsm->base = fsm->pending;
+	fsm->base_version = version;
+      } else if (version != fsm->base_version) {
+	fsm->base_version = 0;
+      }
+    }
+  }
+  fsm->solo = may_lease_solo(fsm);
+  if (fsm->fenced && (fsm->solo ||
+		      before(now_ms + fsm->config.heartbeat_ms, fsm->lease_until_ms))) {
+    fsm->fenced = false;
+    events |= REPLICA_EVENT_LEASED | REPLICA_EVENT_SEND;
+  }
+  return events;
+}
+
+/* Write our message into `msg` (REPLICA_MSG_MAX_SIZE bytes), returns its
+   length */
+size_t replica_fsm_encode (struct replica_fsm_t_ *fsm, void *msg, uint32_t now_ms) {
+  uint8_t *p = msg;
+  struct replica_state_t_ const *state = &fsm->state;
+  unsigned int mask = 0;
+  uint32_t promise_ms;
+  size_t len = MSG_HEADER_SIZE;
+
+  memset(p, 0, MSG_HEADER_SIZE);
+  memcpy(p + MSG_MAGIC, REPLICA_MAGIC, 2);
+  p[MSG_VERSION] = REPLICA_VERSION;
+  p[MSG_NODE_ID] = fsm->config.node_id;
+  p[MSG_ROLE] = fsm->role;
+  put32(p + MSG_TERM, fsm->term);
+  put32(p + MSG_SEQ, ++fsm->seq);
+  put32(p + MSG_SENT_MS, now_ms);
+  put32(p + MSG_STATE_VERSION, fsm->version);
+
+  if (fsm->role == REPLICA_STANDBY) {
+    if (fsm->echo_valid) {
+      p[MSG_FLAGS] |= MSG_ACK;
+      put32(p + MSG_ECHO_MS, fsm->echo_ms);
+    }
+    promise_ms = fsm->promised_at_ms + fsm->config.takeover_ms - now_ms;
+    put32(p + MSG_PROMISE_MS, ((int32_t) promise_ms > 0) ? promise_ms : 0);
+  } else {
+    if (!fsm->fenced) {
+      p[MSG_FLAGS] |= MSG_LEASED;
+    }
+    if (fsm->version) {
+      if ((fsm->base_version == 0) || !same_state(state, &fsm->base, REPLICA_GROUP_MOTOR)) {
+	mask |= REPLICA_GROUP_MOTOR;
+      }
+      if ((fsm->base_version == 0) || !same_state(state, &fsm->base, REPLICA_GROUP_FILTER)) {
+	mask |= REPLICA_GROUP_FILTER;
+      }
+      if ((fsm->base_version == 0) || !same_state(state, &fsm->base, REPLICA_GROUP_FILL)) {
+	mask |= REPLICA_GROUP_FILL;
+      }
+      put32(p + MSG_BASE_VERSION, fsm->base_version);
+      fsm->pending = *state;
+      fsm->pending_version = fsm->version;
+    }
+    p[MSG_MASK] = mask;
+    if (mask & REPLICA_GROUP_MOTOR) {
+      p[len] = (state->motor_running ? MOTOR_RUNNING : 0) |
+	(state->tank_full ? MOTOR_TANK_FULL : 0);
+      put32(p + len + 1, state->motor_running ? now_ms - state->run_start_ms : 0);
+      len += 5;
+    }
+    if (mask & REPLICA_GROUP_FILTER) {
+      put32(p + len, state->filter_readings);
+      p[len + 4] = state->filter_index;
+      p[len + 5] = state->filter_successive;
+      len += 6;
+    }
+    if (mask & REPLICA_GROUP_FILL) {
+      put32(p + len, state->fill.runs);
+      putf(p + len + 4, state->fill.mean_s);
+      putf(p + len + 8, state->fill.m2);
+      len += 12;
+    }
+  }
+  fsm->last_sent_ms = now_ms;
+  fsm->tx++;
+  return len;
+}
+
+bool replica_fsm_may_drive (struct replica_fsm_t_ const *fsm, uint32_t now_ms) {
+  return (fsm->role == REPLICA_ACTIVE) && (fsm->solo || before(now_ms, fsm->lease_until_ms));
+}
+
+/* The active unit's state changed (or not; unchanged state is a no-op) */
+unsigned int replica_fsm_publish (struct replica_fsm_t_ *fsm,
+				  struct replica_state_t_ const *state) {
+  if (fsm->role != REPLICA_ACTIVE) {
+    return 0;
+  }
+  /* The run of the previous active unit is ours now, or over */
+  fsm->resume_run = false;
+  if (fsm->version && same_state(state, &fsm->state, REPLICA_GROUP_MOTOR) &&
+      same_state(state, &fsm->state, REPLICA_GROUP_FILTER) &&
+      same_state(state, &fsm->state, REPLICA_GROUP_FILL)) {
+    return 0;
+  }
+  fsm->state = *state;
+  if (++fsm->version == 0) {
+    fsm->version = 1;
+  }
+  return REPLICA_EVENT_SEND;
+}
+
+/* Take over now, as told by the operator, who knows that the peer is down.
+   Still leased (or not) like any other takeover. */
+unsigned int replica_fsm_take_over (struct replica_fsm_t_ *fsm, uint32_t now_ms) {
+  if (fsm->role == REPLICA_ACTIVE) {
+    return 0;
+  }
+  return become_active(fsm, now_ms);
+}
+
+char const *replica_role_name (enum replica_role_t_ role) {
+  static char const *names[] = {
+    [REPLICA_STANDBY] = "standby",
+    [REPLICA_ACTIVE] = "active",
+  };
+
+  return (role < REPLICA_ROLES) ? names[role] : "?";
+}
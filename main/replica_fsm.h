@@ -0,0 +1,106 @@
+#ifndef __REPLICA_FSM_H__
+#define __REPLICA_FSM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fill_model.h"
+
+/* The active/standby protocol of replica.c, kept free of ESP-IDF and
+   FreeRTOS like tank_filter.c, so that tools/replica_sim.c can run two of
+   them against each other over loopback UDP on a host. All times are in
+   milliseconds of the caller's own uptime clock (wrapping); the two units'
+   clocks are never compared with each other. */
+
+enum replica_role_t_ {
+  REPLICA_STANDBY,
+  REPLICA_ACTIVE,
+  REPLICA_ROLES
+};
+
+struct replica_config_t_ {
+  uint8_t node_id;		/* 1-255, different on the two units */
+  uint32_t heartbeat_ms;	/* between messages */
+  uint32_t lease_ms;		/* an active unit drives this long past an acked heartbeat */
+  uint32_t takeover_ms;		/* a standby takes over after this long without an ack */
+};
+
+/* The state replicated from the active unit to the standby, in the
+   receiver's own clock */
+struct replica_state_t_ {
+  bool motor_running;
+  bool tank_full;
+  uint32_t run_start_ms;	/* uptime at the motor start, if running */
+  uint32_t filter_readings;	/* bit i: tank_filter readings[i] */
+  uint8_t filter_index;
+  uint8_t filter_successive;	/* successive full indications */
+  struct fill_model_stats_t_ fill;
+};
+
+struct replica_fsm_t_ {
+  struct replica_config_t_ config;
+  enum replica_role_t_ role;
+  uint32_t term;
+  uint32_t seq;			/* of our messages */
+
+  /* Active */
+  bool fenced;			/* the lease lapses within a heartbeat, or has */
+  bool solo;			/* leased on our own: the peer is silent or fenced */
+  uint32_t lease_until_ms;
+  uint32_t base_version;	/* the peer has the state at this version, 0 if unknown */
+  struct replica_state_t_ base;
+  uint32_t pending_version;	/* last version sent */
+  struct replica_state_t_ pending;
+
+  /* Standby */
+  uint32_t promised_at_ms;	/* last ack sent; no takeover before this + takeover_ms */
+  bool echo_valid;
+  uint32_t echo_ms;		/* sent_ms of the last active heartbeat acked */
+  bool resume_run;		/* the state came from a peer, and has not been taken over */
+
+  /* Both */
+  uint32_t version;		/* of `state`, 0 if none yet */
+  struct replica_state_t_ state;
+  bool peer_heard;		/* any message in the last takeover_ms */
+  uint32_t peer_heard_ms;
+  uint8_t peer_id;
+  enum replica_role_t_ peer_role;
+  bool peer_leased;
+  uint32_t peer_term;
+  bool peer_fenced;		/* an active peer of our term, fenced since peer_fenced_ms */
+  uint32_t peer_fenced_ms;
+  uint32_t last_sent_ms;
+
+  /* Counters for /mc_stats */
+  uint32_t takeovers;
+  uint32_t fences;
+  uint32_t rx;
+  uint32_t rx_bad;
+  uint32_t tx;
+};
+
+/* Events returned by replica_fsm_tick() and replica_fsm_receive() */
+#define REPLICA_EVENT_SEND 0x01		/* a message is due: replica_fsm_encode() */
+#define REPLICA_EVENT_TAKEOVER 0x02	/* became active */
+#define REPLICA_EVENT_STEP_DOWN 0x04	/* became standby */
+#define REPLICA_EVENT_FENCE 0x08	/* the lease is about to lapse, stop driving */
+#define REPLICA_EVENT_LEASED 0x10	/* may drive (again) */
+#define REPLICA_EVENT_STATE 0x20	/* state received from the active unit */
+
+/* Largest message replica_fsm_encode() writes */
+#define REPLICA_MSG_MAX_SIZE 64
+
+extern bool replica_fsm_init(struct replica_fsm_t_ *fsm, struct replica_config_t_ const *config,
+			     uint32_t term, uint32_t now_ms);
+extern unsigned int replica_fsm_tick(struct replica_fsm_t_ *fsm, uint32_t now_ms,
+				     bool may_take_over);
+extern unsigned int replica_fsm_receive(struct replica_fsm_t_ *fsm, void const *msg,
+					size_t len, uint32_t now_ms);
+extern size_t replica_fsm_encode(struct replica_fsm_t_ *fsm, void *msg, uint32_t now_ms);
+extern bool replica_fsm_may_drive(struct replica_fsm_t_ const *fsm, uint32_t now_ms);
+extern unsigned int replica_fsm_publish(struct replica_fsm_t_ *fsm,
+					struct replica_state_t_ const *state);
+extern unsigned int replica_fsm_take_over(struct replica_fsm_t_ *fsm, uint32_t now_ms);
+extern char const *replica_role_name(enum replica_role_t_ role);
+
+#endif
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "esp_http_client.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "mc.h"
+
+static char const *LOG_TAG = "mc|selftest";
+
+/* Self-test of a newly upgraded image. The bootloader boots an image written
+   by an upgrade once, in the pending verify state; the image has to mark
+   itself valid, or the bootloader rolls back to the previous one at the next
+   reset. It is only marked valid once all of these have reported healthy
+   (an EVENT_HEALTH_* bit in mc_event_group) within
+   CONFIG_WLM_OTA_SELFTEST_TIMEOUT_S of the boot:
+
+     wifi        got an IP address
+     httpd       answered a /mc_status request (the self-test sends one to
+		 itself over the loopback interface, a client's counts too)
+     motor       the motor task read the motor running sense
+     tank_level  the tank level task ran its loop
+     logging     UDP logging sent the backlog and went live
+
+   and no control task has missed its deadline (STATUS_FAULT). Otherwise the
+   image is marked invalid and the unit restarts into the previous one.
+
+   The result, with the time each check took to pass, is kept in NVS so that
+   the previous image can still show why the new one was rolled back, and is
+   reported by /mc_version_info. */
+#define SELFTEST_NAMESPACE "mc_selftest"
+#define SELFTEST_KEY "last"
+#define SELFTEST_POLL_MS 250
+#define SELFTEST_HTTP_URL "http://127.0.0.1/mc_status"
+#define SELFTEST_HTTP_PERIOD_MS 5000
+
+struct selftest_check_t_ {
+  EventBits_t bit;
+  char const *name;
+};
+
+static struct selftest_check_t_ const selftest_checks[] = {
+  { EVENT_HEALTH_WIFI, "wifi" },
+  { EVENT_HEALTH_HTTPD, "httpd" },
+  { EVENT_HEALTH_MOTOR, "motor" },
+  { EVENT_HEALTH_TANK_LEVEL, "tank_level" },
+  { EVENT_HEALTH_LOGGING, "logging" },
+};
+
+#define SELFTEST_CHECKS (sizeof(selftest_checks) / sizeof(selftest_checks[0]))
+
+enum selftest_state_t_ {
+  SELFTEST_NONE,		/* no image upgraded yet */
+  SELFTEST_RUNNING,
+  SELFTEST_PASSED,
+  SELFTEST_FAILED
+};
+
+/* Stored in NVS as it is */
+struct selftest_result_t_ {
+  char version[sizeof(((esp_app_desc_t *) 0)->version)];
+  uint32_t state;		/* enum selftest_state_t_ */
+  uint32_t deadline_ms;
+  uint32_t elapsed_ms;		/* since boot, at the pass or fail */
+  uint32_t healthy_ms[SELFTEST_CHECKS]; /* since boot, 0 if never */
+  uint32_t fault;		/* a control task missed its deadline */
+};
+
+static struct selftest_result_t_ selftest_result;
+static portMUX_TYPE selftest_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void set_result (struct selftest_result_t_ const *result) {
+  taskENTER_CRITICAL(&selftest_lock);
+  selftest_result = *result;
+  taskEXIT_CRITICAL(&selftest_lock);
+}
+
+static void load_result (void) {
+  struct selftest_result_t_ result;
+  size_t len = sizeof(result);
+  nvs_handle_t nvs;
+
+  if (nvs_open(SELFTEST_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+    return;
+  }
+  if ((nvs_get_blob(nvs, SELFTEST_KEY, &result, &len) == ESP_OK) &&
+      (len == sizeof(result)) && (result.state <= SELFTEST_FAILED)) {
+    result.version[sizeof(result.version) - 1] = '\0';
+    set_result(&result);
+  }
+  nvs_close(nvs);
+}
+
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+static void save_result (struct selftest_result_t_ const *result) {
+  nvs_handle_t nvs;
+  esp_err_t err;
+
+  err = nvs_open(SELFTEST_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err == ESP_OK) {
+    err = nvs_set_blob(nvs, SELFTEST_KEY, result, sizeof(*result));
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to save the self-test result (%s)", esp_err_to_name(err));
+  }
+}
+
+/* Ask our own web server for /mc_status, which sets EVENT_HEALTH_HTTPD */
+static void probe_httpd (void) {
+  esp_http_client_config_t config = {
+    .url = SELFTEST_HTTP_URL,
+    .timeout_ms = 2000,
+  };
+  esp_http_client_handle_t client;
+  esp_err_t err;
+
+  client = esp_http_client_init(&config);
+  if (!client) {
+    return;
+  }
+  err = esp_http_client_perform(client);
+  if (err != ESP_OK) {
+    ESP_LOGW(LOG_TAG, "%s: %s", SELFTEST_HTTP_URL, esp_err_to_name(err));
+  }
+  esp_http_client_cleanup(client);
+}
+
+static bool run_selftest (struct mc_task_args_t_ *mc_task_args,
+			  struct selftest_result_t_ *result) {
+  EventBits_t bits, all = 0;
+  uint32_t now_ms, last_probe_ms = 0;
+  size_t i;
+
+  for (i = 0; i < SELFTEST_CHECKS; i++) {
+    all |= selftest_checks[i].bit;
+  }
+  ESP_LOGI(LOG_TAG, "New image, running the self-test (deadline %lu s after boot)",
+	   (unsigned long) (result->deadline_ms / 1000));
+
+  while (pdTRUE) {
+    now_ms = esp_timer_get_time() / 1000;
+    bits = xEventGroupGetBits(mc_task_args->mc_event_group);
+    for (i = 0; i < SELFTEST_CHECKS; i++) {
+      if ((bits & selftest_checks[i].bit) && (result->healthy_ms[i] == 0)) {
+	result->healthy_ms[i] = now_ms;
+	ESP_LOGI(LOG_TAG, "%s healthy at %lu ms", selftest_checks[i].name,
+		 (unsigned long) now_ms);
+      }
+    }
+    result->fault = (status_get() & (1 << STATUS_FAULT)) != 0;
+    result->elapsed_ms = now_ms;
+    set_result(result);
+
+    if (result->fault) {
+      ESP_LOGE(LOG_TAG, "A control task missed its deadline");
+      return false;
+    }
+    if ((bits & all) == all) {
+      return true;
+    }
+    if (now_ms >= result->deadline_ms) {
+      for (i = 0; i < SELFTEST_CHECKS; i++) {
+	if (!(bits & selftest_checks[i].bit)) {
+	  ESP_LOGE(LOG_TAG, "%s did not report healthy", selftest_checks[i].name);
+	}
+      }
+      return false;
+    }
+
+    if ((bits & EVENT_HEALTH_WIFI) && !(bits & EVENT_HEALTH_HTTPD) &&
+	((now_ms - last_probe_ms) >= SELFTEST_HTTP_PERIOD_MS)) {
+      probe_httpd();
+      last_probe_ms = now_ms;
+    }
+    vTaskDelay(pdMS_TO_TICKS(SELFTEST_POLL_MS));
+  }
+}
+#endif
+
+/* Called by ota_task at startup. Returns once the running image is known to
+   be good; an image that fails its self-test does not return, the unit
+   restarts into the previous image. */
+void selftest_boot (struct mc_task_args_t_ *mc_task_args) {
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+  struct selftest_result_t_ result;
+  esp_ota_img_states_t ota_state;
+  bool passed;
+#endif
+
+  load_result();
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+  if ((esp_ota_get_state_partition(esp_ota_get_running_partition(), &ota_state) != ESP_OK) ||
+      (ota_state != ESP_OTA_IMG_PENDING_VERIFY)) {
+    return;
+  }
+
+  memset(&result, 0, sizeof(result));
+  strlcpy(result.version, esp_app_get_description()->version, sizeof(result.version));
+  result.state = SELFTEST_RUNNING;
+  result.deadline_ms = CONFIG_WLM_OTA_SELFTEST_TIMEOUT_S * 1000;
+  set_result(&result);
+
+  passed = run_selftest(mc_task_args, &result);
+  result.state = passed ? SELFTEST_PASSED : SELFTEST_FAILED;
+  set_result(&result);
+  save_result(&result);
+
+  if (passed) {
+    ESP_LOGI(LOG_TAG, "Self-test passed in %lu ms, marking the image valid",
+	     (unsigned long) result.elapsed_ms);
+    esp_ota_mark_app_valid_cancel_rollback();
+    return;
+  }
+
+  ESP_LOGE(LOG_TAG, "Self-test failed, rolling back to the previous image");
+  /* Give the log a moment to get out */
+  vTaskDelay(pdMS_TO_TICKS(1000));
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+  /* Only returns if there is no image to go back to. The image stays pending
+     verify, so the bootloader gives up on it at the next reset anyway. */
+  ESP_LOGE(LOG_TAG, "No previous image to roll back to, carrying on");
+#endif
+}
+
+/* A line for /mc_version_info, e.g.
+     Self-test of 1.4.0: passed at 6250 ms (deadline 120 s): wifi 3000 ms, httpd 5000 ms, ...
+   Returns the length, as snprintf() does. */
+int selftest_format (char *buf, size_t len) {
+  struct selftest_result_t_ result;
+  static char const *state_names[] = {
+    [SELFTEST_NONE] = "none",
+    [SELFTEST_RUNNING] = "running",
+    [SELFTEST_PASSED] = "passed",
+    [SELFTEST_FAILED] = "failed",
+  };
+  int n, written;
+  size_t i;
+
+  taskENTER_CRITICAL(&selftest_lock);
+  result = selftest_result;
+  taskEXIT_CRITICAL(&selftest_lock);
+
+  if (result.state == SELFTEST_NONE) {
+    return snprintf(buf, len, "Self-test: none yet, one runs after each upgrade\n");
+  }
+  written = snprintf(buf, len, "Self-test of %s: %s at %lu ms (deadline %lu s)%s:",
+		     result.version, state_names[result.state],
+		     (unsigned long) result.elapsed_ms,
+		     (unsigned long) (result.deadline_ms / 1000),
+		     result.fault ? ", control task fault" : "");
+  for (i = 0; (i < SELFTEST_CHECKS) && (written >= 0); i++) {
+    if (result.healthy_ms[i]) {
+      n = snprintf(buf + written, (written < (int) len) ? len - written : 0, " %s %lu ms%s",
+		   selftest_checks[i].name, (unsigned long) result.healthy_ms[i],
+		   (i < SELFTEST_CHECKS - 1) ? "," : "");
+    } else {
+      n = snprintf(buf + written, (written < (int) len) ? len - written : 0, " %s never%s",
+		   selftest_checks[i].name, (i < SELFTEST_CHECKS - 1) ? "," : "");
+    }
+    written = (n < 0) ? n : written + n;
+  }
+  if (written >= 0) {
+    n = snprintf(buf + written, (written < (int) len) ? len - written : 0, "\n");
+    written = (n < 0) ? n : written + n;
+  }
+  return written;
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_task_wdt.h"
+#include "mc.h"
+
+/* The control tasks (motor, tank level) report a heartbeat at the top of
+   every loop iteration. If a task misses CONFIG_WLM_SUPERVISOR_MISSED_PERIODS
+   of its loop periods, e.g. because it is stuck in a queue send, the
+   supervisor turns the Err/Status LED on and the motor off, since nothing
+   is watching the tank any more.
+
+   Of the application tasks, only the supervisor is subscribed to the task
+   watchdog (the idle tasks of both cores are too), and it feeds it only
+   while every control task is healthy. A task that stays wedged therefore
+   ends in a watchdog panic (and a core dump) after
+   CONFIG_ESP_TASK_WDT_TIMEOUT_S. */
+#define SUPERVISOR_PERIOD_MS 250
+
+struct supervised_task_t_ {
+  char const *name;
+  uint32_t period_ms;
+  int64_t last_heartbeat_us;
+  uint32_t max_loop_ms;
+  uint32_t missed;
+  bool late;
+};
+
+static struct supervised_task_t_ supervised_tasks[SUPERVISED_TASKS];
+static portMUX_TYPE supervisor_lock = portMUX_INITIALIZER_UNLOCKED;
+static char const *LOG_TAG = "mc|supervisor";
+
+/* Called by a control task before it enters its loop */
+void supervisor_register (enum supervised_task_id_t_ id, char const *name,
+			  uint32_t period_ms) {
+  taskENTER_CRITICAL(&supervisor_lock);
+  supervised_tasks[id].name = name;
+  supervised_tasks[id].period_ms = period_ms;
+  supervised_tasks[id].last_heartbeat_us = esp_timer_get_time();
+  taskEXIT_CRITICAL(&supervisor_lock);
+}
+
+/* Called by a control task at the top of each loop iteration */
+void supervisor_heartbeat (enum supervised_task_id_t_ id) {
+  struct supervised_task_t_ *task = &supervised_tasks[id];
+  int64_t now = esp_timer_get_time();
+  uint32_t loop_ms;
+
+  taskENTER_CRITICAL(&supervisor_lock);
+  loop_ms = (now - task->last_heartbeat_us) / 1000;
+  if (loop_ms > task->max_loop_ms) {
+    task->max_loop_ms = loop_ms;
+  }
+  task->last_heartbeat_us = now;
+  taskEXIT_CRITICAL(&supervisor_lock);
+}
+
+/* `name=value` lines for /mc_stats. Returns the length written, as snprintf
+   does. */
+int supervisor_format_stats (char *buf, size_t len) {
+  struct supervised_task_t_ tasks[SUPERVISED_TASKS];
+  int i, n, written = 0;
+
+  taskENTER_CRITICAL(&supervisor_lock);
+  for (i = 0; i < SUPERVISED_TASKS; i++) {
+    tasks[i] = supervised_tasks[i];
+  }
+  taskEXIT_CRITICAL(&supervisor_lock);
+
+  for (i = 0; i < SUPERVISED_TASKS; i++) {
+    if (!tasks[i].name) {
+      continue;
+    }
+    n = snprintf(buf + written, (written < (int) len) ? len - written : 0,
+		 "%s_period_ms=%lu\n"
+		 "%s_max_loop_ms=%lu\n"
+		 "%s_missed_deadlines=%lu\n",
+		 tasks[i].name, (unsigned long) tasks[i].period_ms,
+		 tasks[i].name, (unsigned long) tasks[i].max_loop_ms,
+		 tasks[i].name, (unsigned long) tasks[i].missed);
+    if (n < 0) {
+      return n;
+    }
+    written += n;
+  }
+  return written;
+}
+
+void supervisor_task (void *param) {
+  struct supervised_task_t_ *task;
+  bool all_healthy;
+  int64_t now, deadline_us;
+  uint32_t late_ms;
+  int i;
+
+  if (esp_task_wdt_add(NULL) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to subscribe to the task watchdog");
+  }
+
+  while (pdTRUE) {
+    vTaskDelay(pdMS_TO_TICKS(SUPERVISOR_PERIOD_MS));
+
+    all_healthy = true;
+    now = esp_timer_get_time();
+    for (i = 0; i < SUPERVISED_TASKS; i++) {
+      task = &supervised_tasks[i];
+
+      taskENTER_CRITICAL(&supervisor_lock);
+      if (!task->name) {
+	taskEXIT_CRITICAL(&supervisor_lock);
+	continue;
+      }
+      deadline_us = task->last_heartbeat_us +
+	(int64_t) task->period_ms * CONFIG_WLM_SUPERVISOR_MISSED_PERIODS * 1000;
+      late_ms = (now - task->last_heartbeat_us) / 1000;
+      taskEXIT_CRITICAL(&supervisor_lock);
+
+      if (now <= deadline_us) {
+	if (task->late) {
+	  ESP_LOGW(LOG_TAG, "%s task is running again", task->name);
+	  task->late = false;
+	}
+	continue;
+      }
+
+      all_healthy = false;
+      if (!task->late) {
+	/* Report (and act on) every missed deadline once */
+	task->late = true;
+	taskENTER_CRITICAL(&supervisor_lock);
+	task->missed++;
+	taskEXIT_CRITICAL(&supervisor_lock);
+	ESP_LOGE(LOG_TAG, "%s task missed its deadline, no heartbeat for %lu ms "
+		 "(period %lu ms)", task->name, (unsigned long) late_ms,
+		 (unsigned long) task->period_ms);
+	status_set(STATUS_FAULT, true);
+	motor_failsafe_off();
+      }
+    }
+
+    if (all_healthy) {
+      esp_task_wdt_reset();
+    }
+  }
+}
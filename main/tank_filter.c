@@ -0,0 +1,69 @@
+#include <string.h>
+#include "tank_filter.h"
+
+/* Reading the GPIO and counting a single high as `full` and a single low as
+   `not full` is too unreliable.
+   Even when the tank is full, we get the occasional not-full reading.
+   And even when the tank is not full, we get a few spurious tank-full readings in
+   succession.
+   To address this, we average out a few readings by maintaining a circular buffer
+   of booleans.
+   Once the number of `trues` in the circular buffer crosses a threshold, we treat
+   that as a SINGLE tank-full.
+
+   We use `n` successive tank-full indications derived using this method to
+   sound the beep.
+   We use `m` successive tank-full indications derived using this method to
+   turn the motor off.
+   Where n = config.beep_after and m is config.motor_off_after */
+
+bool tank_filter_init (struct tank_filter_t_ *filter,
+		       struct tank_filter_config_t_ const *config) {
+  if ((config->window == 0) || (config->window > TANK_FILTER_MAX_WINDOW) ||
+      (config->threshold == 0) || (config->threshold > config->window)) {
+    return false;
+  }
+  filter->config = *config;
+  tank_filter_reset(filter);
+  return true;
+}
+
+/* Clear out the circular buffer, when the motor starts */
+void tank_filter_reset (struct tank_filter_t_ *filter) {
+  memset(filter->readings, 0, sizeof(filter->readings));
+  filter->index = 0;
+  filter->full_reports = 0;
+  filter->successive_full_indications = 0;
+}
+
+/* Take one GPIO reading, add it to the circular buffer, average out the
+   circular buffer readings, and return what, if anything, should be done
+   about it (TANK_FILTER_* flags) */
+unsigned int tank_filter_sample (struct tank_filter_t_ *filter,
+				 bool is_reporting_full_now) {
+  unsigned int i, actions = 0;
+
+  filter->readings[filter->index++] = is_reporting_full_now;
+  filter->index %= filter->config.window;
+
+  filter->full_reports = 0;
+  for (i = 0; i < filter->config.window; i++) {
+    if (filter->readings[i]) {
+      filter->full_reports++;
+    }
+  }
+
+  if (filter->full_reports >= filter->config.threshold) {
+    filter->successive_full_indications++;
+  } else {
+    filter->successive_full_indications = 0;
+  }
+
+  if (filter->successive_full_indications == filter->config.beep_after) {
+    actions |= TANK_FILTER_BEEP;
+  }
+  if (filter->successive_full_indications == filter->config.motor_off_after) {
+    actions |= TANK_FILTER_MOTOR_OFF;
+  }
+  return actions;
+}
@@ -0,0 +1,60 @@
+#ifndef __TANK_FILTER_H__
+#define __TANK_FILTER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The tank-full filter of oh_tank_level.c, kept free of ESP-IDF and FreeRTOS
+   so that tools/tank_replay.c can run recorded sensor traces through the
+   exact same code on a host. */
+
+#define TANK_FILTER_MAX_WINDOW 32
+
+struct tank_filter_config_t_ {
+  unsigned int window;		/* readings averaged */
+  unsigned int threshold;	/* full readings in the window for a full indication */
+  unsigned int beep_after;	/* successive full indications to beep */
+  unsigned int motor_off_after;	/* successive full indications to turn the motor off */
+};
+
+#define TANK_FILTER_DEFAULT_CONFIG { 10, 4, 4, 5 }
+
+struct tank_filter_t_ {
+  struct tank_filter_config_t_ config;
+  bool readings[TANK_FILTER_MAX_WINDOW];
+  unsigned int index;
+  unsigned int full_reports;	/* full readings in the window */
+  unsigned int successive_full_indications;
+};
+
+/* Actions returned by tank_filter_sample(), possibly both at once */
+#define TANK_FILTER_BEEP 0x1
+#define TANK_FILTER_MOTOR_OFF 0x2
+
+extern bool tank_filter_init(struct tank_filter_t_ *filter,
+			     struct tank_filter_config_t_ const *config);
+extern void tank_filter_reset(struct tank_filter_t_ *filter);
+extern unsigned int tank_filter_sample(struct tank_filter_t_ *filter,
+				       bool is_reporting_full_now);
+
+/* Sensor trace format (all little endian): a header, then `count` 16 bit
+   records, one per probe reading of oh_tank_level_task while the motor runs,
+   plus one when the motor stops. */
+#define SENSOR_TRACE_MAGIC "MCST"
+#define SENSOR_TRACE_VERSION 1
+#define SENSOR_TRACE_TICK_MS 10
+
+struct sensor_trace_header_t_ {
+  char magic[4];
+  uint8_t version;
+  uint8_t tick_ms;		/* unit of the record time deltas */
+  uint16_t count;		/* number of records */
+  uint32_t start_ms;		/* uptime at the first record */
+  uint32_t start_epoch;		/* wall clock at the first record, 0 if unset */
+} __attribute__((packed));
+
+#define SENSOR_TRACE_LEVEL_FULL 0x8000	/* WATER_LEVEL_IN read full */
+#define SENSOR_TRACE_MOTOR_RUNNING 0x4000	/* clear in the motor stopped record */
+#define SENSOR_TRACE_DELTA_MASK 0x3fff	/* ticks since the previous record, saturated */
+
+#endif
@@ -0,0 +1,119 @@
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "trace.h"
+
+#ifdef CONFIG_WLM_TRACE
+
+/* One ring per core. A core only ever writes its own ring, so there is no
+   lock shared between the cores; a record is written with interrupts masked
+   on the local core only, which keeps a task and an ISR on the same core
+   from interleaving. `head` counts every record written; the record at
+   position `pos` lives at records[pos % TRACE_RECORDS], as in the log ring.
+
+   The cycle counter wraps every 2^32 cycles (27 seconds at 160MHz), so
+   each record also carries the tick count, which the host tool uses to
+   unwrap it.
+
+   With power management on, the CPU clock (and so the rate of the cycle
+   counter) changes with the load, and a cycle count no longer converts to
+   a time. The records then carry the low 32 bits of esp_timer_get_time()
+   instead, and the export says that there is one "cycle" per us. */
+#define TRACE_RECORDS CONFIG_WLM_TRACE_RECORDS
+
+#ifdef CONFIG_PM_ENABLE
+#define TRACE_CYCLES() ((uint32_t) esp_timer_get_time())
+#else
+#define TRACE_CYCLES() esp_cpu_get_cycle_count()
+#endif
+
+_Static_assert((TRACE_RECORDS & (TRACE_RECORDS - 1)) == 0,
+	       "CONFIG_WLM_TRACE_RECORDS must be a power of 2");
+
+struct trace_ring_t_ {
+  volatile uint32_t head;
+  struct trace_record_t_ records[TRACE_RECORDS];
+};
+
+static struct trace_ring_t_ trace_rings[portNUM_PROCESSORS];
+static volatile bool trace_paused = false;
+
+static char const *trace_event_names[TRACE_EVENTS] = {
+  [TRACE_HTTP_CTRL] = "http_ctrl",
+  [TRACE_MOTOR_Q_SEND] = "motor_q_send",
+  [TRACE_MOTOR_Q_SEND_FAILED] = "motor_q_send_failed",
+  [TRACE_MOTOR_Q_RECV] = "motor_q_recv",
+  [TRACE_BEEP_Q_SEND] = "beep_q_send",
+  [TRACE_BEEP_Q_SEND_FAILED] = "beep_q_send_failed",
+  [TRACE_BEEP_Q_RECV] = "beep_q_recv",
+  [TRACE_GPIO_WRITE] = "gpio_write",
+  [TRACE_GPIO_READ] = "gpio_read",
+  [TRACE_EVENT_SET] = "event_set",
+  [TRACE_EVENT_CLEAR] = "event_clear",
+};
+
+void trace_record (enum trace_event_t_ event, uint16_t arg) {
+  struct trace_ring_t_ *ring;
+  struct trace_record_t_ *record;
+  UBaseType_t irq_state;
+
+  if (trace_paused) {
+    return;
+  }
+
+  irq_state = portSET_INTERRUPT_MASK_FROM_ISR();
+  ring = &trace_rings[esp_cpu_get_core_id()];
+  record = &ring->records[ring->head % TRACE_RECORDS];
+  record->cycles = TRACE_CYCLES();
+  record->ticks = xPortInIsrContext() ? xTaskGetTickCountFromISR() : xTaskGetTickCount();
+  record->task = (uint32_t) xTaskGetCurrentTaskHandle();
+  record->event = event;
+  record->arg = arg;
+  ring->head++;
+  portCLEAR_INTERRUPT_MASK_FROM_ISR(irq_state);
+}
+
+/* Rate of the `cycles` of the records */
+uint32_t trace_cycles_per_us (void) {
+#ifdef CONFIG_PM_ENABLE
+  return 1;
+#else
+  return esp_rom_get_cpu_ticks_per_us();
+#endif
+}
+
+/* Tracing is paused while the rings are read out, so that they hold still */
+void trace_pause (bool pause) {
+  trace_paused = pause;
+}
+
+/* Copy up to `max` records of `core`'s ring from `*cursor` onwards, oldest
+   first. Start with `*cursor` = 0. Returns the number of records copied, 0
+   once all of them have been. */
+size_t trace_read (int core, uint32_t *cursor, struct trace_record_t_ *records,
+		   size_t max) {
+  struct trace_ring_t_ *ring = &trace_rings[core];
+  uint32_t head = ring->head;
+  size_t n;
+
+  if (head - *cursor > TRACE_RECORDS) {
+    *cursor = head - TRACE_RECORDS;
+  }
+  for (n = 0; (n < max) && (*cursor != head); n++, (*cursor)++) {
+    records[n] = ring->records[*cursor % TRACE_RECORDS];
+  }
+  return n;
+}
+
+char const *trace_event_name (uint16_t event) {
+  if ((event >= TRACE_EVENTS) || !trace_event_names[event]) {
+    return "unknown";
+  }
+  return trace_event_names[event];
+}
+
+#endif
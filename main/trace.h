@@ -0,0 +1,53 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+/* Event trace, compiled in with CONFIG_WLM_TRACE. MC_TRACE() appends a
+   record to the ring of the core it runs on, and costs nothing when tracing
+   is compiled out. /mc_trace exports the rings as text, which
+   tools/trace2chrome.py turns into a Chrome trace (chrome://tracing,
+   Perfetto). */
+
+/* Event numbers are part of the export format; only add to the end */
+enum trace_event_t_ {
+  TRACE_HTTP_CTRL = 1,		/* arg: desired motor state */
+  TRACE_MOTOR_Q_SEND,		/* arg: desired motor state */
+  TRACE_MOTOR_Q_SEND_FAILED,	/* arg: desired motor state */
+  TRACE_MOTOR_Q_RECV,		/* arg: desired motor state */
+  TRACE_BEEP_Q_SEND,		/* arg: desired beep state */
+  TRACE_BEEP_Q_SEND_FAILED,	/* arg: desired beep state */
+  TRACE_BEEP_Q_RECV,		/* arg: desired beep state */
+  TRACE_GPIO_WRITE,		/* arg: pin << 8 | level */
+  TRACE_GPIO_READ,		/* arg: pin << 8 | level */
+  TRACE_EVENT_SET,		/* arg: event group bits */
+  TRACE_EVENT_CLEAR,		/* arg: event group bits */
+  TRACE_EVENTS
+};
+
+struct trace_record_t_ {
+  uint32_t cycles;		/* CPU cycle counter of the core (us with PM) */
+  uint32_t ticks;		/* FreeRTOS tick count, to unwrap `cycles` */
+  uint32_t task;		/* handle of the running task */
+  uint16_t event;
+  uint16_t arg;
+};
+
+#define TRACE_GPIO_ARG(pin, level) ((uint16_t) (((pin) << 8) | ((level) & 0xff)))
+
+#ifdef CONFIG_WLM_TRACE
+extern void trace_record(enum trace_event_t_ event, uint16_t arg);
+extern void trace_pause(bool pause);
+extern size_t trace_read(int core, uint32_t *cursor, struct trace_record_t_ *records,
+			 size_t max);
+extern char const *trace_event_name(uint16_t event);
+extern uint32_t trace_cycles_per_us(void);
+#define MC_TRACE(event, arg) trace_record((event), (arg))
+#else
+#define MC_TRACE(event, arg) do { } while (0)
+#endif
+
+#endif
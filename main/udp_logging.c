@@ -1,8 +1,10 @@
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
@@ -10,44 +12,224 @@
 #include "lwip/dns.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_system.h"
 #include "mc.h"
 
+/* Backlog is sent in datagrams of up to this many bytes */
+#define UDP_LOGGING_BATCH_SIZE 1024
+
 static int fd_socket = -1;
+static bool udp_logging_live = false;
+static uint32_t udp_logging_resume_cursor = 0; /* where to resume after wifi comes back */
 static struct sockaddr_in logging_host_addr;
 static vprintf_like_t uart_logging_fn = 0;
 static char logging_buf[256 + 1]; /* All our logs will have to fit in 256 characters */
+static SemaphoreHandle_t logging_lock = NULL;
+static StaticSemaphore_t logging_lock_buf;
 static char const *LOG_TAG = "mc|udp_logging";
 
-static int udp_logging_fn (char const *fmt, va_list args) {
-  int len, err;
+static void udp_send (char const *buf, int len) {
+  int err;
   socklen_t optlen;
-  /* Do not invoke ESP_LOG* macros in this function! */
-  if (fd_socket != -1) {
-    len = vsnprintf(logging_buf, sizeof(logging_buf) - 1, fmt, args);
+
+  if (0 > sendto(fd_socket, buf, len, 0, (struct sockaddr *) &logging_host_addr,
+		 sizeof(logging_host_addr))) {
+    printf("sendto() failed: %s, %ld, %d bytes\n", strerror(errno),
+	   (long) &logging_host_addr, len);
+    err = 0;
+    optlen = sizeof(err);
+    getsockopt(fd_socket, SOL_SOCKET, SO_ERROR, &err, &optlen);
+    printf("sendto() failed because of %d (%s)\n", err, strerror(err));
+  }
+}
+
+/* Format a log line into logging_buf, and pass it on to the log ring (if
+   `to_ring`) and to the UDP logging host (once the backlog has been sent).
+   Called with logging_lock held. */
+static void format_and_send (char const *fmt, va_list args, bool to_ring) {
+  int len;
+
+  len = vsnprintf(logging_buf, sizeof(logging_buf) - 1, fmt, args);
+  if (len > (int) sizeof(logging_buf) - 1) {
+    len = sizeof(logging_buf) - 1;
+  }
+  if (len > 0) {
     logging_buf[len] = '\0';
-    if (0 > sendto(fd_socket, logging_buf, len, 0, (struct sockaddr *) &logging_host_addr,
-		   sizeof(logging_host_addr))) {
-      printf("sendto() failed: %s, %ld, %d bytes\n", strerror(errno),
-	     (long) &logging_host_addr, len);
-      err = 0;
-      optlen = sizeof(err);
-      getsockopt(fd_socket, SOL_SOCKET, SO_ERROR, &err, &optlen);
-      printf("sendto() failed because of %d (%s)\n", err, strerror(err));
+    if (to_ring) {
+      log_ring_write(logging_buf, len);
+    }
+    if (udp_logging_live) {
+      udp_send(logging_buf, len);
     }
   }
+}
+
+/* Installed as the log output function from the start of app_main. Every log
+   line that gets past the rate limiter goes into the log ring, to the UDP
+   logging host once the backlog has been sent, and to the UART. */
+static int udp_logging_fn (char const *fmt, va_list args) {
+  int len;
+  va_list uart_args;
+  char const *tag;
+  uint32_t suppressed;
+  /* Do not invoke ESP_LOG* macros in this function! */
+
+  va_copy(uart_args, args);
+
+  /* A log from inside this function (e.g. from lwip) would clobber
+     logging_buf, so it only goes to the UART */
+  if ((xSemaphoreGetMutexHolder(logging_lock) != xTaskGetCurrentTaskHandle()) &&
+      (pdTRUE == xSemaphoreTake(logging_lock, pdMS_TO_TICKS(100)))) {
+    /* Rate limited lines are dropped here, before any formatting */
+    if (!log_rate_limit(fmt, args, &tag, &suppressed)) {
+      xSemaphoreGive(logging_lock);
+      va_end(uart_args);
+      return 0;
+    }
+    if (suppressed) {
+      len = snprintf(logging_buf, sizeof(logging_buf), "%s: %lu messages suppressed\n",
+		     tag, (unsigned long) suppressed);
+      log_ring_write(logging_buf, len);
+      if (udp_logging_live) {
+	udp_send(logging_buf, len);
+      }
+      printf("%s", logging_buf);
+    }
+
+    format_and_send(fmt, args, true);
+    xSemaphoreGive(logging_lock);
+  }
+
   /* Send to stdout */
-  return vprintf(fmt, args);
+  len = uart_logging_fn(fmt, uart_args);
+  va_end(uart_args);
+  return len;
+}
+
+/* The part of udp_logging_fn() that formats and sends a line, for bench.c.
+   The line skips the log ring, so that a benchmark run does not push the
+   real logs out of it, and the UART. Returns whether the line went to the
+   UDP logging host (it is only formatted while that is not up yet). */
+bool udp_logging_bench_line (char const *fmt, ...) {
+  va_list args;
+  bool live;
+
+  if (pdTRUE != xSemaphoreTake(logging_lock, pdMS_TO_TICKS(100))) {
+    return false;
+  }
+  va_start(args, fmt);
+  format_and_send(fmt, args, false);
+  va_end(args);
+  live = udp_logging_live;
+  xSemaphoreGive(logging_lock);
+  return live;
+}
+
+/* Called first thing in app_main, so that the log ring sees everything */
+void start_log_capture (void) {
+  log_ring_init();
+  logging_lock = xSemaphoreCreateMutexStatic(&logging_lock_buf);
+  uart_logging_fn = esp_log_set_vprintf(udp_logging_fn);
+}
+
+static char const *reset_reason_str (esp_reset_reason_t reason) {
+  switch (reason) {
+  case ESP_RST_POWERON:
+    return "power on";
+  case ESP_RST_EXT:
+    return "external pin";
+  case ESP_RST_SW:
+    return "software restart";
+  case ESP_RST_PANIC:
+    return "panic";
+  case ESP_RST_INT_WDT:
+    return "interrupt watchdog";
+  case ESP_RST_TASK_WDT:
+    return "task watchdog";
+  case ESP_RST_WDT:
+    return "other watchdog";
+  case ESP_RST_DEEPSLEEP:
+    return "deep sleep";
+  case ESP_RST_BROWNOUT:
+    return "brownout";
+  case ESP_RST_SDIO:
+    return "SDIO";
+  default:
+    return "unknown";
+  }
+}
+
+/* Send the tail of the previous boot's log (once), then everything logged
+   since this boot started, in batches. Live logging is switched on once the
+   backlog has been caught up with, under the logging lock so that no line is
+   lost or sent twice. */
+static void send_backlog (void) {
+  static bool prev_boot_sent = false;
+  char const *prev_boot_log;
+  size_t prev_boot_len, len, i;
+  uint32_t cursor = 0, lost;
+  char *batch;
+
+  batch = malloc(UDP_LOGGING_BATCH_SIZE);
+  if (!batch) {
+    udp_logging_live = true;
+    return;
+  }
+
+  prev_boot_log = log_ring_prev_boot(&prev_boot_len);
+  if (!prev_boot_sent) {
+    len = snprintf(batch, UDP_LOGGING_BATCH_SIZE,
+		   "---- reset reason: %s, %u bytes of log from the previous boot ----\n",
+		   reset_reason_str(esp_reset_reason()), (unsigned) prev_boot_len);
+    udp_send(batch, len);
+    for (i = 0; i < prev_boot_len; i += UDP_LOGGING_BATCH_SIZE) {
+      len = prev_boot_len - i;
+      udp_send(prev_boot_log + i, (len > UDP_LOGGING_BATCH_SIZE) ?
+	       UDP_LOGGING_BATCH_SIZE : len);
+    }
+    len = snprintf(batch, UDP_LOGGING_BATCH_SIZE, "---- this boot ----\n");
+    udp_send(batch, len);
+    log_ring_free_prev_boot();
+    prev_boot_sent = true;
+  } else {
+    /* Wifi came back; send what was logged while it was down */
+    cursor = udp_logging_resume_cursor;
+  }
+
+  while (pdTRUE) {
+    len = log_ring_read(&cursor, batch, UDP_LOGGING_BATCH_SIZE, &lost);
+    if (lost) {
+      len = snprintf(batch, UDP_LOGGING_BATCH_SIZE,
+		     "---- %lu bytes of log lost ----\n", (unsigned long) lost);
+      udp_send(batch, len);
+      continue;
+    }
+    if (len > 0) {
+      udp_send(batch, len);
+      continue;
+    }
+
+    xSemaphoreTake(logging_lock, portMAX_DELAY);
+    if (cursor == log_ring_head()) {
+      udp_logging_live = true;
+      xSemaphoreGive(logging_lock);
+      break;
+    }
+    xSemaphoreGive(logging_lock);
+  }
+  free(batch);
 }
 
 /* Can also be invoked externally, by the OTA code just before restarting */
 void stop_udp_logging (void) {
-  if (uart_logging_fn != 0) {
-    esp_log_set_vprintf(uart_logging_fn);
-    ESP_LOGI(LOG_TAG, "Stopped UDP logging");
-  }
   if (fd_socket != -1) {
+    ESP_LOGI(LOG_TAG, "Stopped UDP logging");
+    xSemaphoreTake(logging_lock, portMAX_DELAY);
+    udp_logging_live = false;
+    udp_logging_resume_cursor = log_ring_head();
     close(fd_socket);
     fd_socket = -1;
+    xSemaphoreGive(logging_lock);
   }
 }
 
@@ -66,26 +248,29 @@ static void start_udp_logging (void) {
   inet_pton(AF_INET, CONFIG_WLM_UDP_LOGGING_IPV4_ADDRESS, &(logging_host_addr.sin_addr));
   logging_host_addr.sin_port = htons(CONFIG_WLM_UDP_LOGGING_PORT);
 
-  uart_logging_fn = esp_log_set_vprintf(udp_logging_fn);
+  send_backlog();
   ESP_LOGI(LOG_TAG, "Started UDP logging");
 }
 
 void udp_logging_task (void *param) {
   EventBits_t bits;
   struct mc_task_args_t_ *mc_task_args = (struct mc_task_args_t_ *) param;
-  
+
   while (pdTRUE) {
     bits = xEventGroupWaitBits(mc_task_args->mc_event_group,
-			       EVENT_WIFI_CONNECTED | EVENT_WIFI_FAILED,
+			       EVENT_LOGGING_WIFI_CONNECTED | EVENT_LOGGING_WIFI_FAILED,
 			       pdTRUE, pdFALSE, portMAX_DELAY);
-    if (bits & EVENT_WIFI_CONNECTED) {
+    if (bits & EVENT_LOGGING_WIFI_CONNECTED) {
       if (fd_socket == -1) {
 	ESP_LOGI(LOG_TAG, "Wifi up, starting UDP logging");
 	start_udp_logging();
+	if (udp_logging_live) {
+	  xEventGroupSetBits(mc_task_args->mc_event_group, EVENT_HEALTH_LOGGING);
+	}
       } else {
 	ESP_LOGE(LOG_TAG, "Wifi up, but looks like UDP logging is already enabled");
       }
-    } else if (bits & EVENT_WIFI_FAILED) {
+    } else if (bits & EVENT_LOGGING_WIFI_FAILED) {
       if (fd_socket == -1) {
 	ESP_LOGE(LOG_TAG, "Wifi down, but looks like UDP logging is already disabled");
       } else {
@@ -1,15 +1,228 @@
 #include <stdio.h>
+#include <string.h>
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "lwip/inet.h"
+#include "ping/ping_sock.h"
 #include "mc.h"
 
 static char const *LOG_TAG = "mc|wifi";
 static BaseType_t wifi_connect_retry = 0;
+static esp_netif_t *wifi_netif = NULL;
+
+/* Power save profiles. Modem sleep lets the AP hold frames for the station
+   until it next wakes up for a beacon, which costs up to a few hundred ms
+   on every request that reaches the unit. `auto` turns power save off while
+   the motor runs, when someone may need to stop it in a hurry, and uses
+   max modem sleep while it is idle. The listen interval (in beacon
+   intervals) only applies to max modem sleep, and only takes effect at the
+   next association. */
+static char const *wifi_ps_profile_names[WIFI_PS_PROFILES] = {
+  [WIFI_PS_PROFILE_NONE] = "none",
+  [WIFI_PS_PROFILE_MIN] = "min",
+  [WIFI_PS_PROFILE_MAX] = "max",
+  [WIFI_PS_PROFILE_AUTO] = "auto",
+};
+
+#if defined(CONFIG_WLM_WIFI_PS_NONE)
+static enum wifi_ps_profile_t_ wifi_ps_profile = WIFI_PS_PROFILE_NONE;
+#elif defined(CONFIG_WLM_WIFI_PS_MIN)
+static enum wifi_ps_profile_t_ wifi_ps_profile = WIFI_PS_PROFILE_MIN;
+#elif defined(CONFIG_WLM_WIFI_PS_MAX)
+static enum wifi_ps_profile_t_ wifi_ps_profile = WIFI_PS_PROFILE_MAX;
+#else
+static enum wifi_ps_profile_t_ wifi_ps_profile = WIFI_PS_PROFILE_AUTO;
+#endif
+static bool wifi_ps_motor_is_running = false;
+static bool wifi_started = false;
+static enum wifi_ps_profile_t_ wifi_ps_applied = WIFI_PS_PROFILES; /* none yet */
+static portMUX_TYPE wifi_ps_lock = portMUX_INITIALIZER_UNLOCKED;
+/* Held across each apply, so that two callers cannot set the power save in
+   the opposite order from the one they read the target in */
+static SemaphoreHandle_t wifi_ps_apply_lock = NULL;
+static StaticSemaphore_t wifi_ps_apply_lock_buf;
+
+/* Bring esp_wifi_set_ps() in line with the profile and the motor state. The
+   profile is only recorded as applied once it is, so that a failed attempt
+   is retried the next time round. */
+static void apply_ps_profile (void) {
+  enum wifi_ps_profile_t_ target;
+  wifi_ps_type_t ps_type;
+  bool changed;
+
+  if (!wifi_ps_apply_lock) {
+    /* start_wifi() applies it */
+    return;
+  }
+  xSemaphoreTake(wifi_ps_apply_lock, portMAX_DELAY);
+  taskENTER_CRITICAL(&wifi_ps_lock);
+  target = wifi_ps_profile;
+  if (target == WIFI_PS_PROFILE_AUTO) {
+    target = wifi_ps_motor_is_running ? WIFI_PS_PROFILE_NONE : WIFI_PS_PROFILE_MAX;
+  }
+  changed = wifi_started && (target != wifi_ps_applied);
+  taskEXIT_CRITICAL(&wifi_ps_lock);
+
+  if (changed) {
+    switch (target) {
+    case WIFI_PS_PROFILE_MIN:
+      ps_type = WIFI_PS_MIN_MODEM;
+      break;
+    case WIFI_PS_PROFILE_MAX:
+      ps_type = WIFI_PS_MAX_MODEM;
+      break;
+    default:
+      ps_type = WIFI_PS_NONE;
+      break;
+    }
+    if (esp_wifi_set_ps(ps_type) != ESP_OK) {
+      ESP_LOGE(LOG_TAG, "Unable to set power save to %s", wifi_ps_profile_names[target]);
+    } else {
+      taskENTER_CRITICAL(&wifi_ps_lock);
+      wifi_ps_applied = target;
+      taskEXIT_CRITICAL(&wifi_ps_lock);
+      ESP_LOGI(LOG_TAG, "Power save %s", wifi_ps_profile_names[target]);
+    }
+  }
+  xSemaphoreGive(wifi_ps_apply_lock);
+}
+
+/* Called by the motor task when the motor starts or stops */
+void wifi_ps_motor_running (bool running) {
+  taskENTER_CRITICAL(&wifi_ps_lock);
+  wifi_ps_motor_is_running = running;
+  taskEXIT_CRITICAL(&wifi_ps_lock);
+  apply_ps_profile();
+}
+
+bool wifi_ps_set_profile (enum wifi_ps_profile_t_ profile) {
+  if (profile >= WIFI_PS_PROFILES) {
+    return false;
+  }
+  taskENTER_CRITICAL(&wifi_ps_lock);
+  wifi_ps_profile = profile;
+  taskEXIT_CRITICAL(&wifi_ps_lock);
+  apply_ps_profile();
+  return true;
+}
+
+/* wifi-ps=none|min|max|auto */
+bool wifi_ps_command (char const *arg) {
+  enum wifi_ps_profile_t_ profile;
+
+  for (profile = 0; profile < WIFI_PS_PROFILES; profile++) {
+    if (strcmp(arg, wifi_ps_profile_names[profile]) == 0) {
+      ESP_LOGI(LOG_TAG, "Power save profile %s", arg);
+      return wifi_ps_set_profile(profile);
+    }
+  }
+  ESP_LOGE(LOG_TAG, "Unknown power save profile \"%s\"", arg);
+  return false;
+}
+
+/* The selected profile and the one in effect (they differ for auto) */
+enum wifi_ps_profile_t_ wifi_ps_get_profile (enum wifi_ps_profile_t_ *applied) {
+  enum wifi_ps_profile_t_ profile;
+
+  taskENTER_CRITICAL(&wifi_ps_lock);
+  profile = wifi_ps_profile;
+  if (applied) {
+    *applied = wifi_ps_applied;
+  }
+  taskEXIT_CRITICAL(&wifi_ps_lock);
+  return profile;
+}
+
+char const *wifi_ps_profile_name (enum wifi_ps_profile_t_ profile) {
+  return (profile < WIFI_PS_PROFILES) ? wifi_ps_profile_names[profile] : "unset";
+}
+
+/* Round trip probe: `count` pings to the gateway, `interval_ms` apart. The
+   interval should be longer than the DTIM period, so that the station is
+   back asleep (under power save) when each ping goes out. This measures
+   the path out of the unit and back; traffic that starts elsewhere (e.g. a
+   POST to /mc_ctrl) also waits for the station to wake up, and
+   tools/http_bench.py --wifi-ps measures that. */
+struct rtt_probe_t_ {
+  struct wifi_rtt_result_t_ *result;
+  SemaphoreHandle_t done;
+};
+
+static void rtt_probe_success (esp_ping_handle_t ping, void *arg) {
+  struct rtt_probe_t_ *probe = (struct rtt_probe_t_ *) arg;
+  uint32_t elapsed_ms;
+
+  esp_ping_get_profile(ping, ESP_PING_PROF_TIMEGAP, &elapsed_ms, sizeof(elapsed_ms));
+  if ((probe->result->received == 0) || (elapsed_ms < probe->result->min_ms)) {
+    probe->result->min_ms = elapsed_ms;
+  }
+  if (elapsed_ms > probe->result->max_ms) {
+    probe->result->max_ms = elapsed_ms;
+  }
+  probe->result->total_ms += elapsed_ms;
+  probe->result->received++;
+}
+
+static void rtt_probe_end (esp_ping_handle_t ping, void *arg) {
+  struct rtt_probe_t_ *probe = (struct rtt_probe_t_ *) arg;
+
+  esp_ping_get_profile(ping, ESP_PING_PROF_REQUEST, &probe->result->sent,
+		       sizeof(probe->result->sent));
+  xSemaphoreGive(probe->done);
+}
+
+bool wifi_rtt_probe (uint32_t count, uint32_t interval_ms,
+		     struct wifi_rtt_result_t_ *result) {
+  esp_ping_config_t ping_config = ESP_PING_DEFAULT_CONFIG();
+  esp_ping_callbacks_t callbacks = {
+    .on_ping_success = rtt_probe_success,
+    .on_ping_end = rtt_probe_end,
+  };
+  esp_netif_ip_info_t ip_info;
+  esp_ping_handle_t ping;
+  struct rtt_probe_t_ probe;
+  bool ok;
+
+  memset(result, 0, sizeof(*result));
+  if (!wifi_netif || (esp_netif_get_ip_info(wifi_netif, &ip_info) != ESP_OK) ||
+      (ip_info.gw.addr == 0)) {
+    ESP_LOGE(LOG_TAG, "No gateway to probe");
+    return false;
+  }
+
+  probe.result = result;
+  probe.done = xSemaphoreCreateBinary();
+  if (!probe.done) {
+    return false;
+  }
+  ping_config.target_addr.type = IPADDR_TYPE_V4;
+  ip_2_ip4(&ping_config.target_addr)->addr = ip_info.gw.addr;
+  ping_config.count = count;
+  ping_config.interval_ms = interval_ms;
+  ping_config.timeout_ms = 1000;
+  ping_config.task_prio = MC_PRIO_HTTP_WORKER;
+  callbacks.cb_args = &probe;
+  if (esp_ping_new_session(&ping_config, &callbacks, &ping) != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Unable to start the ping session");
+    vSemaphoreDelete(probe.done);
+    return false;
+  }
+  esp_ping_start(ping);
+  ok = (pdTRUE == xSemaphoreTake(probe.done,
+				 pdMS_TO_TICKS(count * (interval_ms + 1000) + 1000)));
+  if (!ok) {
+    ESP_LOGE(LOG_TAG, "Ping session did not finish");
+    esp_ping_stop(ping);
+  }
+  esp_ping_delete_session(ping);
+  vSemaphoreDelete(probe.done);
+  return ok;
+}
 
 static void wifi_event_handler (void* arg, esp_event_base_t event_base,
 				int32_t event_id, void* event_data) {
@@ -19,19 +232,24 @@ static void wifi_event_handler (void* arg, esp_event_base_t event_base,
     ESP_LOGI(LOG_TAG, "WIFI_EVENT_STA_START, invoking esp_wifi_connect()");
     esp_wifi_connect();
   } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    status_set(STATUS_WIFI_DOWN, true);
     if (wifi_connect_retry < 3) {
       ESP_LOGI(LOG_TAG, "disconnected, will retry (%d)", wifi_connect_retry);
       esp_wifi_connect();
       wifi_connect_retry++;
     } else {
-      xEventGroupSetBits(mc_event_group, EVENT_WIFI_FAILED);
+      xEventGroupSetBits(mc_event_group, EVENT_WIFI_FAILED | EVENT_MQTT_WIFI_FAILED |
+			 EVENT_LOGGING_WIFI_FAILED);
       ESP_LOGI(LOG_TAG, "connection to the AP failed");
     }
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
     ESP_LOGI(LOG_TAG, "connected, got ip:" IPSTR, IP2STR(&event->ip_info.ip));
     wifi_connect_retry = 0;
-    xEventGroupSetBits(mc_event_group, EVENT_WIFI_CONNECTED);
+    status_set(STATUS_WIFI_DOWN, false);
+    xEventGroupSetBits(mc_event_group, EVENT_WIFI_CONNECTED | EVENT_MQTT_WIFI_CONNECTED |
+		       EVENT_LOGGING_WIFI_CONNECTED | EVENT_HEALTH_WIFI);
+    beacon_notify();
   }
 }
 
@@ -42,13 +260,17 @@ void start_wifi (EventGroupHandle_t mc_event_group) {
   wifi_config_t wifi_config = {
     .sta = {
       .ssid = CONFIG_WLM_WIFI_SSID,
-      .password = CONFIG_WLM_WIFI_PASSWORD
+      .password = CONFIG_WLM_WIFI_PASSWORD,
+      .listen_interval = CONFIG_WLM_WIFI_LISTEN_INTERVAL,
     },
   };
 
+  /* Down until we get an IP */
+  status_set(STATUS_WIFI_DOWN, true);
+
   ESP_ERROR_CHECK(esp_netif_init());
 
-  esp_netif_create_default_wifi_sta();
+  wifi_netif = esp_netif_create_default_wifi_sta();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
   ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
@@ -63,6 +285,11 @@ void start_wifi (EventGroupHandle_t mc_event_group) {
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
   ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
   ESP_ERROR_CHECK(esp_wifi_start());
+  wifi_ps_apply_lock = xSemaphoreCreateMutexStatic(&wifi_ps_apply_lock_buf);
+  taskENTER_CRITICAL(&wifi_ps_lock);
+  wifi_started = true;
+  taskEXIT_CRITICAL(&wifi_ps_lock);
+  apply_ps_profile();
 
   ESP_LOGI(LOG_TAG, "start_wifi finished.");
 }
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""Listen for the status beacons of mc units and show the whole fleet.
+
+Every unit multicasts a small binary beacon (main/beacon.c) periodically and
+whenever its motor, tank or beep state changes. This joins the multicast
+group and keeps a table with the latest beacon of each unit, so one packet
+per unit replaces polling /mc_status over HTTP. A unit that has not been
+heard from for --stale seconds is shown as gone; gaps in a unit's sequence
+numbers are counted as lost beacons.
+
+Examples:
+    tools/beacon_listener.py
+    tools/beacon_listener.py --stale 120 --interval 10
+    tools/beacon_listener.py --json >> beacons.jsonl
+
+With --json, every beacon is printed as one JSON line instead of the table,
+for feeding into other monitoring.
+"""
+
+import argparse
+import json
+import socket
+import struct
+import sys
+import time
+
+# Mirrors struct beacon_t_ in main/beacon.c (version 1, little endian)
+BEACON_FORMAT = "<2sBB6sH16sIbBIIIIII"
+BEACON_SIZE = struct.calcsize(BEACON_FORMAT)
+BEACON_MAGIC = b"MB"
+BEACON_VERSION = 1
+
+STATE_BITS = {0x01: "motor", 0x02: "full", 0x04: "beep"}
+
+# enum status_code_t_ in main/mc.h
+STATUS_BITS = {
+    0: "wifi_down",
+    1: "ota",
+    2: "sensor_fault",
+    3: "booting",
+    4: "fault",
+}
+
+
+def bits(value, names):
+    return [name for bit, name in sorted(names.items()) if value & bit]
+
+
+def parse(data):
+    """Return the beacon as a dict, or None if it is not one we understand.
+    Fields appended to this version are skipped; any other version has a
+    different layout (see main/beacon.c) and is not read."""
+    if len(data) < 3 or data[:2] != BEACON_MAGIC:
+        return None
+    if data[2] != BEACON_VERSION or len(data) < BEACON_SIZE:
+        return None
+    (_, version, state, unit_id, seq, firmware, uptime_s, rssi, status,
+     free_heap, min_free_heap, motor_on_s, motor_off_s, tank_full_s,
+     epoch) = struct.unpack_from(BEACON_FORMAT, data)
+    return {
+        "unit": ":".join("%02x" % b for b in unit_id),
+        "version": version,
+        "seq": seq,
+        "firmware": firmware.split(b"\0", 1)[0].decode(errors="replace"),
+        "state": bits(state, STATE_BITS),
+        "status": [name for bit, name in sorted(STATUS_BITS.items())
+                   if status & (1 << bit)],
+        "uptime_s": uptime_s,
+        "rssi": rssi,
+        "free_heap": free_heap,
+        "min_free_heap": min_free_heap,
+        "motor_on_s": motor_on_s,
+        "motor_off_s": motor_off_s,
+        "tank_full_s": tank_full_s,
+        "epoch": epoch,
+    }
+
+
+def ago(beacon, event_s):
+    """Time since an event, from the uptime stamps in the beacon."""
+    if not event_s:
+        return "-"
+    seconds = beacon["uptime_s"] - event_s
+    if seconds < 120:
+        return "%ds" % seconds
+    if seconds < 7200:
+        return "%dm" % (seconds // 60)
+    return "%dh" % (seconds // 3600)
+
+
+def open_socket(group, port, interface):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if hasattr(socket, "SO_REUSEPORT"):
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+    sock.bind(("", port))
+    membership = socket.inet_aton(group) + socket.inet_aton(interface)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+    return sock
+
+
+class Fleet:
+    def __init__(self):
+        self.units = {}
+
+    def update(self, beacon, address, now):
+        unit = self.units.setdefault(beacon["unit"], {"received": 0, "lost": 0})
+        last = unit.get("beacon")
+        if last is not None:
+            if beacon["uptime_s"] < last["uptime_s"]:
+                unit["restarts"] = unit.get("restarts", 0) + 1
+            else:
+                unit["lost"] += (beacon["seq"] - last["seq"] - 1) % 65536
+        unit.update(beacon=beacon, address=address, heard=now)
+        unit["received"] += 1
+
+    def print_table(self, now, stale):
+        print("\n%s  %d units" % (time.strftime("%H:%M:%S"), len(self.units)))
+        print("%-17s %-15s %-8s %-16s %6s %4s %7s %5s %5s %5s %6s  %s" % (
+            "unit", "address", "fw", "state", "uptime", "rssi", "heap",
+            "on", "off", "full", "lost", "status"))
+        for name in sorted(self.units):
+            unit = self.units[name]
+            beacon = unit["beacon"]
+            gone = now - unit["heard"] > stale
+            print("%-17s %-15s %-8s %-16s %5dm %4d %7d %5s %5s %5s %6d  %s" % (
+                name, unit["address"], beacon["firmware"][:8],
+                "GONE" if gone else ",".join(beacon["state"]) or "idle",
+                beacon["uptime_s"] // 60, beacon["rssi"], beacon["free_heap"],
+                ago(beacon, beacon["motor_on_s"]),
+                ago(beacon, beacon["motor_off_s"]),
+                ago(beacon, beacon["tank_full_s"]),
+                unit["lost"], ",".join(beacon["status"])))
+        sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--group", default="239.255.77.67",
+                        help="multicast group (CONFIG_WLM_BEACON_IPV4_ADDRESS)")
+    parser.add_argument("--port", type=int, default=18371,
+                        help="port (CONFIG_WLM_BEACON_PORT)")
+    parser.add_argument("--interface", default="0.0.0.0",
+                        help="address of the local interface to listen on")
+    parser.add_argument("--stale", type=float, default=100,
+                        help="seconds without a beacon before a unit is gone "
+                             "(a few CONFIG_WLM_BEACON_PERIOD_S)")
+    parser.add_argument("--interval", type=float, default=5,
+                        help="seconds between table refreshes")
+    parser.add_argument("--json", action="store_true",
+                        help="print each beacon as a JSON line instead")
+    args = parser.parse_args()
+
+    sock = open_socket(args.group, args.port, args.interface)
+    sock.settimeout(1.0)
+    fleet = Fleet()
+    next_print = time.monotonic() + args.interval
+    while True:
+        try:
+            data, (address, _) = sock.recvfrom(1500)
+        except socket.timeout:
+            data = None
+        except KeyboardInterrupt:
+            return 0
+        now = time.monotonic()
+        if data:
+            beacon = parse(data)
+            if beacon is None:
+                continue
+            fleet.update(beacon, address, now)
+            if args.json:
+                print(json.dumps(dict(beacon, address=address,
+                                      received=time.time())))
+                sys.stdout.flush()
+        if not args.json and now >= next_print:
+            fleet.print_table(now, args.stale)
+            next_print = now + args.interval
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""Side by side comparison of two /mc_bench reports.
+
+Each report is the body of GET /mc_bench (or the "mc|bench" lines of the
+boot log with the log prefix stripped) from one build, e.g. the -Os and the
+-O2 builds described under "Benchmarks" in README.md. Cycle counts are
+compared rather than times, so a run at a different CPU clock still lines
+up.
+
+Examples:
+    curl -s http://192.168.29.9/mc_bench > bench-os.txt
+    (flash the -O2 build)
+    curl -s http://192.168.29.9/mc_bench > bench-o2.txt
+    tools/bench_compare.py bench-os.txt bench-o2.txt
+"""
+
+import argparse
+import sys
+
+FIELDS = ("min_cycles", "median_cycles", "max_cycles")
+
+
+def parse_report(path):
+    header = {}
+    cases = {}
+    with open(path) as f:
+        for line in f:
+            words = line.split()
+            if not words:
+                continue
+            if words[0].startswith("build="):
+                header = dict(w.split("=", 1) for w in words)
+                continue
+            values = dict(w.split("=", 1) for w in words[1:] if "=" in w)
+            cases[words[0]] = values
+    return header, cases
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("base", help="report of the reference build")
+    parser.add_argument("other", help="report of the build to compare")
+    args = parser.parse_args()
+
+    base_header, base = parse_report(args.base)
+    other_header, other = parse_report(args.other)
+    print("%-24s %s  vs  %s" % ("", base_header.get("build", args.base),
+                                other_header.get("build", args.other)))
+    for name in base:
+        if name not in other:
+            continue
+        if any(f not in base[name] or f not in other[name] for f in FIELDS):
+            print("%-24s skipped" % name)
+            continue
+        columns = []
+        for field in FIELDS:
+            b = int(base[name][field])
+            o = int(other[name][field])
+            ratio = (o / b) if b else 0.0
+            columns.append("%s %8d %8d %5.2fx" % (field.split("_")[0], b, o, ratio))
+        print("%-24s %s" % (name, "   ".join(columns)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,295 @@
+/* Run the tank level control path of the firmware on the host, against the
+   mock I/O backend (main/io_mock.c) and the tank-full filter
+   (main/tank_filter.c), and time it.
+
+   Build and run on the host:
+     cc -O2 -Wall -Itools/host -Imain -o control_host tools/control_host.c \
+	main/io_mock.c main/tank_filter.c
+     ./control_host
+     ./control_host -n 1000000
+
+   tools/host has just enough of sdkconfig.h and FreeRTOS for io_mock.c; the
+   tick is the one this program keeps.
+
+   The checks: the outputs start as io.c leaves them at boot, a snapshot
+   does not change within a tick and follows the inputs at the next one,
+   and in a few simulated motor runs (the probe going full cleanly, with
+   noise, or never) the motor is turned off through the I/O layer at the
+   same reading as the filter decides when fed the probe levels directly.
+   The exit status is 1 if any of them failed.
+
+   The benchmark times io_snapshot() within a tick and across ticks,
+   io_set(), and one probe reading of the control loop (snapshot, filter,
+   output), -n times each, and prints the min, median and max of the time
+   per call over batches of 1000 calls. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "io.h"
+#include "tank_filter.h"
+
+#define TICK_MS 10			/* CONFIG_FREERTOS_HZ=100 */
+#define SAMPLE_PERIOD_MS 1000		/* as in oh_tank_level.c */
+#define PROBE_SETTLE_MS 500
+#define MAX_READINGS 600		/* a 10 minute run */
+#define BENCH_BATCH 1000
+#define BENCH_MAX_BATCHES 10000
+
+static TickType_t host_tick = 0;
+static unsigned int failures = 0;
+
+TickType_t xTaskGetTickCount (void) {
+  return host_tick;
+}
+
+static void usage (char const *prog) {
+  fprintf(stderr, "usage: %s [-n calls]\n", prog);
+  exit(2);
+}
+
+static void check (bool ok, char const *what) {
+  if (!ok) {
+    printf("FAIL %s\n", what);
+    failures++;
+  }
+}
+
+static void advance_ms (uint32_t ms) {
+  host_tick += ms / TICK_MS;
+}
+
+/* The motor: runs while the active low relay is out of its Normal state,
+   and the running sense follows it */
+static void motor_plant (void) {
+  io_mock_set_input(IO_MOTOR_RUNNING_SENSE, !io_mock_get_output(IO_MOTOR));
+}
+
+static void toggle_motor_relay (void) {
+  io_set(IO_MOTOR, !io_mock_get_output(IO_MOTOR));
+}
+
+static void check_boot (void) {
+  io_init();
+  check(io_mock_get_output(IO_MOTOR) == 1, "boot: motor relay in its Normal state");
+  check(io_mock_get_output(IO_BEEP) == 0, "boot: beep off");
+  check(io_mock_get_output(IO_ERR_STATUS) == 0, "boot: err/status off");
+  check(io_mock_get_output(IO_WATER_LEVEL_ENABLE) == 0, "boot: probe off");
+  printf("ok   boot\n");
+}
+
+static void check_snapshot (void) {
+  struct io_snapshot_t_ first, second;
+  unsigned int before = failures;
+
+  advance_ms(TICK_MS);
+  io_mock_set_input(IO_WATER_LEVEL, 0);
+  io_snapshot(&first);
+  io_mock_set_input(IO_WATER_LEVEL, 1);
+  io_snapshot(&second);
+  check((second.seq == first.seq) && (second.inputs == first.inputs) &&
+	!IO_LEVEL(&second, IO_WATER_LEVEL), "snapshot: same within a tick");
+  advance_ms(TICK_MS);
+  io_snapshot(&second);
+  check((second.seq == first.seq + 1) && IO_LEVEL(&second, IO_WATER_LEVEL) &&
+	(second.tick == first.tick + 1), "snapshot: new at the next tick");
+  io_mock_set_input(IO_WATER_LEVEL, 0);
+  if (failures == before) {
+    printf("ok   snapshot\n");
+  }
+}
+
+/* One motor run. The probe reads levels[i] at reading i; returns the
+   reading the motor was turned off at, or -1. Also feeds the same levels to
+   a filter directly, into `*reference`. */
+static int run_motor (char const *scenario, bool const *levels, int readings,
+		      int *reference) {
+  struct tank_filter_config_t_ config = TANK_FILTER_DEFAULT_CONFIG;
+  struct tank_filter_t_ filter, direct;
+  struct io_snapshot_t_ inputs;
+  unsigned int actions;
+  int i, off_at = -1;
+
+  tank_filter_init(&filter, &config);
+  tank_filter_init(&direct, &config);
+  *reference = -1;
+  for (i = 0; i < readings; i++) {
+    if ((*reference < 0) && (tank_filter_sample(&direct, levels[i]) & TANK_FILTER_MOTOR_OFF)) {
+      *reference = i;
+    }
+  }
+
+  toggle_motor_relay();
+  advance_ms(TICK_MS);
+  motor_plant();
+  for (i = 0; i < readings; i++) {
+    /* As oh_tank_level_task: sleep, check the motor runs, power the probe,
+       let it settle, read it, power it off */
+    advance_ms(SAMPLE_PERIOD_MS - PROBE_SETTLE_MS);
+    motor_plant();
+    io_snapshot(&inputs);
+    if (!IO_LEVEL(&inputs, IO_MOTOR_RUNNING_SENSE)) {
+      break;
+    }
+    io_set(IO_WATER_LEVEL_ENABLE, 1);
+    io_mock_set_input(IO_WATER_LEVEL, levels[i]);
+    advance_ms(PROBE_SETTLE_MS);
+    io_snapshot(&inputs);
+    io_set(IO_WATER_LEVEL_ENABLE, 0);
+    io_mock_set_input(IO_WATER_LEVEL, 0);
+    actions = tank_filter_sample(&filter, IO_LEVEL(&inputs, IO_WATER_LEVEL));
+    if (actions & TANK_FILTER_MOTOR_OFF) {
+      toggle_motor_relay();
+      off_at = i;
+    }
+  }
+  if (off_at < 0) {
+    /* Nobody else turns it off here */
+    toggle_motor_relay();
+  }
+  advance_ms(TICK_MS);
+  motor_plant();
+  io_snapshot(&inputs);
+
+  if ((off_at != *reference) || IO_LEVEL(&inputs, IO_MOTOR_RUNNING_SENSE) ||
+      (io_mock_get_output(IO_MOTOR) != 1) || io_mock_get_output(IO_WATER_LEVEL_ENABLE)) {
+    printf("FAIL %s: motor off at reading %d, the filter says %d\n", scenario, off_at,
+	   *reference);
+    failures++;
+  } else {
+    printf("ok   %s: motor off at reading %d\n", scenario, off_at);
+  }
+  return off_at;
+}
+
+static void check_runs (void) {
+  static bool levels[MAX_READINGS];
+  int i, reference;
+
+  /* Fills in 5 minutes, and reads full from then on */
+  for (i = 0; i < MAX_READINGS; i++) {
+    levels[i] = (i >= 300);
+  }
+  run_motor("clean fill", levels, MAX_READINGS, &reference);
+
+  /* The probe flickers: a spurious full now and then before, misses after */
+  for (i = 0; i < MAX_READINGS; i++) {
+    levels[i] = (i >= 300) ? ((i % 4) != 1) : ((i % 37) == 0);
+  }
+  run_motor("noisy fill", levels, MAX_READINGS, &reference);
+
+  /* The probe never reads full */
+  memset(levels, 0, sizeof(levels));
+  run_motor("no full reading", levels, MAX_READINGS, &reference);
+}
+
+static uint64_t now_ns (void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_double (void const *a, void const *b) {
+  double x = *(double const *) a, y = *(double const *) b;
+
+  return (x > y) - (x < y);
+}
+
+enum bench_case_t_ {
+  BENCH_SNAPSHOT_SAME_TICK,
+  BENCH_SNAPSHOT_NEW_TICK,
+  BENCH_SET,
+  BENCH_PROBE_READING,
+  BENCH_CASES
+};
+
+static char const *bench_names[BENCH_CASES] = {
+  [BENCH_SNAPSHOT_SAME_TICK] = "io_snapshot_same_tick",
+  [BENCH_SNAPSHOT_NEW_TICK] = "io_snapshot_new_tick",
+  [BENCH_SET] = "io_set",
+  [BENCH_PROBE_READING] = "probe_reading",
+};
+
+static void bench (unsigned long calls) {
+  static double per_call_ns[BENCH_MAX_BATCHES];
+  struct tank_filter_config_t_ config = TANK_FILTER_DEFAULT_CONFIG;
+  struct tank_filter_t_ filter;
+  struct io_snapshot_t_ inputs;
+  volatile uint32_t sink = 0;
+  unsigned long batches = calls / BENCH_BATCH, b, i;
+  uint64_t start;
+  int c;
+
+  if (batches == 0) {
+    batches = 1;
+  } else if (batches > BENCH_MAX_BATCHES) {
+    batches = BENCH_MAX_BATCHES;
+  }
+  tank_filter_init(&filter, &config);
+  printf("build=host batches=%lu calls_per_batch=%d\n", batches, BENCH_BATCH);
+  for (c = 0; c < BENCH_CASES; c++) {
+    for (b = 0; b < batches; b++) {
+      start = now_ns();
+      for (i = 0; i < BENCH_BATCH; i++) {
+	switch (c) {
+	case BENCH_SNAPSHOT_SAME_TICK:
+	  io_snapshot(&inputs);
+	  sink += inputs.inputs;
+	  break;
+	case BENCH_SNAPSHOT_NEW_TICK:
+	  host_tick++;
+	  io_snapshot(&inputs);
+	  sink += inputs.inputs;
+	  break;
+	case BENCH_SET:
+	  io_set(IO_WATER_LEVEL_ENABLE, i & 1);
+	  break;
+	case BENCH_PROBE_READING:
+	  host_tick++;
+	  io_mock_set_input(IO_WATER_LEVEL, i & 1);
+	  io_snapshot(&inputs);
+	  if (tank_filter_sample(&filter, IO_LEVEL(&inputs, IO_WATER_LEVEL)) &
+	      TANK_FILTER_MOTOR_OFF) {
+	    io_set(IO_MOTOR, 1);
+	  }
+	  break;
+	}
+      }
+      per_call_ns[b] = (double) (now_ns() - start) / BENCH_BATCH;
+    }
+    qsort(per_call_ns, batches, sizeof(per_call_ns[0]), compare_double);
+    printf("%s min_ns=%.1f median_ns=%.1f max_ns=%.1f\n", bench_names[c],
+	   per_call_ns[0], per_call_ns[batches / 2], per_call_ns[batches - 1]);
+  }
+  (void) sink;
+}
+
+int main (int argc, char **argv) {
+  unsigned long calls = 100000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n':
+      calls = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc) {
+    usage(argv[0]);
+  }
+
+  check_boot();
+  check_snapshot();
+  check_runs();
+  printf("%u failures\n", failures);
+  bench(calls);
+  return failures ? 1 : 0;
+}
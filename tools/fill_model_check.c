@@ -0,0 +1,328 @@
+/* Run the fill time model of the tank level task (main/fill_model.c) on the
+   host through a few series of motor runs, read the way oh_tank_level.c
+   reads the probe, and check what it learns and plans.
+
+   Build and run on the host:
+     cc -O2 -Wall -Imain -o fill_model_check tools/fill_model_check.c \
+	main/fill_model.c -lm
+     ./fill_model_check
+     ./fill_model_check -s 12345
+
+   The configuration is the sdkconfig default (3 fills to learn, 20 weighed
+   in, a reading every 15 s in the slow phase, fast 60 s ahead, 3600 s at
+   most). -s seeds the fill times of the noisy series.
+
+   The checks:
+   - clean fill: fills that all take 600 s. Until the model is learned, the
+     probe is read every second and the cutoff is the maximum run time;
+     after, the mean is 600 s, fast reading starts at 540 s, the cutoff is
+     1.5 times the mean, the tank full is seen as soon as it is reached, and
+     far fewer readings are taken per run.
+   - noisy fill: fill times spread around 600 s. The mean and standard
+     deviation follow those of the fills, no fill ends before fast reading
+     starts or runs into the cutoff, and the cutoff lies between 1.5 times
+     the mean and the maximum run time.
+   - stalled fill: the probe never reads full (or the supply runs dry). The
+     run is cut off at the cutoff, well short of the maximum run time, and
+     is not learned.
+   - partial fill: the tank was not empty at the start. The full reading in
+     the slow phase is at most one slow period late, and is not learned.
+   - drift: the fill time changes for good, and the model follows it.
+   - restore: stats that do not look right are refused.
+   The exit status is 1 if any of them failed. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fill_model.h"
+
+#define MIN_RUNS 3			/* CONFIG_WLM_FILL_MODEL_MIN_RUNS */
+#define MAX_RUNS 20			/* CONFIG_WLM_FILL_MODEL_MAX_RUNS */
+#define SLOW_PERIOD_S 15		/* CONFIG_WLM_FILL_SLOW_PERIOD_S */
+#define FAST_LEAD_S 60			/* CONFIG_WLM_FILL_FAST_LEAD_S */
+#define MAX_RUNTIME_S 3600		/* CONFIG_WLM_FILL_MAX_RUNTIME_S */
+#define NEVER_FULL UINT32_MAX
+
+struct run_t_ {
+  uint32_t off_s;			/* when the motor was turned off */
+  uint32_t reads;			/* probe readings taken */
+  bool cut_off;
+  bool learned;
+};
+
+static unsigned int failures = 0;
+static unsigned long rng_state = 1;
+
+static void usage (char const *prog) {
+  fprintf(stderr, "usage: %s [-s seed]\n", prog);
+  exit(2);
+}
+
+static void check (bool ok, char const *what) {
+  if (!ok) {
+    printf("FAIL %s\n", what);
+    failures++;
+  }
+}
+
+static void report (char const *scenario, unsigned int before,
+		    struct fill_model_t_ const *model) {
+  printf("%s %s: runs=%lu mean_s=%.1f stddev_s=%.1f fast_after_s=%lu cutoff_s=%lu\n",
+	 (failures == before) ? "ok  " : "FAIL", scenario,
+	 (unsigned long) model->stats.runs, model->stats.mean_s,
+	 fill_model_stddev_s(model), (unsigned long) fill_model_fast_after_s(model),
+	 (unsigned long) fill_model_cutoff_s(model));
+}
+
+/* A uniform pseudo random number in [0, 1) */
+static double uniform (void) {
+  rng_state = rng_state * 1103515245 + 12345;
+  return (double) ((rng_state >> 16) & 0x7fff) / 0x8000;
+}
+
+static void init_model (struct fill_model_t_ *model) {
+  struct fill_model_config_t_ config = {
+    .min_runs = MIN_RUNS,
+    .max_runs = MAX_RUNS,
+    .slow_period_s = SLOW_PERIOD_S,
+    .fast_lead_s = FAST_LEAD_S,
+    .max_runtime_s = MAX_RUNTIME_S,
+  };
+
+  if (!fill_model_init(model, &config)) {
+    printf("FAIL init: configuration refused\n");
+    exit(1);
+  }
+}
+
+/* One motor run, the tank reading full from `full_s` into it. As
+   oh_tank_level_task, once a second: cut off at the cutoff, read the probe
+   every slow period until the fast phase (or a full reading), every second
+   from then on. The motor is turned off at the first full reading (the
+   filter's own delay is the same whatever the model does), and the fill
+   learned then. */
+static struct run_t_ run_motor (struct fill_model_t_ *model, uint32_t full_s) {
+  struct run_t_ run = { 0 };
+  uint32_t fast_after_s = fill_model_fast_after_s(model);
+  uint32_t cutoff_s = fill_model_cutoff_s(model);
+  uint32_t run_s, last_read_s = 0;
+  bool fast_sampling = (fast_after_s == 0), read_once = false;
+
+  for (run_s = 0; ; run_s++) {
+    if (run_s >= cutoff_s) {
+      run.off_s = run_s;
+      run.cut_off = true;
+      return run;
+    }
+    if (!fast_sampling) {
+      if (run_s >= fast_after_s) {
+	fast_sampling = true;
+      } else if (read_once && (run_s - last_read_s < SLOW_PERIOD_S)) {
+	continue;
+      }
+    }
+    last_read_s = run_s;
+    read_once = true;
+    run.reads++;
+    if (run_s >= full_s) {
+      run.off_s = run_s;
+      run.learned = fill_model_learn(model, run_s);
+      return run;
+    }
+  }
+}
+
+static void check_clean_fill (void) {
+  struct fill_model_t_ model;
+  struct run_t_ run, first = { 0 };
+  unsigned int before = failures, i;
+
+  init_model(&model);
+  for (i = 0; i < MIN_RUNS; i++) {
+    check((fill_model_fast_after_s(&model) == 0) &&
+	  (fill_model_cutoff_s(&model) == MAX_RUNTIME_S) && !fill_model_learned(&model),
+	  "clean fill: read fast, cutoff at the maximum until learned");
+    run = run_motor(&model, 600);
+    check(run.learned && !run.cut_off && (run.off_s == 600) && (run.reads == 601),
+	  "clean fill: read every second until learned");
+    if (i == 0) {
+      first = run;
+    }
+  }
+  check(fill_model_learned(&model), "clean fill: learned after min_runs fills");
+  for (i = 0; i < 10; i++) {
+    run = run_motor(&model, 600);
+    check(run.learned && !run.cut_off && (run.off_s == 600),
+	  "clean fill: full seen as soon as reached");
+  }
+  check(fabsf(model.stats.mean_s - 600) < 0.01f, "clean fill: mean 600 s");
+  check(fill_model_stddev_s(&model) < 0.01f, "clean fill: no spread");
+  check(fill_model_fast_after_s(&model) == 600 - FAST_LEAD_S,
+	"clean fill: fast reading from 540 s");
+  check(fill_model_cutoff_s(&model) == 900, "clean fill: cutoff at 1.5 times the mean");
+  check(run.reads * 5 < first.reads, "clean fill: a fifth of the readings or fewer");
+  report("clean fill", before, &model);
+  printf("     readings per run: %lu learning, %lu learned\n",
+	 (unsigned long) first.reads, (unsigned long) run.reads);
+}
+
+static void check_noisy_fill (void) {
+  struct fill_model_t_ model;
+  struct run_t_ run;
+  static uint32_t fill_s[MAX_RUNS];
+  double mean = 0, var = 0, u;
+  uint32_t shortest = UINT32_MAX, longest = 0, cutoff_s;
+  unsigned int before = failures, i;
+
+  init_model(&model);
+  /* Roughly normal around 600 s, about 25 s spread (a sum of uniforms) */
+  for (i = 0; i < MAX_RUNS; i++) {
+    u = uniform() + uniform() + uniform() + uniform() - 2;
+    fill_s[i] = (uint32_t) (600 + u * 42);
+    mean += fill_s[i];
+    shortest = (fill_s[i] < shortest) ? fill_s[i] : shortest;
+    longest = (fill_s[i] > longest) ? fill_s[i] : longest;
+  }
+  mean /= MAX_RUNS;
+  for (i = 0; i < MAX_RUNS; i++) {
+    var += (fill_s[i] - mean) * (fill_s[i] - mean);
+  }
+  var /= MAX_RUNS - 1;
+
+  for (i = 0; i < MAX_RUNS; i++) {
+    if (fill_model_learned(&model)) {
+      check(fill_s[i] >= fill_model_fast_after_s(&model),
+	    "noisy fill: fast reading started before the tank full");
+    }
+    run = run_motor(&model, fill_s[i]);
+    check(run.learned && !run.cut_off && (run.off_s == fill_s[i]),
+	  "noisy fill: full seen as soon as reached");
+  }
+  cutoff_s = fill_model_cutoff_s(&model);
+  check(fabs(model.stats.mean_s - mean) < 0.5, "noisy fill: mean of the fills");
+  check(fabs(fill_model_stddev_s(&model) - sqrt(var)) < 0.5,
+	"noisy fill: standard deviation of the fills");
+  check(fill_model_fast_after_s(&model) < shortest, "noisy fill: fast before the shortest fill");
+  check((cutoff_s > longest) && (cutoff_s >= (uint32_t) (model.stats.mean_s * 1.5f)) &&
+	(cutoff_s <= MAX_RUNTIME_S), "noisy fill: cutoff past the longest fill, within bounds");
+  report("noisy fill", before, &model);
+  printf("     fills %lu to %lu s\n", (unsigned long) shortest, (unsigned long) longest);
+}
+
+static void check_stalled_fill (void) {
+  struct fill_model_t_ model, learned;
+  struct run_t_ run;
+  unsigned int before = failures, i;
+
+  init_model(&model);
+  for (i = 0; i < 10; i++) {
+    run_motor(&model, 600);
+  }
+  learned = model;
+
+  run = run_motor(&model, NEVER_FULL);
+  check(run.cut_off && (run.off_s == 900), "stalled fill: cut off at 900 s");
+  check(memcmp(&model.stats, &learned.stats, sizeof(model.stats)) == 0,
+	"stalled fill: not learned");
+
+  /* The supply runs dry for a while: full long after the cutoff */
+  run = run_motor(&model, 2400);
+  check(run.cut_off && (run.off_s == 900), "slow supply: cut off at 900 s");
+
+  /* Not learned yet: only the maximum run time stops it */
+  init_model(&model);
+  run = run_motor(&model, NEVER_FULL);
+  check(run.cut_off && (run.off_s == MAX_RUNTIME_S) && (model.stats.runs == 0),
+	"stalled fill: cut off at the maximum before learning");
+  report("stalled fill", before, &learned);
+}
+
+static void check_partial_fill (void) {
+  struct fill_model_t_ model, learned;
+  struct run_t_ run;
+  unsigned int before = failures, i;
+
+  init_model(&model);
+  for (i = 0; i < 10; i++) {
+    run_motor(&model, 600);
+  }
+  learned = model;
+  run = run_motor(&model, 200);
+  check(!run.cut_off && (run.off_s >= 200) && (run.off_s < 200 + SLOW_PERIOD_S),
+	"partial fill: full seen within a slow period");
+  check(!run.learned && (memcmp(&model.stats, &learned.stats, sizeof(model.stats)) == 0),
+	"partial fill: not learned");
+  report("partial fill", before, &model);
+}
+
+static void check_drift (void) {
+  struct fill_model_t_ model;
+  unsigned int before = failures, i;
+
+  init_model(&model);
+  for (i = 0; i < MAX_RUNS; i++) {
+    run_motor(&model, 600);
+  }
+  /* Lower supply pressure: 700 s from now on. Each fill weighs 1 / 20. */
+  for (i = 0; i < 3 * MAX_RUNS; i++) {
+    check(!run_motor(&model, 700).cut_off, "drift: no cutoff");
+  }
+  check((model.stats.runs == MAX_RUNS) && (fabsf(model.stats.mean_s - 700) < 10),
+	"drift: mean follows the new fill time");
+  report("drift", before, &model);
+}
+
+static void check_restore (void) {
+  struct fill_model_t_ model;
+  struct fill_model_stats_t_ stats = {
+    .version = FILL_MODEL_VERSION, .runs = 5, .mean_s = 600, .m2 = 400,
+  };
+  struct fill_model_stats_t_ bad;
+  unsigned int before = failures;
+
+  init_model(&model);
+  bad = stats;
+  bad.version++;
+  check(!fill_model_restore(&model, &bad), "restore: other version refused");
+  bad = stats;
+  bad.runs = MAX_RUNS + 1;
+  check(!fill_model_restore(&model, &bad), "restore: too many runs refused");
+  bad = stats;
+  bad.mean_s = NAN;
+  check(!fill_model_restore(&model, &bad), "restore: NaN mean refused");
+  bad = stats;
+  bad.m2 = -1;
+  check(!fill_model_restore(&model, &bad), "restore: negative m2 refused");
+  check(model.stats.runs == 0, "restore: model left as it was");
+  check(fill_model_restore(&model, &stats) && (model.stats.runs == 5) &&
+	fabsf(fill_model_stddev_s(&model) - 10) < 0.01f, "restore: good stats taken");
+  report("restore", before, &model);
+}
+
+int main (int argc, char **argv) {
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+    case 's':
+      rng_state = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc) {
+    usage(argv[0]);
+  }
+
+  check_clean_fill();
+  check_noisy_fill();
+  check_stalled_fill();
+  check_partial_fill();
+  check_drift();
+  check_restore();
+  printf("%u failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,17 @@
+#ifndef __HOST_FREERTOS_H__
+#define __HOST_FREERTOS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Just enough of FreeRTOS for main/io_mock.c to build on the host, in
+   tools/control_host.c. That runs in a single thread, so the critical
+   sections have nothing to exclude. */
+typedef uint32_t TickType_t;
+typedef int portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define taskENTER_CRITICAL(mux) ((void) (mux))
+#define taskEXIT_CRITICAL(mux) ((void) (mux))
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __HOST_TASK_H__
+#define __HOST_TASK_H__
+
+#include "freertos/FreeRTOS.h"
+
+/* The tick is whatever the host program says it is */
+extern TickType_t xTaskGetTickCount(void);
+
+#endif
@@ -0,0 +1,2 @@
+/* sdkconfig.h for the host builds of tools/control_host.c: nothing is
+   configured, so optional parts (e.g. CONFIG_WLM_TRACE) are compiled out */
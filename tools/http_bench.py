@@ -0,0 +1,345 @@
+#!/usr/bin/env python3
+"""HTTP load and latency benchmark for the mc web endpoints.
+
+Drives a number of concurrent keep-alive clients against the handlers in
+main/http.c for a fixed duration, then probes how many sockets the server
+will hold open at once. Heap usage is read from /mc_stats before and after
+the run. The result is a single JSON document, so results from different
+firmware versions can be diffed or fed into a regression check.
+
+Examples:
+    tools/http_bench.py 192.168.29.9
+    tools/http_bench.py 192.168.29.9 --clients 8 --duration 30 -o bench.json
+    tools/http_bench.py localhost:8080 --ctrl-body "timeofday=$(date +%s)"
+
+Only use --ctrl-body with harmless commands; `motor=on` would toggle the pump
+for every request.
+
+With --jitter, the tank sampling loop's wakeup jitter counters are reset
+before the run and reported after it, to check that the control loop is not
+disturbed by the load (or by an OTA download started alongside).
+
+With --wifi-ps, the load run is repeated under each Wi-Fi power save
+profile in turn (wifi-ps= on /mc_ctrl), and the profile the unit had before
+is put back at the end. Use a single client and a pause between requests
+(--pause longer than the DTIM period, e.g. 0.5) so that the unit is back
+asleep when each request arrives; back to back requests keep it awake and
+hide the power save latency:
+    tools/http_bench.py 192.168.29.9 --wifi-ps --clients 1 --pause 0.5
+"""
+
+import argparse
+import http.client
+import json
+import sys
+import threading
+import time
+
+
+def parse_target(target):
+    host, _, port = target.partition(":")
+    return host, int(port) if port else 80
+
+
+def get_stats(host, port, timeout):
+    """Fetch /mc_stats and return it as a dict of ints (empty on failure)."""
+    try:
+        conn = http.client.HTTPConnection(host, port, timeout=timeout)
+        conn.request("GET", "/mc_stats")
+        body = conn.getresponse().read().decode(errors="replace")
+        conn.close()
+    except (OSError, http.client.HTTPException):
+        return {}
+    stats = {}
+    for line in body.splitlines():
+        name, sep, value = line.partition("=")
+        if not sep:
+            continue
+        try:
+            stats[name] = int(value)
+        except ValueError:
+            stats[name] = value
+    return stats
+
+
+def get_version(host, port, timeout):
+    try:
+        conn = http.client.HTTPConnection(host, port, timeout=timeout)
+        conn.request("GET", "/mc_version_info")
+        body = conn.getresponse().read().decode(errors="replace")
+        conn.close()
+    except (OSError, http.client.HTTPException):
+        return None
+    for line in body.splitlines():
+        if line.startswith("Running version: "):
+            return line[len("Running version: "):]
+    return None
+
+
+def post_ctrl(host, port, body, timeout):
+    """POST a command to /mc_ctrl; returns False on failure."""
+    try:
+        conn = http.client.HTTPConnection(host, port, timeout=timeout)
+        conn.request("POST", "/mc_ctrl", body=body)
+        ok = conn.getresponse().status == 200
+        conn.close()
+    except (OSError, http.client.HTTPException):
+        return False
+    return ok
+
+
+def reset_jitter(host, port, timeout):
+    """Reset the tank loop jitter counters; returns False on failure."""
+    return post_ctrl(host, port, "jitter=reset", timeout)
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return None
+    index = min(len(sorted_values) - 1,
+                int(round(pct / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+class Client(threading.Thread):
+    """One keep-alive connection issuing requests back to back."""
+
+    def __init__(self, host, port, requests, deadline, timeout, pause):
+        super().__init__(daemon=True)
+        self.host = host
+        self.port = port
+        self.requests = requests
+        self.deadline = deadline
+        self.timeout = timeout
+        self.pause = pause
+        self.latencies = {path: [] for _, path, _ in requests}
+        self.errors = {path: 0 for _, path, _ in requests}
+        self.reconnects = 0
+
+    def run(self):
+        conn = None
+        i = 0
+        while time.monotonic() < self.deadline:
+            method, path, body = self.requests[i % len(self.requests)]
+            i += 1
+            if conn is None:
+                conn = http.client.HTTPConnection(self.host, self.port,
+                                                  timeout=self.timeout)
+            headers = {"Connection": "keep-alive"}
+            if body is not None:
+                headers["Content-Type"] = "application/x-www-form-urlencoded"
+            start = time.perf_counter()
+            try:
+                conn.request(method, path, body=body, headers=headers)
+                response = conn.getresponse()
+                response.read()
+                elapsed = time.perf_counter() - start
+                if response.status != 200:
+                    self.errors[path] += 1
+                else:
+                    self.latencies[path].append(elapsed)
+                if response.will_close:
+                    conn.close()
+                    conn = None
+                    self.reconnects += 1
+            except (OSError, http.client.HTTPException):
+                self.errors[path] += 1
+                conn.close()
+                conn = None
+                self.reconnects += 1
+                time.sleep(0.05)
+            if self.pause:
+                time.sleep(self.pause)
+        if conn is not None:
+            conn.close()
+
+
+def run_load(host, port, requests, clients, duration, timeout, pause=0.0):
+    deadline = time.monotonic() + duration
+    workers = [Client(host, port, requests, deadline, timeout, pause)
+               for _ in range(clients)]
+    started = time.monotonic()
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    elapsed = time.monotonic() - started
+
+    endpoints = {}
+    for _, path, _ in requests:
+        latencies = sorted(l for w in workers for l in w.latencies[path])
+        errors = sum(w.errors[path] for w in workers)
+        endpoints[path] = {
+            "requests": len(latencies),
+            "errors": errors,
+            "throughput_rps": round(len(latencies) / elapsed, 2),
+            "latency_ms": {
+                "min": ms(latencies[0] if latencies else None),
+                "p50": ms(percentile(latencies, 50)),
+                "p99": ms(percentile(latencies, 99)),
+                "max": ms(latencies[-1] if latencies else None),
+            },
+        }
+    total = sum(e["requests"] for e in endpoints.values())
+    return {
+        "elapsed_s": round(elapsed, 3),
+        "throughput_rps": round(total / elapsed, 2),
+        "reconnects": sum(w.reconnects for w in workers),
+        "endpoints": endpoints,
+    }
+
+
+def ms(seconds):
+    return None if seconds is None else round(seconds * 1000.0, 3)
+
+
+def run_wifi_ps(host, port, requests, args):
+    """The load run under each power save profile. Returns the results by
+    profile, and puts the unit's own profile back afterwards."""
+    saved = get_stats(host, port, args.timeout).get("wifi_ps_profile")
+    results = {}
+    try:
+        for profile in args.wifi_ps_profiles.split(","):
+            if not post_ctrl(host, port, "wifi-ps=" + profile, args.timeout):
+                results[profile] = {"error": "unable to select the profile"}
+                continue
+            time.sleep(args.settle)
+            results[profile] = run_load(host, port, requests, args.clients,
+                                        args.duration, args.timeout,
+                                        args.pause)
+            results[profile]["wifi_ps"] = get_stats(
+                host, port, args.timeout).get("wifi_ps")
+    finally:
+        if saved and not post_ctrl(host, port, "wifi-ps=" + saved,
+                                   args.timeout):
+            print("warning: unable to restore power save profile %s" % saved,
+                  file=sys.stderr)
+    return results
+
+
+def probe_sockets(host, port, limit, timeout):
+    """Open up to `limit` connections, keep them all open, and check how many
+    of them the server actually serves. Returns the number that succeeded and
+    what happened to the first one that did not."""
+    conns = []
+    served = 0
+    failure = None
+    try:
+        for _ in range(limit):
+            conn = http.client.HTTPConnection(host, port, timeout=timeout)
+            conns.append(conn)
+            try:
+                conn.request("GET", "/mc_status",
+                             headers={"Connection": "keep-alive"})
+                conn.getresponse().read()
+                served += 1
+            except (OSError, http.client.HTTPException) as exc:
+                failure = type(exc).__name__
+                break
+        # Check whether the oldest sockets were purged to make room
+        purged = 0
+        for conn in conns[:served]:
+            try:
+                conn.request("GET", "/mc_status",
+                             headers={"Connection": "keep-alive"})
+                conn.getresponse().read()
+            except (OSError, http.client.HTTPException):
+                purged += 1
+    finally:
+        for conn in conns:
+            conn.close()
+    return {"attempted": len(conns), "served": served,
+            "first_failure": failure, "purged": purged}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("target", help="host[:port] of the mc unit")
+    parser.add_argument("--clients", type=int, default=4,
+                        help="concurrent keep-alive clients (default 4)")
+    parser.add_argument("--duration", type=float, default=10.0,
+                        help="load duration in seconds (default 10)")
+    parser.add_argument("--endpoint", action="append", default=None,
+                        help="GET endpoint to load (repeatable, default "
+                        "/mc_status and /mc_version_info)")
+    parser.add_argument("--ctrl-body", default=None,
+                        help="also POST this body to /mc_ctrl")
+    parser.add_argument("--socket-probe", type=int, default=16,
+                        help="max sockets to open in the exhaustion probe "
+                        "(0 to skip, default 16)")
+    parser.add_argument("--jitter", action="store_true",
+                        help="measure the tank loop wakeup jitter over the "
+                        "load run")
+    parser.add_argument("--pause", type=float, default=0.0,
+                        help="seconds each client waits between requests")
+    parser.add_argument("--wifi-ps", action="store_true",
+                        help="repeat the load run under each Wi-Fi power "
+                        "save profile")
+    parser.add_argument("--wifi-ps-profiles", default="none,min,max",
+                        help="profiles for --wifi-ps (default none,min,max)")
+    parser.add_argument("--settle", type=float, default=2.0,
+                        help="seconds to wait after switching the power save "
+                        "profile (default 2)")
+    parser.add_argument("--timeout", type=float, default=5.0,
+                        help="per-request timeout in seconds")
+    parser.add_argument("-o", "--output", default=None,
+                        help="write the JSON result here instead of stdout")
+    args = parser.parse_args()
+
+    host, port = parse_target(args.target)
+    requests = [("GET", path, None)
+                for path in (args.endpoint or ["/mc_status",
+                                               "/mc_version_info"])]
+    if args.ctrl_body is not None:
+        requests.append(("POST", "/mc_ctrl", args.ctrl_body))
+
+    result = {
+        "target": "%s:%d" % (host, port),
+        "timestamp": int(time.time()),
+        "firmware_version": get_version(host, port, args.timeout),
+        "clients": args.clients,
+        "stats_before": get_stats(host, port, args.timeout),
+    }
+    if args.jitter and not reset_jitter(host, port, args.timeout):
+        print("warning: unable to reset the jitter counters", file=sys.stderr)
+    if args.wifi_ps:
+        result["wifi_ps"] = run_wifi_ps(host, port, requests, args)
+    else:
+        result["load"] = run_load(host, port, requests, args.clients,
+                                  args.duration, args.timeout, args.pause)
+    if args.socket_probe > 0:
+        result["sockets"] = probe_sockets(host, port, args.socket_probe,
+                                          args.timeout)
+    result["stats_after"] = get_stats(host, port, args.timeout)
+
+    before = result["stats_before"]
+    after = result["stats_after"]
+    if "min_free_heap" in after:
+        result["heap"] = {
+            "min_free_heap": after["min_free_heap"],
+            "free_heap_delta": (after.get("free_heap", 0) -
+                                before.get("free_heap", 0)),
+            "largest_free_block": after.get("largest_free_block"),
+        }
+    if args.jitter and "tank_jitter_samples" in after:
+        result["tank_jitter"] = {
+            "samples": after["tank_jitter_samples"],
+            "min_us": after["tank_jitter_min_us"],
+            "max_us": after["tank_jitter_max_us"],
+            "spread_us": (after["tank_jitter_max_us"] -
+                          after["tank_jitter_min_us"]),
+        }
+    if "httpd_max_open_sockets" in after and "sockets" in result:
+        result["sockets"]["max_open_sockets"] = after["httpd_max_open_sockets"]
+
+    text = json.dumps(result, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,337 @@
+/* Run the active/standby protocol of the firmware (main/replica_fsm.c) as
+   two units talking over loopback UDP, through a set of failure scenarios,
+   and check that the two never drive the motor relay at once.
+
+   Build and run on the host:
+     cc -O2 -Wall -Imain -o replica_sim tools/replica_sim.c main/replica_fsm.c
+     ./replica_sim
+     ./replica_sim -p 47100 -b 500 -l 3000 -t 5000
+
+   -p is the first of the two UDP ports (the units use -p and -p + 1),
+   -b, -l and -t are the heartbeat, lease and takeover periods in ms (by
+   default a tenth of the firmware defaults, so that the run is short).
+   Unit 2's clock starts just short of the 32 bit wrap, unit 1's at 0, so
+   the run also shows that neither compares its clock with the other's.
+
+   For each scenario, the time it took for a unit to drive the relay again
+   is printed. The exit status is 1 if the two units could ever drive at
+   the same time, or a scenario did not end with exactly one of them able
+   to drive. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "replica_fsm.h"
+
+#define UNITS 2
+#define STEP_MS 5
+
+struct unit_t_ {
+  struct replica_fsm_t_ fsm;
+  int fd;
+  uint16_t port;
+  uint32_t clock_offset_ms;
+  bool up;
+  bool drop_out;		/* lose everything it sends */
+  uint32_t saved_term;		/* what the firmware keeps in NVS */
+};
+
+static struct unit_t_ units[UNITS];
+static struct replica_config_t_ config = { 0, 50, 300, 500 };
+static uint64_t start_ms;
+static unsigned int overlaps = 0;
+static unsigned int failures = 0;
+
+static uint64_t wall_ms (void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t unit_now (struct unit_t_ *unit) {
+  return (uint32_t) (wall_ms() - start_ms) + unit->clock_offset_ms;
+}
+
+static void usage (char const *prog) {
+  fprintf(stderr, "usage: %s [-p port] [-b heartbeat_ms] [-l lease_ms] [-t takeover_ms]\n",
+	  prog);
+  exit(2);
+}
+
+static int open_socket (uint16_t port) {
+  struct sockaddr_in addr;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    exit(2);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "bind to port %u: %s\n", port, strerror(errno));
+    exit(2);
+  }
+  return fd;
+}
+
+static void boot (int i) {
+  struct unit_t_ *unit = &units[i];
+  struct replica_config_t_ unit_config = config;
+  char buf[REPLICA_MSG_MAX_SIZE];
+
+  /* What was sent to it while it was down is lost */
+  while (recv(unit->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+  }
+  unit_config.node_id = i + 1;
+  if (!replica_fsm_init(&unit->fsm, &unit_config, unit->saved_term, unit_now(unit))) {
+    fprintf(stderr, "bad configuration: heartbeat %u, lease %u, takeover %u ms\n",
+	    config.heartbeat_ms, config.lease_ms, config.takeover_ms);
+    exit(2);
+  }
+  unit->up = true;
+}
+
+static void report (int i, unsigned int events) {
+  struct replica_fsm_t_ *fsm = &units[i].fsm;
+  static char const *names[] = { "send", "takeover", "step down", "fence", "leased", "state" };
+  unsigned int bit;
+
+  for (bit = 1; bit < 6; bit++) {
+    if (events & (1 << bit)) {
+      printf("  %6lu ms  unit %d: %s (%s, term %u)\n",
+	     (unsigned long) (wall_ms() - start_ms), i + 1, names[bit],
+	     replica_role_name(fsm->role), (unsigned) fsm->term);
+    }
+  }
+}
+
+static void step_unit (int i) {
+  struct unit_t_ *unit = &units[i];
+  struct sockaddr_in peer;
+  unsigned char buf[REPLICA_MSG_MAX_SIZE + 1];
+  unsigned int events;
+  ssize_t n;
+  size_t len;
+
+  if (!unit->up) {
+    return;
+  }
+  events = 0;
+  while ((n = recv(unit->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    events |= replica_fsm_receive(&unit->fsm, buf, n, unit_now(unit));
+  }
+  events |= replica_fsm_tick(&unit->fsm, unit_now(unit), true);
+  if (unit->fsm.term != unit->saved_term) {
+    unit->saved_term = unit->fsm.term;
+  }
+  if (events & REPLICA_EVENT_SEND) {
+    len = replica_fsm_encode(&unit->fsm, buf, unit_now(unit));
+    if (!unit->drop_out) {
+      memset(&peer, 0, sizeof(peer));
+      peer.sin_family = AF_INET;
+      peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      peer.sin_port = htons(units[1 - i].port);
+      sendto(unit->fd, buf, len, 0, (struct sockaddr *) &peer, sizeof(peer));
+    }
+  }
+  report(i, events);
+}
+
+static int drivers (void) {
+  int i, n = 0;
+
+  for (i = 0; i < UNITS; i++) {
+    if (units[i].up && replica_fsm_may_drive(&units[i].fsm, unit_now(&units[i]))) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/* Run for `ms`, returns how long it took until a unit could drive (-1 if
+   none could at the end) */
+static long run (uint32_t ms) {
+  uint64_t until = wall_ms() + ms, from = wall_ms();
+  long driving_after = -1;
+  int i, n;
+
+  while (wall_ms() < until) {
+    for (i = 0; i < UNITS; i++) {
+      step_unit(i);
+    }
+    n = drivers();
+    if (n > 1) {
+      overlaps++;
+      printf("  %6lu ms  BOTH UNITS MAY DRIVE\n", (unsigned long) (wall_ms() - start_ms));
+    }
+    if ((n == 1) && (driving_after < 0)) {
+      driving_after = wall_ms() - from;
+    } else if (n == 0) {
+      driving_after = -1;
+    }
+    usleep(STEP_MS * 1000);
+  }
+  return driving_after;
+}
+
+static int driver (void) {
+  int i;
+
+  for (i = 0; i < UNITS; i++) {
+    if (units[i].up && replica_fsm_may_drive(&units[i].fsm, unit_now(&units[i]))) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void expect_one (char const *scenario, long driving_after) {
+  if (drivers() != 1) {
+    printf("FAIL %s: %d units may drive at the end\n", scenario, drivers());
+    failures++;
+  } else {
+    printf("ok   %s: unit %d drives, %ld ms into the scenario\n", scenario, driver() + 1,
+	   driving_after);
+  }
+}
+
+static void check_state (void) {
+  struct replica_state_t_ state;
+  int active = driver();
+  struct unit_t_ *standby;
+  int32_t skew;
+
+  if (active < 0) {
+    return;
+  }
+  standby = &units[1 - active];
+  memset(&state, 0, sizeof(state));
+  state.motor_running = true;
+  state.run_start_ms = unit_now(&units[active]) - 42000;
+  state.filter_readings = 0x2a5;
+  state.filter_index = 7;
+  state.filter_successive = 2;
+  state.fill.version = FILL_MODEL_VERSION;
+  state.fill.runs = 5;
+  state.fill.mean_s = 1234.5f;
+  state.fill.m2 = 678.25f;
+  replica_fsm_publish(&units[active].fsm, &state);
+  run(4 * config.heartbeat_ms);
+  /* The run start is in the standby's own clock, give or take the transit */
+  skew = (int32_t) ((unit_now(standby) - standby->fsm.state.run_start_ms) -
+		    (unit_now(&units[active]) - state.run_start_ms));
+  if (!standby->fsm.state.motor_running || (skew < -STEP_MS * 4) || (skew > STEP_MS * 4) ||
+      (standby->fsm.state.filter_readings != 0x2a5) ||
+      (standby->fsm.state.filter_index != 7) || (standby->fsm.state.filter_successive != 2) ||
+      (standby->fsm.state.fill.runs != 5) || (standby->fsm.state.fill.mean_s != 1234.5f) ||
+      (standby->fsm.state.fill.m2 != 678.25f) ||
+      (standby->fsm.version != units[active].fsm.version)) {
+    printf("FAIL state replication: standby has version %u, active %u\n",
+	   (unsigned) standby->fsm.version, (unsigned) units[active].fsm.version);
+    failures++;
+  } else {
+    printf("ok   state replication: run age off by %ld ms\n", (long) skew);
+  }
+}
+
+int main (int argc, char **argv) {
+  uint16_t port = 47100;
+  uint32_t scenario_ms;
+  int opt, active;
+
+  while ((opt = getopt(argc, argv, "p:b:l:t:")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'b':
+      config.heartbeat_ms = atoi(optarg);
+      break;
+    case 'l':
+      config.lease_ms = atoi(optarg);
+      break;
+    case 't':
+      config.takeover_ms = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc) {
+    usage(argv[0]);
+  }
+  scenario_ms = 3 * config.takeover_ms;
+
+  start_ms = wall_ms();
+  units[0].port = port;
+  units[1].port = port + 1;
+  units[1].clock_offset_ms = 0xffffffff - config.takeover_ms;
+  units[0].fd = open_socket(units[0].port);
+  units[1].fd = open_socket(units[1].port);
+
+  printf("both units boot\n");
+  boot(0);
+  boot(1);
+  expect_one("boot", run(scenario_ms));
+  check_state();
+
+  printf("the active unit dies\n");
+  active = driver();
+  if (active >= 0) {
+    units[active].up = false;
+    expect_one("failover", run(scenario_ms));
+    printf("it comes back\n");
+    boot(active);
+    expect_one("rejoin", run(scenario_ms));
+  }
+
+  printf("the network between them fails both ways\n");
+  units[0].drop_out = units[1].drop_out = true;
+  run(scenario_ms);
+  printf("  (units that may drive during the partition: %d)\n", drivers());
+  units[0].drop_out = units[1].drop_out = false;
+  printf("it comes back\n");
+  expect_one("partition", run(scenario_ms));
+
+  printf("the active unit stops being heard\n");
+  active = driver();
+  if (active >= 0) {
+    units[active].drop_out = true;
+    run(scenario_ms);
+    units[active].drop_out = false;
+    expect_one("one way loss", run(scenario_ms));
+  }
+
+  printf("the standby unit stops being heard\n");
+  active = driver();
+  if (active >= 0) {
+    units[1 - active].drop_out = true;
+    run(scenario_ms);
+    units[1 - active].drop_out = false;
+    expect_one("standby loss", run(scenario_ms));
+  }
+
+  printf("the standby unit dies and comes back\n");
+  active = driver();
+  if (active >= 0) {
+    units[1 - active].up = false;
+    run(scenario_ms);
+    printf("  (units that may drive: %d)\n", drivers());
+    boot(1 - active);
+    expect_one("standby restart", run(scenario_ms));
+  }
+
+  printf("%u overlaps, %u failures\n", overlaps, failures);
+  return (overlaps || failures) ? 1 : 0;
+}
@@ -0,0 +1,304 @@
+/* Replay recorded sensor traces (/mc_sensor_trace) through the tank-full
+   filter of the firmware (main/tank_filter.c), under one or more filter
+   configurations, and report when each of them would have beeped and turned
+   the motor off.
+
+   Build and run on the host:
+     cc -O2 -Wall -Imain -o tank_replay tools/tank_replay.c main/tank_filter.c
+     ./tank_replay traces/
+     ./tank_replay -c 10,4,4,5 -c 8,3,4,5 traces/ extra.mcst
+
+   -c window,threshold,beep_after,motor_off_after adds a configuration; the
+   first one is the reference (the firmware default if no -c is given). For
+   each motor run in each trace, the time from the first full reading to the
+   motor-off decision (the decision latency) is printed for every
+   configuration. A run in which a configuration decides differently from the
+   reference (motor-off or not, or at a different reading) is a disagreement.
+   The exit status is 1 if there were any, so that a directory of traces can
+   serve as a regression check of filter changes.
+
+   Note that a trace only goes as far as the motor actually ran: once the
+   firmware turned the motor off, there are no readings to show what a
+   slower configuration would have done. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "tank_filter.h"
+
+#define MAX_CONFIGS 8
+
+struct run_result_t_ {
+  long first_full_ms;		/* -1 if no full reading */
+  long beep_ms;			/* -1 if no beep */
+  long motor_off_ms;		/* -1 if no motor-off */
+  unsigned int motor_off_reading; /* reading number of the motor-off */
+};
+
+struct config_stats_t_ {
+  unsigned int runs;
+  unsigned int motor_offs;
+  unsigned int disagreements;
+  long latency_total_ms;
+  long latency_max_ms;
+};
+
+static struct tank_filter_config_t_ configs[MAX_CONFIGS];
+static struct config_stats_t_ stats[MAX_CONFIGS];
+static int num_configs = 0;
+static unsigned int traces = 0;
+
+static void usage (char const *prog) {
+  fprintf(stderr, "usage: %s [-c window,threshold,beep_after,motor_off_after]... "
+	  "<trace.mcst | directory>...\n", prog);
+  exit(2);
+}
+
+static uint16_t le16 (unsigned char const *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32 (unsigned char const *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void print_result (struct run_result_t_ const *r) {
+  if (r->motor_off_ms < 0) {
+    printf(" %16s", "no motor-off");
+  } else if (r->first_full_ms < 0) {
+    printf(" %16s", "motor-off");
+  } else {
+    printf(" %13.1fs  ", (r->motor_off_ms - r->first_full_ms) / 1000.0);
+  }
+}
+
+/* One motor run of a trace, replayed under every configuration */
+static void replay_run (char const *name, unsigned int run, uint16_t const *records,
+			size_t count, long start_ms, unsigned int tick_ms) {
+  struct tank_filter_t_ filter;
+  struct run_result_t_ results[MAX_CONFIGS];
+  unsigned int actions, reading;
+  long now_ms;
+  size_t i;
+  int c;
+  bool full, disagreement = false;
+
+  for (c = 0; c < num_configs; c++) {
+    struct run_result_t_ *r = &results[c];
+
+    r->first_full_ms = r->beep_ms = r->motor_off_ms = -1;
+    r->motor_off_reading = 0;
+    tank_filter_init(&filter, &configs[c]);
+    now_ms = start_ms;
+    for (i = 0, reading = 1; i < count; i++, reading++) {
+      if (i > 0) {
+	now_ms += (records[i] & SENSOR_TRACE_DELTA_MASK) * tick_ms;
+      }
+      full = (records[i] & SENSOR_TRACE_LEVEL_FULL) != 0;
+      if (full && (r->first_full_ms < 0)) {
+	r->first_full_ms = now_ms;
+      }
+      actions = tank_filter_sample(&filter, full);
+      if ((actions & TANK_FILTER_BEEP) && (r->beep_ms < 0)) {
+	r->beep_ms = now_ms;
+      }
+      if ((actions & TANK_FILTER_MOTOR_OFF) && (r->motor_off_ms < 0)) {
+	r->motor_off_ms = now_ms;
+	r->motor_off_reading = reading;
+      }
+    }
+
+    stats[c].runs++;
+    if (r->motor_off_ms >= 0) {
+      stats[c].motor_offs++;
+      if (r->first_full_ms >= 0) {
+	stats[c].latency_total_ms += r->motor_off_ms - r->first_full_ms;
+	if (r->motor_off_ms - r->first_full_ms > stats[c].latency_max_ms) {
+	  stats[c].latency_max_ms = r->motor_off_ms - r->first_full_ms;
+	}
+      }
+    }
+    if ((c > 0) && (r->motor_off_reading != results[0].motor_off_reading)) {
+      stats[c].disagreements++;
+      disagreement = true;
+    }
+  }
+
+  printf("%-32s %4u %6zu", name, run, count);
+  for (c = 0; c < num_configs; c++) {
+    print_result(&results[c]);
+  }
+  printf("%s\n", disagreement ? "  DISAGREE" : "");
+}
+
+static void replay_file (char const *path) {
+  FILE *f;
+  unsigned char header[sizeof(struct sensor_trace_header_t_)];
+  uint16_t *records;
+  unsigned char raw[2];
+  size_t count, i, run_start;
+  unsigned int run = 0, tick_ms;
+  long now_ms, run_start_ms = 0;
+  char const *name;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return;
+  }
+  if ((fread(header, sizeof(header), 1, f) != 1) ||
+      (memcmp(header, SENSOR_TRACE_MAGIC, 4) != 0) ||
+      (header[4] != SENSOR_TRACE_VERSION)) {
+    fprintf(stderr, "%s: not a version %d sensor trace\n", path, SENSOR_TRACE_VERSION);
+    fclose(f);
+    return;
+  }
+  tick_ms = header[5];
+  count = le16(&header[6]);
+  now_ms = le32(&header[8]);
+
+  records = malloc((count + 1) * sizeof(uint16_t));
+  if (!records) {
+    fclose(f);
+    return;
+  }
+  for (i = 0; i < count; i++) {
+    if (fread(raw, sizeof(raw), 1, f) != 1) {
+      fprintf(stderr, "%s: truncated after %zu of %zu records\n", path, i, count);
+      break;
+    }
+    records[i] = le16(raw);
+  }
+  count = i;
+  fclose(f);
+  traces++;
+
+  name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+  /* Split the trace into motor runs: a run is the readings between two
+     motor-stopped records */
+  run_start = 0;
+  for (i = 0; i <= count; i++) {
+    if (i < count) {
+      now_ms += (records[i] & SENSOR_TRACE_DELTA_MASK) * tick_ms;
+      if (i == run_start) {
+	run_start_ms = now_ms;
+      }
+    }
+    if ((i == count) || !(records[i] & SENSOR_TRACE_MOTOR_RUNNING)) {
+      if (i > run_start) {
+	replay_run(name, ++run, &records[run_start], i - run_start, run_start_ms, tick_ms);
+      }
+      run_start = i + 1;
+    }
+  }
+  free(records);
+}
+
+static int ends_with (char const *s, char const *suffix) {
+  size_t len = strlen(s), suffix_len = strlen(suffix);
+
+  return (len >= suffix_len) && (strcmp(s + len - suffix_len, suffix) == 0);
+}
+
+static int compare_names (void const *a, void const *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void replay_path (char const *path) {
+  struct stat st;
+  DIR *dir;
+  struct dirent *entry;
+  char **names = NULL, *full;
+  size_t num_names = 0, i;
+
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    replay_file(path);
+    return;
+  }
+
+  /* The *.mcst files of a directory, in name order */
+  dir = opendir(path);
+  if (!dir) {
+    perror(path);
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (!ends_with(entry->d_name, ".mcst")) {
+      continue;
+    }
+    full = malloc(strlen(path) + strlen(entry->d_name) + 2);
+    names = realloc(names, (num_names + 1) * sizeof(*names));
+    if (!full || !names) {
+      break;
+    }
+    sprintf(full, "%s/%s", path, entry->d_name);
+    names[num_names++] = full;
+  }
+  closedir(dir);
+
+  qsort(names, num_names, sizeof(*names), compare_names);
+  for (i = 0; i < num_names; i++) {
+    replay_file(names[i]);
+    free(names[i]);
+  }
+  free(names);
+}
+
+int main (int argc, char **argv) {
+  struct tank_filter_config_t_ default_config = TANK_FILTER_DEFAULT_CONFIG;
+  struct tank_filter_t_ check;
+  unsigned int disagreements = 0;
+  int i, c;
+
+  for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+    if ((strcmp(argv[i], "-c") != 0) || (i + 1 == argc) || (num_configs == MAX_CONFIGS)) {
+      usage(argv[0]);
+    }
+    i++;
+    if ((sscanf(argv[i], "%u,%u,%u,%u", &configs[num_configs].window,
+		&configs[num_configs].threshold, &configs[num_configs].beep_after,
+		&configs[num_configs].motor_off_after) != 4) ||
+	!tank_filter_init(&check, &configs[num_configs])) {
+      fprintf(stderr, "bad configuration \"%s\"\n", argv[i]);
+      usage(argv[0]);
+    }
+    num_configs++;
+  }
+  if (i == argc) {
+    usage(argv[0]);
+  }
+  if (num_configs == 0) {
+    configs[num_configs++] = default_config;
+  }
+
+  printf("%-32s %4s %6s", "trace", "run", "reads");
+  for (c = 0; c < num_configs; c++) {
+    printf("  %2u/%-2u b%-2u m%-2u%s", configs[c].threshold, configs[c].window,
+	   configs[c].beep_after, configs[c].motor_off_after, c ? " " : "*");
+  }
+  printf("\n");
+
+  for (; i < argc; i++) {
+    replay_path(argv[i]);
+  }
+
+  printf("\n%u traces. Motor-off latency is from the first full reading; "
+	 "* is the reference.\n", traces);
+  for (c = 0; c < num_configs; c++) {
+    printf("config %u/%u b%u m%u: %u runs, %u motor-offs, latency mean %.1fs "
+	   "max %.1fs, %u disagreements\n",
+	   configs[c].threshold, configs[c].window, configs[c].beep_after,
+	   configs[c].motor_off_after, stats[c].runs, stats[c].motor_offs,
+	   stats[c].motor_offs ? stats[c].latency_total_ms / 1000.0 / stats[c].motor_offs : 0.0,
+	   stats[c].latency_max_ms / 1000.0, stats[c].disagreements);
+    disagreements += stats[c].disagreements;
+  }
+  return disagreements ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""Convert an /mc_trace export into Chrome trace JSON.
+
+The firmware has to be built with CONFIG_WLM_TRACE. Load the output in
+chrome://tracing or https://ui.perfetto.dev. Each core is a process and each
+task a thread. Every record is an instant event. Queue sends are joined to
+their receives with flow arrows, so that the path of e.g. a `motor=on` from
+the HTTP worker through motor_on_off_q to the MOTOR_OUT write and the
+EVENT_MOTOR_RUNNING change can be followed.
+
+Examples:
+    curl -s http://192.168.29.9/mc_trace > trace.txt
+    tools/trace2chrome.py trace.txt -o trace.json
+    curl -s http://192.168.29.9/mc_trace | tools/trace2chrome.py - -o trace.json
+"""
+
+import argparse
+import json
+import sys
+
+# Queue send event -> matching receive event
+FLOWS = {
+    "motor_q_send": "motor_q_recv",
+    "beep_q_send": "beep_q_recv",
+}
+
+GPIO_NAMES = {
+    27: "BEEP_OUT",
+    33: "ERR_STATUS_OUT",
+    32: "MOTOR_OUT",
+    13: "WATER_LEVEL_ENABLE_OUT",
+    4: "MOTOR_RUNNING_SENSE_IN",
+    39: "WATER_LEVEL_IN",
+}
+
+
+def parse(lines):
+    header = {}
+    events = {}
+    tasks = {}
+    records = []
+    for line in lines:
+        fields = line.split()
+        if not fields:
+            continue
+        if fields[0] == "r" and len(fields) == 7:
+            records.append({
+                "core": int(fields[1]),
+                "cycles": int(fields[2]),
+                "ticks": int(fields[3]),
+                "task": fields[4],
+                "event": int(fields[5]),
+                "arg": int(fields[6]),
+            })
+        elif fields[0] == "event" and len(fields) == 3:
+            events[int(fields[1])] = fields[2]
+        elif fields[0] == "task" and len(fields) >= 3:
+            tasks[fields[1]] = " ".join(fields[2:])
+        elif "=" in fields[0]:
+            name, _, value = fields[0].partition("=")
+            header[name] = int(value)
+    return header, events, tasks, records
+
+
+def timestamps(records, ticks_per_us, tick_hz):
+    """Unwrap the 32-bit cycle counts of one core, using the tick count that
+    comes with each record, and return the time of each record in us."""
+    tick_us = 1000000.0 / tick_hz
+    wrap = 1 << 32
+    times = []
+    prev_cycles = prev_ticks = prev_us = None
+    for record in records:
+        if prev_cycles is None:
+            us = record["ticks"] * tick_us
+        else:
+            expected = (record["ticks"] - prev_ticks) * tick_us * ticks_per_us
+            delta = (record["cycles"] - prev_cycles) % wrap
+            # Add as many wraps as the tick count says have gone by
+            delta += round((expected - delta) / wrap) * wrap
+            us = prev_us + delta / float(ticks_per_us)
+        prev_cycles, prev_ticks, prev_us = record["cycles"], record["ticks"], us
+        times.append(us)
+    return times
+
+
+def describe(name, arg):
+    if name in ("gpio_write", "gpio_read"):
+        pin = arg >> 8
+        return {"pin": GPIO_NAMES.get(pin, pin), "level": arg & 0xff}
+    if name in ("event_set", "event_clear"):
+        return {"bits": "0x%x" % arg}
+    return {"state": arg}
+
+
+def convert(header, events, tasks, records):
+    ticks_per_us = header.get("cpu_ticks_per_us", 160)
+    tick_hz = header.get("tick_hz", 100)
+    out = []
+    tids = {}
+    for core in sorted({r["core"] for r in records}):
+        core_records = [r for r in records if r["core"] == core]
+        out.append({"name": "process_name", "ph": "M", "pid": core,
+                    "args": {"name": "core %d" % core}})
+        for record, us in zip(core_records,
+                              timestamps(core_records, ticks_per_us, tick_hz)):
+            record["ts"] = us
+
+    for record in records:
+        key = (record["core"], record["task"])
+        if key not in tids:
+            tids[key] = len(tids) + 1
+            out.append({"name": "thread_name", "ph": "M",
+                        "pid": record["core"], "tid": tids[key],
+                        "args": {"name": tasks.get(record["task"],
+                                                   record["task"])}})
+
+    pending = {}
+    flow_id = 0
+    for record in sorted(records, key=lambda r: r["ts"]):
+        name = events.get(record["event"], str(record["event"]))
+        event = {
+            "name": name,
+            "ph": "i",
+            "s": "t",
+            "ts": round(record["ts"], 3),
+            "pid": record["core"],
+            "tid": tids[(record["core"], record["task"])],
+            "args": describe(name, record["arg"]),
+        }
+        out.append(event)
+        if name in FLOWS:
+            flow_id += 1
+            pending.setdefault(FLOWS[name], []).append(flow_id)
+            out.append(dict(event, ph="s", id=flow_id, name="queue",
+                            cat="queue"))
+        elif pending.get(name):
+            out.append(dict(event, ph="f", bp="e", id=pending[name].pop(0),
+                            name="queue", cat="queue"))
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", help="/mc_trace export, or - for stdin")
+    parser.add_argument("-o", "--output", default=None,
+                        help="write the JSON here instead of stdout")
+    args = parser.parse_args()
+
+    if args.input == "-":
+        lines = sys.stdin.read().splitlines()
+    else:
+        with open(args.input) as f:
+            lines = f.read().splitlines()
+    header, events, tasks, records = parse(lines)
+    if not records:
+        print("no trace records in the input", file=sys.stderr)
+        return 1
+
+    text = json.dumps(convert(header, events, tasks, records))
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())